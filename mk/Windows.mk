@@ -34,4 +34,9 @@ define rmdir
 rd /S /Q $(call path,$1)
 endef
 
+# Runs the command, and fails unless it exits with status 1
+define exits_1
+$1 & if errorlevel 2 (exit 1) else if errorlevel 1 (exit 0) else (exit 1)
+endef
+
 #/Fe:"$(call slashes,$1)"
\ No newline at end of file
@@ -1,5 +1,88 @@
-
 #include "ast.h"
+#include "scanner.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define RESERVE(array, count, capacity, needed) \
+	if ((count) + (needed) > (capacity)) { \
+		(capacity) = (capacity) ? 2 * (capacity) : 64; \
+		while ((count) + (needed) > (capacity)) \
+			(capacity) *= 2; \
+		(array) = realloc((array), (capacity) * sizeof(*(array))); \
+	}
+
+// Copied text goes in blocks that never move, since tokens point into them
+#define AST_TEXT_BLOCK 4096
+
+struct AstText {
+	AstText *Next;
+	size_t Used, Capacity;
+	u8 Bytes[];
+};
+
+Ast *Ast_New() {
+	Ast *ast = calloc(1, sizeof(Ast));
+	// the reserved entries: an empty node, an empty token, and an empty list
+	Ast_AddNode(ast, &(AstNode) { AstNode_None });
+	Ast_AddToken(ast, &TOKEN_EMPTY);
+	Ast_AddChildren(ast, &(u32) { 0 }, 1);
+	return ast;
+}
+
+void Ast_Release(Ast *ast) {
+	if (ast) {
+		free(ast->Nodes);
+		free(ast->Tokens);
+		free(ast->Children);
+		LineIndex_Release(&ast->Lines);
+		while (ast->Text) {
+			AstText *next = ast->Text->Next;
+			free(ast->Text);
+			ast->Text = next;
+		}
+		free(ast);
+	}
+}
+
+AstIndex Ast_AddNode(Ast *ast, const AstNode *node) {
+	RESERVE(ast->Nodes, ast->NumNodes, ast->NodeCapacity, 1);
+	ast->Nodes[ast->NumNodes] = *node;
+	return ast->NumNodes++;
+}
+
+u32 Ast_AddToken(Ast *ast, const Token *token) {
+	RESERVE(ast->Tokens, ast->NumTokens, ast->TokenCapacity, 1);
+	ast->Tokens[ast->NumTokens] = *token;
+	return ast->NumTokens++;
+}
 
+u32 Ast_AddChildren(Ast *ast, const u32 *values, u32 count) {
+	RESERVE(ast->Children, ast->NumChildren, ast->ChildCapacity, count);
+	u32 first = ast->NumChildren;
+	for (u32 i = 0; i < count; i++)
+		ast->Children[first + i] = values[i];
+	ast->NumChildren += count;
+	return first;
+}
 
+String Ast_CopyText(Ast *ast, const String *text) {
+	AstText *block = ast->Text;
+	if (block == NULL || block->Capacity - block->Used < text->Length) {
+		size_t capacity = text->Length > AST_TEXT_BLOCK ? text->Length : AST_TEXT_BLOCK;
+		block = malloc(sizeof(AstText) + capacity);
+		block->Next = ast->Text;
+		block->Used = 0;
+		block->Capacity = capacity;
+		ast->Text = block;
+	}
+	String copy = { block->Bytes + block->Used, text->Length };
+	memcpy(copy.Bytes, text->Bytes, text->Length);
+	block->Used += text->Length;
+	return copy;
+}
 
+SourcePosition Ast_Position(const Ast *ast, const Token *token) {
+	// the line index is only a cache, filled in the first time it's needed
+	return LineIndex_Find((LineIndex *) &ast->Lines, token->Pos);
+}
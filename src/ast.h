@@ -2,15 +2,48 @@
 
 #include "token.h"
 
-#define AST_CAST(T,node) ((T *) (node))
+// A parsed program lives in one Ast: its nodes, the tokens they refer to and
+// their child lists are each a single array, and nodes refer to each other by
+// index. Entry 0 of each array is reserved, so 0 (AST_NONE) means "none"
+// everywhere. The whole tree goes away with Ast_Release.
+//
+// Every node has a main token and two operands whose meaning depends on its
+// type:
+//
+//   Type          Token        Lhs              Rhs
+//   Block         -            statement list   -
+//   Function      name         parameter list   extra: return type token, body,
+//                                               locals*, slot*
+//   Declaration   name         type token       -
+//   If            -            condition        extra: true branch, false branch
+//   Return        -            expression       -
+//   FunctionCall  -            function         argument list
+//   Expression    operator     left operand     right operand
+//   Identifier    identifier   depth*           slot*
+//   Literal       literal      -                -
+//
+// A list is an index into Children holding its length followed by its items;
+// an extra is an index into Children holding the listed fields in order.
+// Fields marked * are filled in by the resolver (see resolver.h): a depth is
+// the number of enclosing functions out the name was bound, or AST_GLOBAL.
 
-#define AST_FOREACH(var,node,func) \
+typedef u32 AstIndex;
+
+#define AST_NONE 0
+#define AST_GLOBAL UINT32_MAX
+
+#define AST_NODE(ast, i) (&(ast)->Nodes[i])
+#define AST_TOKEN(ast, i) (&(ast)->Tokens[i])
+#define AST_EXTRA(ast, node, k) ((ast)->Children[(node)->Rhs + (k)])
+#define AST_LIST_LENGTH(ast, list) ((ast)->Children[list])
+#define AST_LIST_ITEM(ast, list, k) ((ast)->Children[(list) + 1 + (k)])
+
+#define AST_FOREACH(var,ast,list,func) \
 	do { \
-		AstNode *var = node; \
-		while (var) { \
-			AstNode *next = var->Right; \
+		u32 _count = AST_LIST_LENGTH(ast, list); \
+		for (u32 _k = 0; _k < _count; _k++) { \
+			AstIndex var = AST_LIST_ITEM(ast, list, _k); \
 			(func); \
-			var = next; \
 		} \
 	}  while (0)
 
@@ -30,59 +63,38 @@ typedef enum  {
 
 typedef struct AstNode {
 	AstNodeType Type;
-	struct AstNode *Left, *Right;
+	u32 Token;
+	AstIndex Lhs, Rhs;
 } AstNode;
 
-typedef struct AstIfNode {
-	AstNode Base;
-	AstNode *Condition;
-	AstNode *TrueBranch, *FalseBranch;
-} AstIfNode;
-
-typedef struct AstIdentifierNode {
-	AstNode Base;
-	Token Token;
-} AstIdentifierNode;
-
-typedef struct AstLiteralNode {
-	AstNode Base;
-	Token Token;
-} AstLiteralNode;
-
-typedef struct AstExpressionNode {
-	AstNode Base;
-	Token Operator;
-} AstExpressionNode;
-
-typedef struct AstReturnNode {
-	AstNode Base;
-	AstExpressionNode *Expression;
-} AstReturnNode;
-
-typedef struct AstBlockNode {
-	AstNode Base;
-	AstNode *Statements;
-} AstBlockNode;
-
-typedef struct AstDeclarationNode {
-	AstNode Base;
-	Token Identifier, Type;
-} AstDeclarationNode;
-
-typedef struct AstFunctionNode {
-	AstNode Base;
-	Token Identifier, ReturnType;
-	AstDeclarationNode *Parameters;
-	AstBlockNode *Body;
-} AstFunctionNode;
-
-typedef struct AstFunctionCallNode {
-	AstNode Base;
-	AstNode *Function;
-	AstNode *Arguments;
-} AstFunctionCallNode;
-
-typedef struct AstModuleNode {
-	AstNode Base;
-	AstNode *Statements;
-} AstModuleNode;
\ No newline at end of file
+typedef struct AstText AstText;
+
+typedef struct Ast {
+	AstNode *Nodes;
+	Token *Tokens;
+	u32 *Children;
+	u32 NumNodes, NumTokens, NumChildren;
+	u32 NodeCapacity, TokenCapacity, ChildCapacity;
+	AstIndex Root;
+	u32 NumGlobals;
+	LineIndex Lines; // of the source the tokens point into
+	AstText *Text; // copies of token text, see Ast_CopyText
+} Ast;
+
+Ast *Ast_New();
+
+void Ast_Release(Ast *);
+
+AstIndex Ast_AddNode(Ast *, const AstNode *);
+
+u32 Ast_AddToken(Ast *, const Token *);
+
+// Appends count entries to Children and returns the index of the first
+u32 Ast_AddChildren(Ast *, const u32 *values, u32 count);
+
+// Copies the text into the tree, for tokens whose source doesn't outlive the
+// scanner. The copy lasts until Ast_Release.
+String Ast_CopyText(Ast *, const String *);
+
+// Where the token is in the source, for messages
+SourcePosition Ast_Position(const Ast *, const Token *);
@@ -0,0 +1,127 @@
+#include "atom.h"
+#include "trace.h"
+
+#include <stdlib.h>
+
+// Entries live in pages that are allocated once and never move, found through
+// a directory of fixed size, so an atom's entry stays put as the table grows.
+// The hash table maps hashes to atoms with linear probing and is rebuilt
+// larger under the exclusive lock.
+
+#define ATOM_PAGE_BITS 10
+#define ATOM_PAGE_SIZE (1 << ATOM_PAGE_BITS)
+#define ATOM_MAX_PAGES 1024
+
+#ifdef _WIN32
+typedef struct { void *Ptr; } SRWLOCK;
+extern void AcquireSRWLockShared(SRWLOCK *);
+extern void ReleaseSRWLockShared(SRWLOCK *);
+extern void AcquireSRWLockExclusive(SRWLOCK *);
+extern void ReleaseSRWLockExclusive(SRWLOCK *);
+static SRWLOCK Lock;
+#define READ_LOCK() AcquireSRWLockShared(&Lock)
+#define READ_UNLOCK() ReleaseSRWLockShared(&Lock)
+#define WRITE_LOCK() AcquireSRWLockExclusive(&Lock)
+#define WRITE_UNLOCK() ReleaseSRWLockExclusive(&Lock)
+#else
+#include <pthread.h>
+static pthread_rwlock_t Lock = PTHREAD_RWLOCK_INITIALIZER;
+#define READ_LOCK() pthread_rwlock_rdlock(&Lock)
+#define READ_UNLOCK() pthread_rwlock_unlock(&Lock)
+#define WRITE_LOCK() pthread_rwlock_wrlock(&Lock)
+#define WRITE_UNLOCK() pthread_rwlock_unlock(&Lock)
+#endif
+
+typedef struct AtomEntry {
+	String Name;
+	u32 Hash;
+} AtomEntry;
+
+static AtomEntry *Pages[ATOM_MAX_PAGES];
+static u32 NumAtoms = 1; // atom 0 is ATOM_NONE
+static Atom *Slots; // 0 for an empty slot
+static u32 SlotMask;
+
+static AtomEntry *Entry(Atom atom) {
+	return &Pages[atom >> ATOM_PAGE_BITS][atom & (ATOM_PAGE_SIZE - 1)];
+}
+
+// FNV-1a
+u32 Atom_HashBytes(const u8 *bytes, size_t length) {
+	u32 hash = 2166136261u;
+	for (size_t i = 0; i < length; i++)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	return hash;
+}
+
+// Returns the slot holding the name, or the empty slot where it would go
+static Atom *Probe(const String *name, u32 hash) {
+	for (u32 i = hash & SlotMask;; i = (i + 1) & SlotMask) {
+		Atom atom = Slots[i];
+		if (atom == ATOM_NONE)
+			return &Slots[i];
+		const AtomEntry *entry = Entry(atom);
+		if (entry->Hash == hash && String_Equals(&entry->Name, name))
+			return &Slots[i];
+	}
+}
+
+static void Rehash(u32 capacity) {
+	Atom *old = Slots;
+	u32 oldCapacity = Slots ? SlotMask + 1 : 0;
+	Slots = calloc(capacity, sizeof(Atom));
+	SlotMask = capacity - 1;
+	for (u32 i = 0; i < oldCapacity; i++) {
+		if (old[i] != ATOM_NONE) {
+			const AtomEntry *entry = Entry(old[i]);
+			*Probe(&entry->Name, entry->Hash) = old[i];
+		}
+	}
+	free(old);
+}
+
+Atom Atom_Find(const String *name) {
+	u32 hash = Atom_HashBytes(name->Bytes, name->Length);
+	READ_LOCK();
+	Atom atom = Slots ? *Probe(name, hash) : ATOM_NONE;
+	READ_UNLOCK();
+	return atom;
+}
+
+Atom Atom_Intern(const String *name) {
+	Atom atom = Atom_Find(name);
+	if (atom != ATOM_NONE)
+		return atom;
+
+	u32 hash = Atom_HashBytes(name->Bytes, name->Length);
+	WRITE_LOCK();
+	// keep the table at most half full
+	if (Slots == NULL || 2 * NumAtoms > SlotMask + 1)
+		Rehash(Slots ? 2 * (SlotMask + 1) : 256);
+	// someone may have added it since we looked
+	Atom *slot = Probe(name, hash);
+	if (*slot == ATOM_NONE) {
+		if (NumAtoms == ATOM_MAX_PAGES * ATOM_PAGE_SIZE) {
+			WRITE_UNLOCK();
+			ERROR("[atom] too many names");
+			abort();
+		}
+		atom = NumAtoms;
+		if (Pages[atom >> ATOM_PAGE_BITS] == NULL)
+			Pages[atom >> ATOM_PAGE_BITS] = malloc(ATOM_PAGE_SIZE * sizeof(AtomEntry));
+		*Entry(atom) = (AtomEntry) { String_Copy(name), hash };
+		NumAtoms++;
+		*slot = atom;
+	}
+	atom = *slot;
+	WRITE_UNLOCK();
+	return atom;
+}
+
+const String *Atom_Name(Atom atom) {
+	return &Entry(atom)->Name;
+}
+
+u32 Atom_Hash(Atom atom) {
+	return Entry(atom)->Hash;
+}
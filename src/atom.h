@@ -0,0 +1,28 @@
+#pragma once
+
+#include "str.h"
+
+// Names are interned into atoms: small integers that stand for the same name
+// everywhere, so comparing two names is comparing two integers. The scanner
+// interns every identifier it produces (see Token.Atom).
+//
+// There is one table for the whole process. An atom's name and hash never
+// move once interned, so Atom_Name and Atom_Hash don't lock; lookups take a
+// shared lock and interning a new name an exclusive one, so any number of
+// threads can share the table.
+
+typedef u32 Atom;
+
+#define ATOM_NONE 0
+
+// Returns the atom for the name, adding it if it's new
+Atom Atom_Intern(const String *);
+
+// Returns the atom for the name, or ATOM_NONE if it was never interned
+Atom Atom_Find(const String *);
+
+const String *Atom_Name(Atom);
+
+u32 Atom_Hash(Atom);
+
+u32 Atom_HashBytes(const u8 *, size_t);
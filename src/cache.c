@@ -0,0 +1,212 @@
+#include "cache.h"
+#include "compiler.h"
+#include "trace.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <intrin.h>
+#define GENERIC_READ 0x80000000u
+#define GENERIC_WRITE 0x40000000u
+#define FILE_SHARE_READ 0x1
+#define FILE_SHARE_WRITE 0x2
+#define OPEN_ALWAYS 4
+#define PAGE_READWRITE 0x04
+#define FILE_MAP_WRITE 0x2
+#define MOVEFILE_REPLACE_EXISTING 0x1
+#define INVALID_HANDLE_VALUE ((void *) (intptr_t) -1)
+extern void *CreateFileA(const char *name, u32 access, u32 share, void *security, u32 disposition, u32 flags, void *templateFile);
+extern void *CreateFileMappingA(void *file, void *security, u32 protect, u32 sizeHigh, u32 sizeLow, const char *name);
+extern void *MapViewOfFile(void *mapping, u32 access, u32 offsetHigh, u32 offsetLow, size_t length);
+extern int UnmapViewOfFile(const void *address);
+extern int CloseHandle(void *handle);
+extern int CreateDirectoryA(const char *path, void *security);
+extern int MoveFileExA(const char *from, const char *to, u32 flags);
+extern u32 GetCurrentProcessId(void);
+#define ATOMIC_ADD(p, n) _InterlockedExchangeAdd64((volatile __int64 *) (p), (n))
+#define PROCESS_ID() GetCurrentProcessId()
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ATOMIC_ADD(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define PROCESS_ID() ((u32) getpid())
+#endif
+
+#define CACHE_MAGIC "EXMC"
+#define CACHE_PATH_MAX 1024
+
+// Followed by the module; its size keeps the module 8-byte aligned
+typedef struct CacheEntryHeader {
+	char Magic[4];
+	u32 CompilerVersion;
+	u32 SourceLength;
+	u32 Reserved;
+	uint64_t SourceHash;
+} CacheEntryHeader;
+
+// Mixes a word at a time into one 64-bit state, then finishes with the
+// splitmix64 finalizer
+uint64_t Cache_Hash(const u8 *bytes, size_t length, uint64_t seed) {
+	const uint64_t k1 = 0x9E3779B97F4A7C15ull, k2 = 0xBF58476D1CE4E5B9ull;
+	uint64_t h = seed ^ (length * k1);
+	size_t i = 0;
+	for (; i + 8 <= length; i += 8) {
+		uint64_t word;
+		memcpy(&word, &bytes[i], 8);
+		h ^= word * k1;
+		h = (h << 31 | h >> 33) * k2;
+	}
+	uint64_t tail = 0;
+	memcpy(&tail, &bytes[i], length - i);
+	h ^= tail * k1;
+	h ^= h >> 30;
+	h *= k2;
+	h ^= h >> 27;
+	h *= 0x94D049BB133111EBull;
+	h ^= h >> 31;
+	return h;
+}
+
+static bool EntryPath(char *path, const char *dir, uint64_t hash, const char *suffix) {
+	int n = snprintf(path, CACHE_PATH_MAX, "%s/%016llx%s", dir, (unsigned long long) hash, suffix);
+	if (n < 0 || n >= CACHE_PATH_MAX) {
+		ERROR("[cache] path too long in '%s'", dir);
+		return false;
+	}
+	return true;
+}
+
+// Fine if it's already there
+static void MakeDirectory(const char *dir) {
+#ifdef _WIN32
+	CreateDirectoryA(dir, NULL);
+#else
+	mkdir(dir, 0777);
+#endif
+}
+
+// Adds one to a counter in the directory's stats file, given as its index in
+// CacheStats, or reads them all into stats. The file is mapped, and shared by
+// every process using the directory.
+static void Count(const char *dir, size_t counter, CacheStats *stats) {
+	char path[CACHE_PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s/stats", dir) >= (int) sizeof(path))
+		return;
+	volatile uint64_t *shared = NULL;
+#ifdef _WIN32
+	void *file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, 0, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	// grows the file to fit, zero filled
+	void *mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, sizeof(CacheStats), NULL);
+	CloseHandle(file);
+	if (mapping == NULL)
+		return;
+	shared = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, sizeof(CacheStats));
+	CloseHandle(mapping);
+#else
+	int fd = open(path, O_RDWR | O_CREAT, 0666);
+	if (fd < 0)
+		return;
+	struct stat st;
+	void *view = MAP_FAILED;
+	// processes racing to grow the file all leave it zero filled
+	if (fstat(fd, &st) == 0 && (st.st_size >= (off_t) sizeof(CacheStats) || ftruncate(fd, sizeof(CacheStats)) == 0))
+		view = mmap(NULL, sizeof(CacheStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (view != MAP_FAILED)
+		shared = view;
+#endif
+	if (shared == NULL)
+		return;
+	if (stats)
+		memcpy(stats, (const void *) shared, sizeof(CacheStats));
+	else
+		ATOMIC_ADD(&shared[counter], 1);
+#ifdef _WIN32
+	UnmapViewOfFile((const void *) shared);
+#else
+	munmap((void *) shared, sizeof(CacheStats));
+#endif
+}
+
+#define COUNT(dir, field) Count(dir, offsetof(CacheStats, field) / sizeof(uint64_t), NULL)
+
+Module *Cache_Load(const char *dir, const u8 *text, u32 length, Source *entry) {
+	char path[CACHE_PATH_MAX];
+	uint64_t hash = Cache_Hash(text, length, COMPILER_VERSION);
+	*entry = (Source) { 0 };
+	if (!EntryPath(path, dir, hash, ".exm"))
+		return NULL;
+	MakeDirectory(dir);
+
+	FILE *file;
+	if (fopen_s(&file, path, "rb") != 0) {
+		COUNT(dir, Misses);
+		return NULL;
+	}
+	fclose(file);
+
+	Module *module = NULL;
+	if (Source_Open(entry, path) && entry->Length >= sizeof(CacheEntryHeader)) {
+		const CacheEntryHeader *header = (const CacheEntryHeader *) entry->Text;
+		if (memcmp(header->Magic, CACHE_MAGIC, 4) == 0 && header->CompilerVersion == COMPILER_VERSION
+			&& header->SourceLength == length && header->SourceHash == hash)
+			module = Module_Load(entry->Text + sizeof(CacheEntryHeader), entry->Length - sizeof(CacheEntryHeader));
+	}
+	if (module == NULL) {
+		ERROR("[cache] ignoring '%s', which doesn't match the script", path);
+		Source_Release(entry);
+		COUNT(dir, Rejected);
+		COUNT(dir, Misses);
+		return NULL;
+	}
+	COUNT(dir, Hits);
+	return module;
+}
+
+bool Cache_Store(const char *dir, const u8 *text, u32 length, const Module *module) {
+	char path[CACHE_PATH_MAX], temp[CACHE_PATH_MAX], suffix[32];
+	uint64_t hash = Cache_Hash(text, length, COMPILER_VERSION);
+	snprintf(suffix, sizeof(suffix), ".%u.tmp", PROCESS_ID());
+	if (!EntryPath(path, dir, hash, ".exm") || !EntryPath(temp, dir, hash, suffix))
+		return false;
+	MakeDirectory(dir);
+
+	FILE *file;
+	if (fopen_s(&file, temp, "wb") != 0) {
+		ERROR("[cache] could not open '%s' for writing", temp);
+		return false;
+	}
+	CacheEntryHeader header = {
+		.Magic = CACHE_MAGIC,
+		.CompilerVersion = COMPILER_VERSION,
+		.SourceLength = length,
+		.SourceHash = hash,
+	};
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && Module_Write(module, file);
+	if (fclose(file) != 0)
+		ok = false;
+#ifdef _WIN32
+	ok = ok && MoveFileExA(temp, path, MOVEFILE_REPLACE_EXISTING);
+#else
+	ok = ok && rename(temp, path) == 0;
+#endif
+	if (!ok) {
+		ERROR("[cache] could not write '%s'", path);
+		remove(temp);
+		return false;
+	}
+	COUNT(dir, Stores);
+	return true;
+}
+
+void Cache_Stats(const char *dir, CacheStats *stats) {
+	*stats = (CacheStats) { 0 };
+	Count(dir, 0, stats);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "types.h"
+#include "module.h"
+#include "source.h"
+
+// Compiled modules are kept in a cache directory, one file per script, named
+// for a hash of the script's text and COMPILER_VERSION. An entry is a small
+// header that repeats the hash and the script's length, then the module as
+// Module_Write writes it; a hit maps the entry and loads the module from the
+// mapping (see Module_Load), and anything that doesn't match or doesn't
+// verify is a miss.
+//
+// Any number of processes can share a directory: an entry is written to a
+// file of its own and renamed into place, so it is either complete or not
+// there at all. Hits, misses and stores are counted in the directory's
+// "stats" file, which every process adds to.
+
+typedef struct CacheStats {
+	uint64_t Hits;
+	uint64_t Misses;
+	uint64_t Stores;
+	uint64_t Rejected; // entries that were there but didn't match or verify
+} CacheStats;
+
+// Returns the module cached for the text, or NULL, creating the directory if
+// need be. The module lives in entry, which is released after Module_Unload.
+Module *Cache_Load(const char *dir, const u8 *text, u32 length, Source *entry);
+
+// Saves the module for the text, creating the directory if need be
+bool Cache_Store(const char *dir, const u8 *text, u32 length, const Module *);
+
+// Reads the directory's counters; all zero for a cache not used yet
+void Cache_Stats(const char *dir, CacheStats *);
+
+uint64_t Cache_Hash(const u8 *bytes, size_t length, uint64_t seed);
@@ -0,0 +1,509 @@
+
+#include "compiler.h"
+#include "opcode.h"
+#include "io.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_FUNCTIONS 1024
+
+typedef enum {
+	CompileError_None,
+	CompileError_Unsupported,
+	CompileError_Unresolved,
+	CompileError_Arity,
+	CompileError_Limit
+} CompileErrorType;
+
+typedef struct CodeBuffer {
+	u8 *Bytes;
+	u32 Length, Capacity;
+} CodeBuffer;
+
+// Natives callable from scripts. Variadic natives get one Function entry per
+// arity used, since CALL takes its argument count from the callee.
+static const struct {
+	const char *Name;
+	void (*Native)(VM *);
+	s32 NumParams; // -1 for any number
+} NATIVES[] = {
+	{ "println", io_println_Native, -1 }
+};
+
+struct Compiler {
+	Function Functions[MAX_FUNCTIONS];
+	AstIndex Sources[MAX_FUNCTIONS]; // function nodes, AST_NONE for $global and natives
+	Atom Names[MAX_FUNCTIONS]; // interned Function.Name
+	Atom NativeNames[countof(NATIVES)];
+	u32 NumFunctions;
+	ConstantTable Constants;
+	u32 ConstantCapacity;
+	const Ast *Ast;
+	AstIndex Current;
+	CodeBuffer Code;
+	CompileErrorType Error;
+};
+
+Compiler *Compiler_New() {
+	Compiler *c = calloc(1, sizeof(Compiler));
+	return c;
+}
+
+void Compiler_Release(Compiler *c) {
+	free(c->Code.Bytes);
+	free(c);
+}
+
+static void SetError(Compiler *c, CompileErrorType error) {
+	if (c->Error == CompileError_None)
+		c->Error = error;
+}
+
+static void Emit(Compiler *c, const u8 *bytes, u32 count) {
+	CodeBuffer *code = &c->Code;
+	if (code->Length + count > code->Capacity) {
+		code->Capacity = code->Capacity ? 2 * code->Capacity : 64;
+		while (code->Length + count > code->Capacity)
+			code->Capacity *= 2;
+		code->Bytes = realloc(code->Bytes, code->Capacity);
+	}
+	memcpy(&code->Bytes[code->Length], bytes, count);
+	code->Length += count;
+}
+
+static void EmitOp(Compiler *c, Opcode op) {
+	u8 byte = (u8) op;
+	Emit(c, &byte, 1);
+}
+
+static void EmitOp_u8(Compiler *c, Opcode op, u8 operand) {
+	u8 bytes[] = { (u8) op, operand };
+	Emit(c, bytes, sizeof(bytes));
+}
+
+static void EmitOp_u32(Compiler *c, Opcode op, u32 operand) {
+	u8 bytes[] = { (u8) op, $(operand) };
+	Emit(c, bytes, sizeof(bytes));
+}
+
+// Emits a branch with a placeholder offset and returns its position for PatchBranch
+static u32 EmitBranch(Compiler *c, Opcode op) {
+	u32 pos = c->Code.Length;
+	EmitOp_u32(c, op, 0);
+	return pos;
+}
+
+static void PatchBranch(Compiler *c, u32 pos) {
+	s32 offset = (s32) (c->Code.Length - (pos + 5));
+	u8 bytes[] = { $(offset) };
+	memcpy(&c->Code.Bytes[pos + 1], bytes, sizeof(bytes));
+}
+
+static u32 AddConstant(Compiler *c, Constant *constant) {
+	ConstantTable *table = &c->Constants;
+	if (table->Count == c->ConstantCapacity) {
+		c->ConstantCapacity = c->ConstantCapacity ? 2 * c->ConstantCapacity : 16;
+		table->Entries = realloc(table->Entries, c->ConstantCapacity * sizeof(Constant *));
+	}
+	table->Entries[table->Count] = constant;
+	return table->Count++;
+}
+
+static u32 AddStringConstant(Compiler *c, const String *str) {
+	StringConstant *constant = calloc(1, sizeof(StringConstant));
+	*constant = (StringConstant) { CONSTANT_STRING, strndup((const char *) str->Bytes, str->Length), str->Length };
+	return AddConstant(c, (Constant *) constant);
+}
+
+static Function *AddFunction(Compiler *c, Atom name, u32 numArgs, AstIndex source) {
+	if (c->NumFunctions == MAX_FUNCTIONS) {
+		ERROR("[compiler] too many functions");
+		SetError(c, CompileError_Limit);
+		return NULL;
+	}
+	u32 index = c->NumFunctions++;
+	Function *function = &c->Functions[index];
+	const String *text = Atom_Name(name);
+	function->Name = strndup((const char *) text->Bytes, text->Length);
+	function->NumArgs = numArgs;
+	c->Sources[index] = source;
+	c->Names[index] = name;
+	return function;
+}
+
+#define TOKEN_ATOM(c, node) (AST_TOKEN((c)->Ast, (node)->Token)->Atom)
+
+// Registers every function in the tree up front so calls can refer to
+// functions that are defined later in the script.
+static void DeclareFunctions(Compiler *c, AstIndex index) {
+	if (index == AST_NONE || c->Error)
+		return;
+	const AstNode *node = AST_NODE(c->Ast, index);
+	switch (node->Type) {
+		case AstNode_Function: {
+			Atom name = TOKEN_ATOM(c, node);
+			for (u32 i = 0; i < c->NumFunctions; i++) {
+				if (c->Sources[i] && c->Names[i] == name) {
+					ERROR("[compiler] function '%s' is already defined", c->Functions[i].Name);
+					SetError(c, CompileError_Unsupported);
+					return;
+				}
+			}
+			AddFunction(c, name, AST_LIST_LENGTH(c->Ast, node->Lhs), index);
+			DeclareFunctions(c, AST_EXTRA(c->Ast, node, 1));
+			break;
+		}
+		case AstNode_Block: {
+			AST_FOREACH(x, c->Ast, node->Lhs, DeclareFunctions(c, x));
+			break;
+		}
+		case AstNode_If: {
+			DeclareFunctions(c, AST_EXTRA(c->Ast, node, 0));
+			DeclareFunctions(c, AST_EXTRA(c->Ast, node, 1));
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+static s32 ResolveParameter(Compiler *c, Atom identifier) {
+	if (c->Current) {
+		u32 parameters = AST_NODE(c->Ast, c->Current)->Lhs;
+		for (u32 slot = 0; slot < AST_LIST_LENGTH(c->Ast, parameters); slot++) {
+			if (TOKEN_ATOM(c, AST_NODE(c->Ast, AST_LIST_ITEM(c->Ast, parameters, slot))) == identifier)
+				return (s32) slot;
+		}
+	}
+	return -1;
+}
+
+static s32 ResolveFunction(Compiler *c, Atom identifier, u32 numArgs) {
+	for (u32 i = 0; i < c->NumFunctions; i++) {
+		const Function *function = &c->Functions[i];
+		if (c->Names[i] != identifier)
+			continue;
+		if (c->Sources[i] && function->NumArgs != numArgs) {
+			ERROR("[compiler] '%s' takes %d arguments, %d given", function->Name, function->NumArgs, numArgs);
+			SetError(c, CompileError_Arity);
+			return -1;
+		}
+		if (function->NumArgs == numArgs)
+			return (s32) i;
+	}
+	for (size_t i = 0; i < countof(NATIVES); i++) {
+		if (c->NativeNames[i] == identifier) {
+			if (NATIVES[i].NumParams >= 0 && (u32) NATIVES[i].NumParams != numArgs) {
+				ERROR("[compiler] '%s' takes %d arguments, %d given", NATIVES[i].Name, NATIVES[i].NumParams, numArgs);
+				SetError(c, CompileError_Arity);
+				return -1;
+			}
+			Function *function = AddFunction(c, identifier, numArgs, AST_NONE);
+			if (function == NULL)
+				return -1;
+			function->Flags = FF_NATIVE;
+			function->Native = NATIVES[i].Native;
+			return (s32) (c->NumFunctions - 1);
+		}
+	}
+	const String *name = Atom_Name(identifier);
+	ERROR("[compiler] unresolved function '%.*s'", name->Length, name->Bytes);
+	SetError(c, CompileError_Unresolved);
+	return -1;
+}
+
+static bool ParseUint(const String *text, u32 *value) {
+	u32 x = 0;
+	for (size_t i = 0; i < text->Length; i++) {
+		u8 digit = text->Bytes[i] - '0';
+		if (digit > 9 || x > (UINT32_MAX - digit) / 10)
+			return false;
+		x = 10 * x + digit;
+	}
+	*value = x;
+	return true;
+}
+
+static void CompileExpression(Compiler *c, AstIndex index);
+static void CompileStatement(Compiler *c, AstIndex index);
+
+static void CompileLiteral(Compiler *c, const AstNode *node) {
+	const Token *token = AST_TOKEN(c->Ast, node->Token);
+	u32 value;
+	if (token->Type != Token_IntegerLiteral) {
+		SourcePosition at = Ast_Position(c->Ast, token);
+		ERROR("[compiler] %d:%d: only integer literals are supported", at.Line, at.Column);
+		SetError(c, CompileError_Unsupported);
+	}
+	else if (!ParseUint(&token->Text, &value)) {
+		SourcePosition at = Ast_Position(c->Ast, token);
+		ERROR("[compiler] %d:%d: integer literal out of range", at.Line, at.Column);
+		SetError(c, CompileError_Limit);
+	}
+	else {
+		EmitOp_u32(c, PUSH, value);
+	}
+}
+
+static void CompileIdentifier(Compiler *c, const AstNode *node) {
+	const Token *token = AST_TOKEN(c->Ast, node->Token);
+	s32 slot = ResolveParameter(c, token->Atom);
+	if (slot < 0) {
+		SourcePosition at = Ast_Position(c->Ast, token);
+		ERROR("[compiler] %d:%d: unresolved identifier '%.*s'", at.Line, at.Column, token->Text.Length, token->Text.Bytes);
+		SetError(c, CompileError_Unresolved);
+	}
+	else if (slot > UINT8_MAX) {
+		SourcePosition at = Ast_Position(c->Ast, token);
+		ERROR("[compiler] %d:%d: '%.*s' is parameter %d, only %d can be used", at.Line, at.Column,
+			token->Text.Length, token->Text.Bytes, slot + 1, UINT8_MAX + 1);
+		SetError(c, CompileError_Limit);
+	}
+	else {
+		EmitOp_u8(c, LOAD, (u8) slot);
+	}
+}
+
+static void CompileBinaryExpression(Compiler *c, const AstNode *node) {
+	static const struct {
+		TokenType Operator;
+		Opcode Opcode;
+	} OPERATORS[] = {
+		{ Token_Plus, ADD },
+		{ Token_Minus, SUB },
+		{ Token_Multiply, MUL },
+		{ Token_Divide, DIV },
+		{ Token_CompareEq, EQ },
+		{ Token_CompareNotEq, NE }
+	};
+	const Token *oper = AST_TOKEN(c->Ast, node->Token);
+	CompileExpression(c, node->Lhs);
+	CompileExpression(c, node->Rhs);
+	for (size_t i = 0; i < countof(OPERATORS); i++) {
+		if (OPERATORS[i].Operator == oper->Type) {
+			EmitOp(c, OPERATORS[i].Opcode);
+			return;
+		}
+	}
+	SourcePosition at = Ast_Position(c->Ast, oper);
+	ERROR("[compiler] %d:%d: unsupported operator '%.*s'", at.Line, at.Column, oper->Text.Length, oper->Text.Bytes);
+	SetError(c, CompileError_Unsupported);
+}
+
+static void CompileFunctionCall(Compiler *c, const AstNode *node) {
+	const AstNode *function = AST_NODE(c->Ast, node->Lhs);
+	if (function->Type != AstNode_Identifier) {
+		ERROR("[compiler] only named functions can be called");
+		SetError(c, CompileError_Unsupported);
+		return;
+	}
+	u32 count = AST_LIST_LENGTH(c->Ast, node->Rhs);
+	AST_FOREACH(argument, c->Ast, node->Rhs, CompileExpression(c, argument));
+	s32 index = ResolveFunction(c, TOKEN_ATOM(c, function), count);
+	if (index >= 0) {
+		EmitOp_u32(c, CALL, (u32) index);
+	}
+}
+
+static void CompileExpression(Compiler *c, AstIndex index) {
+	if (index == AST_NONE) {
+		SetError(c, CompileError_Unsupported);
+		return;
+	}
+	const AstNode *node = AST_NODE(c->Ast, index);
+	switch (node->Type) {
+		case AstNode_Literal:
+			CompileLiteral(c, node);
+			break;
+		case AstNode_Identifier:
+			CompileIdentifier(c, node);
+			break;
+		case AstNode_Expression:
+			CompileBinaryExpression(c, node);
+			break;
+		case AstNode_FunctionCall:
+			CompileFunctionCall(c, node);
+			break;
+		default:
+			ERROR("[compiler] node type %d is not an expression", node->Type);
+			SetError(c, CompileError_Unsupported);
+			break;
+	}
+}
+
+static void CompileIf(Compiler *c, const AstNode *node) {
+	AstIndex falseBranch = AST_EXTRA(c->Ast, node, 1);
+	CompileExpression(c, node->Lhs);
+	u32 toFalse = EmitBranch(c, BZ);
+	CompileStatement(c, AST_EXTRA(c->Ast, node, 0));
+	if (falseBranch) {
+		u32 toEnd = EmitBranch(c, JMP);
+		PatchBranch(c, toFalse);
+		CompileStatement(c, falseBranch);
+		PatchBranch(c, toEnd);
+	}
+	else {
+		PatchBranch(c, toFalse);
+	}
+}
+
+static void CompileReturn(Compiler *c, const AstNode *node) {
+	if (c->Current == AST_NONE) {
+		ERROR("[compiler] return outside of a function");
+		SetError(c, CompileError_Unsupported);
+		return;
+	}
+	if (node->Lhs)
+		CompileExpression(c, node->Lhs);
+	else
+		EmitOp_u32(c, PUSH, 0);
+	EmitOp(c, RET);
+}
+
+static void CompileStatement(Compiler *c, AstIndex index) {
+	if (index == AST_NONE || c->Error)
+		return;
+	const AstNode *node = AST_NODE(c->Ast, index);
+	switch (node->Type) {
+		case AstNode_Function:
+			// compiled separately, see CompileFunction
+			break;
+		case AstNode_Block:
+			AST_FOREACH(x, c->Ast, node->Lhs, CompileStatement(c, x));
+			break;
+		case AstNode_If:
+			CompileIf(c, node);
+			break;
+		case AstNode_Return:
+			CompileReturn(c, node);
+			break;
+		default:
+			// expression statement, discard its value
+			CompileExpression(c, index);
+			EmitOp(c, POP);
+			break;
+	}
+}
+
+static void FinishFunction(Compiler *c, Function *function) {
+	ByteArrayConstant *body = calloc(1, sizeof(ByteArrayConstant));
+	*body = (ByteArrayConstant) { CONSTANT_BYTEARRAY, malloc(c->Code.Length), c->Code.Length };
+	memcpy(body->Bytes, c->Code.Bytes, c->Code.Length);
+	function->Body.Bytes = body->Bytes;
+	function->Body.Length = c->Code.Length;
+	c->Code.Length = 0;
+
+	MethodInfo *method = calloc(1, sizeof(MethodInfo));
+	*method = (MethodInfo) {
+		.Type = CONSTANT_METHOD,
+		.ClassInfo = 0,
+		.Name = AddStringConstant(c, &(String) { (u8 *) function->Name, strlen(function->Name) }),
+		.NumParams = function->NumArgs,
+		.Body = AddConstant(c, (Constant *) body)
+	};
+	AddConstant(c, (Constant *) method);
+	TRACE("[compiler] %s: %d bytes", function->Name, function->Body.Length);
+}
+
+static void CompileFunction(Compiler *c, u32 index) {
+	Function *function = &c->Functions[index];
+	c->Current = c->Sources[index];
+	CompileStatement(c, AST_EXTRA(c->Ast, AST_NODE(c->Ast, c->Current), 1));
+	// falling off the end returns 0
+	EmitOp_u32(c, PUSH, 0);
+	EmitOp(c, RET);
+	FinishFunction(c, function);
+	c->Current = AST_NONE;
+}
+
+bool Compiler_FindNative(const char *name, Function *function) {
+	for (size_t i = 0; i < countof(NATIVES); i++) {
+		if (strcmp(NATIVES[i].Name, name) == 0) {
+			if (NATIVES[i].NumParams >= 0 && (u32) NATIVES[i].NumParams != function->NumArgs)
+				return false;
+			function->Flags = FF_NATIVE;
+			function->Native = NATIVES[i].Native;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Frees every entry but the static one at index 0, and what they point to
+static void FreeConstants(ConstantTable *constants) {
+	for (u32 i = 1; i < constants->Count; i++) {
+		Constant *constant = constants->Entries[i];
+		if (constant->Type == CONSTANT_STRING)
+			free((void *) ((StringConstant *) constant)->Value);
+		else if (constant->Type == CONSTANT_BYTEARRAY)
+			free(((ByteArrayConstant *) constant)->Bytes);
+		free(constant);
+	}
+	free(constants->Entries);
+	*constants = (ConstantTable) { 0 };
+}
+
+static void FreeNames(Function *functions, u32 count) {
+	for (u32 i = 0; i < count; i++)
+		free((void *) functions[i].Name);
+}
+
+Module *Compiler_BuildModule(Compiler *c, const Ast *ast) {
+	static const Constant none = { CONSTANT_NONE };
+	if (ast->Root == AST_NONE)
+		return NULL;
+	c->Ast = ast;
+
+	// Entry 0 is reserved so that a zero index can mean "none"
+	AddConstant(c, (Constant *) &none);
+
+	for (size_t i = 0; i < countof(NATIVES); i++)
+		c->NativeNames[i] = Atom_Intern(&(String) { (u8 *) NATIVES[i].Name, strlen(NATIVES[i].Name) });
+	AddFunction(c, Atom_Intern(&(String) { (u8 *) "$global", 7 }), 0, AST_NONE);
+	DeclareFunctions(c, ast->Root);
+
+	u32 numDeclared = c->NumFunctions;
+	for (u32 i = 1; i < numDeclared && !c->Error; i++)
+		CompileFunction(c, i);
+
+	CompileStatement(c, ast->Root);
+	EmitOp(c, HALT);
+	FinishFunction(c, &c->Functions[0]);
+
+	if (c->Error) {
+		ERROR("[compiler] compilation failed (error %d)", c->Error);
+		FreeConstants(&c->Constants);
+		c->ConstantCapacity = 0;
+		FreeNames(c->Functions, c->NumFunctions);
+		c->NumFunctions = 0;
+		return NULL;
+	}
+
+	Module *module = calloc(1, sizeof(Module));
+	Function *functions = calloc(c->NumFunctions, sizeof(Function));
+	memcpy(functions, c->Functions, c->NumFunctions * sizeof(Function));
+	ConstantTable *constants = calloc(1, sizeof(ConstantTable));
+	*constants = c->Constants;
+	c->Constants = (ConstantTable) { 0 };
+	c->ConstantCapacity = 0;
+	*module = (Module) { .Functions = functions, .NumFunctions = c->NumFunctions, .Constants = constants };
+	if (!Module_Verify(module)) {
+		ERROR("[compiler] generated code failed verification");
+		Compiler_ReleaseModule(module);
+		return NULL;
+	}
+	return module;
+}
+
+void Compiler_ReleaseModule(Module *module) {
+	if (module == NULL)
+		return;
+	Module_ReleaseCode(module);
+	FreeNames(module->Functions, module->NumFunctions);
+	FreeConstants(module->Constants);
+	free(module->Constants);
+	free(module->Functions);
+	free(module);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "ast.h"
+#include "module.h"
+
+// Bump whenever the same script would compile to different code, so that
+// modules cached from the old compiler aren't used (see cache.h)
+#define COMPILER_VERSION 1
+
+typedef struct Compiler Compiler;
+
+Compiler *Compiler_New();
+
+void Compiler_Release(Compiler *);
+
+// Lowers a parsed program into a module. Function 0 is always "$global", which
+// runs the top-level statements and halts. Returns NULL if the program uses
+// anything the VM can't express.
+Module *Compiler_BuildModule(Compiler *, const Ast *);
+
+// Frees a module Compiler_BuildModule returned, and everything in it
+void Compiler_ReleaseModule(Module *);
+
+// Makes the function the native that scripts call by that name. Returns false
+// if there's no such native, or it doesn't take the function's NumArgs.
+bool Compiler_FindNative(const char *name, Function *);
@@ -1,4 +1,50 @@
 #pragma once
 
-#define MAX_FRAMES 256
-#define MEMORY_SIZE 1024
\ No newline at end of file
+// A VM reserves address space for its stack and call stack up to its limits
+// (see VMLimits), but only commits the initial sizes; the rest is committed
+// as the stacks grow. Memory sizes are in words.
+#define INITIAL_MEMORY_SIZE 1024
+#define INITIAL_FRAMES 64
+#define DEFAULT_MAX_MEMORY (1 << 20)
+#define DEFAULT_MAX_FRAMES (1 << 16)
+
+// Bytes of native stack JIT code may use, below where its VM was set up; calls
+// made any deeper than that are interpreted, see VM_HasNativeStack
+#define JIT_NATIVE_STACK (512 << 10)
+
+// Bytes of stack for the tree-walking evaluator's activations and operands
+#define EVAL_STACK_SIZE (1 << 20)
+
+// Steps the explicit-stack evaluator takes before handing control back to
+// whoever runs it, which may resume it or leave it suspended
+#define EVAL_LOOP_SLICE (1 << 16)
+
+// The scanner finds where runs of whitespace, comments, identifiers and
+// strings end a vector at a time: 32 bytes with AVX2 when the build targets
+// it, otherwise 16 with SSE2. Other targets, or a build with SCANNER_NO_SIMD,
+// look at a byte at a time, with the same result.
+#if !defined(SCANNER_NO_SIMD) && defined(__AVX2__)
+#define SCANNER_SIMD 32
+#elif !defined(SCANNER_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define SCANNER_SIMD 16
+#else
+#define SCANNER_SIMD 0
+#endif
+
+// A streaming scanner reads its input this many bytes at a time, and keeps at
+// least this much ahead of the token it's on
+#define SCANNER_CHUNK (1 << 16)
+
+// Scanner_Tokenize gives each thread at least this many bytes of the text
+#define SCANNER_SPLIT_MIN (1 << 18)
+
+// Instructions a recording VM keeps, the most recent ones, see recorder.h
+#define RECORDER_CAPACITY (1 << 20)
+
+// Threaded dispatch relies on the labels-as-values extension in GCC and Clang.
+// Everything else, or a build with VM_NO_COMPUTED_GOTO, uses the switch loop.
+#if defined(__GNUC__) && !defined(VM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO 1
+#else
+#define VM_COMPUTED_GOTO 0
+#endif
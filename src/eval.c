@@ -1,93 +1,55 @@
 
 #include "eval.h"
 #include "io.h"
+#include "resolver.h"
 #include "str.h"
 #include "trace.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
-typedef struct Scope {
-	struct Symbol *Symbols[256];
-	size_t NumSymbols;
-} Scope;
-
-typedef struct Activation {
-	const AstFunctionNode *Function;
-	Scope Scopes[256];
-	size_t NumScopes;
-	Value Operands[256];
-	size_t NumOperands;
-	struct Activation *Next;
-} Activation;
-
-int PutSymbol(Scope *scope, const String *identifier, const Value *value) {
-	// TODO: need to see if duplicate
-	Symbol *symbol = calloc(1, sizeof(Symbol));
-	symbol->Identifier = String_Copy(identifier);
-	symbol->Value = *value;
-	scope->Symbols[scope->NumSymbols++] = symbol;
-	return 0;
-}
-
-Symbol *GetSymbol(AstEvalVisitor *v, const String *identifier) {
-	assert(v->Frame);
-	for (Activation *frame = v->Frame; frame; frame = frame->Next) {
-		assert(frame->NumScopes > 0);
-		for (size_t j = frame->NumScopes; j > 0; j--) {
-			Scope *scope = &frame->Scopes[j-1];
-			for (size_t k = 0; k < scope->NumSymbols; k++) {
-				if (String_Equals(&scope->Symbols[k]->Identifier, identifier))
-					return scope->Symbols[k];
-			}
-		}
-	}
-	return NULL;
-}
+// Object.Self for script functions
+typedef struct Closure {
+	AstIndex Function;
+	Activation *Parent;
+} Closure;
 
-Scope *CurrentScope(AstEvalVisitor *v) {
-	assert(v->Frame->NumScopes > 0);
-	return &v->Frame->Scopes[v->Frame->NumScopes - 1];
-}
+static const char *const BUILTINS[] = { "println" };
 
-Scope *PushScope(AstEvalVisitor *v) {
-	assert(v->Frame);
-	Scope *scope = &v->Frame->Scopes[v->Frame->NumScopes++];
-	scope->NumSymbols = 0;
-	return scope;
+// Whatever the script printed, and the error message, are still buffered in
+// stdout, so flush them before aborting, as VM_Panic does
+void Eval_Abort() {
+	fflush(stdout);
+	abort();
 }
 
-void PopScope(AstEvalVisitor *v) {
-	assert(v->Frame);
-	assert(v->Frame->NumScopes > 0);
-	Scope *scope = &v->Frame->Scopes[--v->Frame->NumScopes];
-	for (size_t j = 0; j < scope->NumSymbols; j++) {
-		Symbol *symbol = scope->Symbols[j];
-		free(symbol->Identifier.Bytes);
-	}
+static void StackOverflow() {
+	LOG(Eval, Error, "evaluation stack overflow");
+	Eval_Abort();
 }
 
-Activation *PushFrame(AstEvalVisitor *v) {
-	Activation *frame = calloc(1, sizeof(Activation));
-	frame->NumScopes = 1;
-	Scope *scope = &frame->Scopes[0];
-	scope->NumSymbols = 0;
-	frame->Next = v->Frame;
+Activation *PushFrame(AstEvalVisitor *v, u32 numLocals, Activation *parent) {
+	Activation *caller = v->Frame;
+	Activation *frame = caller ? (Activation *) &caller->Operands[caller->NumOperands] : (Activation *) v->Stack;
+	Value *operands = &frame->Locals[numLocals];
+	if ((u8 *) operands > v->StackEnd)
+		StackOverflow();
+	*frame = (Activation) { .Operands = operands, .Next = caller, .Parent = parent, .NumLocals = numLocals };
+	memset(frame->Locals, 0, numLocals * sizeof(Value));
 	v->Frame = frame;
 	return frame;
 }
 
 void PopFrame(AstEvalVisitor *v) {
-	Activation *frame = v->Frame;
-	while (frame->NumScopes > 0) {
-		PopScope(v);
-	}
-	v->Frame = frame->Next;
-	free(frame);
+	v->Frame = v->Frame->Next;
 }
 
 void PushOperand(AstEvalVisitor *v, const Value *valuep) {
-	v->Frame->Operands[v->Frame->NumOperands++] = *valuep;
+	Activation *frame = v->Frame;
+	if ((u8 *) &frame->Operands[frame->NumOperands + 1] > v->StackEnd)
+		StackOverflow();
+	frame->Operands[frame->NumOperands++] = *valuep;
 }
 
 bool PopOperand(AstEvalVisitor *v, Value *valuep) {
@@ -112,178 +74,434 @@ static bool ToBoolean(const Value *value) {
 	}
 }
 
-void eval(AstEvalVisitor *v, const AstNode *node);
+void eval(AstEvalVisitor *v, AstIndex index);
 
-void eval_Function(AstEvalVisitor *v, const AstFunctionNode *function) {
+static void InvokeFunction(AstEvalVisitor *v, void *self);
+
+static Value *Lookup(AstEvalVisitor *v, const AstNode *identifier) {
+	Activation *frame = v->Globals;
+	if (identifier->Lhs != AST_GLOBAL) {
+		frame = v->Frame;
+		for (u32 depth = identifier->Lhs; depth > 0; depth--)
+			frame = frame->Parent;
+	}
+	assert(identifier->Rhs < frame->NumLocals);
+	return &frame->Locals[identifier->Rhs];
+}
+
+void eval_Function(AstEvalVisitor *v, AstIndex index) {
+	const AstNode *function = AST_NODE(v->Ast, index);
+	Closure *closure = calloc(1, sizeof(Closure));
+	*closure = (Closure) { .Function = index, .Parent = v->Frame };
 	Object *object = calloc(1, sizeof(Object));
-	object->Self = function->Body;
-	object->OpInvoke = eval;
-	PutSymbol(CurrentScope(v), &function->Identifier.Text, &(Value) { .Type = Value_Object, .Object = object });
+	object->Self = closure;
+	object->OpInvoke = InvokeFunction;
+	v->Frame->Locals[AST_EXTRA(v->Ast, function, 3)] = (Value) { .Type = Value_Object, .Object = object };
 }
 
-void eval_FunctionCall(AstEvalVisitor *v, const AstFunctionCallNode *node) {
+// Runs a script function in the frame eval_FunctionCall pushed for it, with
+// the arguments on its operand stack
+static void InvokeFunction(AstEvalVisitor *v, void *self) {
+	const Closure *closure = self;
+	const AstNode *function = AST_NODE(v->Ast, closure->Function);
+	Activation *frame = v->Frame;
+	u32 count = AST_LIST_LENGTH(v->Ast, function->Lhs);
+	if (frame->NumOperands != count) {
+		const String *name = &AST_TOKEN(v->Ast, function->Token)->Text;
+		LOG(Eval, Error, "'%.*s' takes %d arguments, %d given", name->Length, (const char *) name->Bytes, count, (int) frame->NumOperands);
+		Eval_Abort();
+	}
+	// the operands are in reverse order, see eval_FunctionCall
+	for (u32 i = 0; i < count; i++)
+		frame->Locals[i] = frame->Operands[count - i - 1];
+	frame->NumOperands = 0;
+	// falling off the end returns 0, as in compiled code
+	frame->Result = (Value) { .Type = Value_Uint, .Uint = 0 };
+	eval(v, AST_EXTRA(v->Ast, function, 1));
+	PushOperand(v, &frame->Result);
+}
 
-	// Evaluate the expression that resolves to target function
-	eval(v, node->Function);
+// Evaluates the expression that resolves to the function a call targets
+static Object *EvalCallee(AstEvalVisitor *v, const AstNode *node) {
+	eval(v, node->Lhs);
 
 	// Get the result off the stack
 	Value operand;
-	if (PopOperand(v, &operand)) {
-		if (operand.Type != Value_Object) {
-			// raise a type error
-			abort();
-		}
-		else if (operand.Object->OpInvoke == NULL) {
-			// another kind of error
-			abort();
-		}
-		else {
-			Activation *caller = v->Frame;
-
-			// Evaluate function arguments
-			const AstNode *argument = node->Arguments;
-			int count = 0;
-			while (argument) {
-				eval(v, argument->Left);
-				const AstNode *next = argument->Right;
-				++count;
-				argument = next;
-			}
+	if (!PopOperand(v, &operand) || operand.Type != Value_Object) {
+		// raise a type error
+		abort();
+	}
+	else if (operand.Object->OpInvoke == NULL) {
+		// another kind of error
+		abort();
+	}
+	return operand.Object;
+}
 
-			Activation *callee = PushFrame(v);
+static void CallObject(AstEvalVisitor *v, const AstNode *node, Object *object) {
+	Activation *caller = v->Frame;
 
-			// Move operands into callee's frame
-			for (int i = 0; i < count; i++) {
-				callee->Operands[callee->NumOperands++] = caller->Operands[--caller->NumOperands];
-			}
+	// Evaluate function arguments
+	u32 count = AST_LIST_LENGTH(v->Ast, node->Rhs);
+	AST_FOREACH(argument, v->Ast, node->Rhs, eval(v, argument));
 
-			// Evaluate function in callee context
-			Object *object = operand.Object;
-			operand.Object->OpInvoke(v, object->Self);
+	// Script functions get room for their locals
+	if (object->OpInvoke == InvokeFunction) {
+		const Closure *closure = object->Self;
+		PushFrame(v, AST_EXTRA(v->Ast, AST_NODE(v->Ast, closure->Function), 2), closure->Parent);
+	}
+	else {
+		PushFrame(v, 0, NULL);
+	}
 
-			// Push the return value onto the caller's stack
-			Value returnValue;
-			if (PopOperand(v, &returnValue)) {
-				caller->Operands[caller->NumOperands++] = returnValue;
-			}
+	// Move operands into callee's frame
+	for (u32 i = 0; i < count; i++) {
+		PushOperand(v, &caller->Operands[--caller->NumOperands]);
+	}
 
-			// Pop callee frame
-			PopFrame(v);
-		}
+	// Evaluate function in callee context
+	object->OpInvoke(v, object->Self);
+
+	// Push the return value onto the caller's stack
+	Value returnValue;
+	if (PopOperand(v, &returnValue)) {
+		caller->Operands[caller->NumOperands++] = returnValue;
 	}
+
+	// Pop callee frame
+	PopFrame(v);
 }
 
-void eval_Return(AstEvalVisitor *v, const AstReturnNode *node) {
+void eval_FunctionCall(AstEvalVisitor *v, const AstNode *node) {
+	CallObject(v, node, EvalCallee(v, node));
+}
 
+void eval_Return(AstEvalVisitor *v, const AstNode *node) {
+	Value result = { .Type = Value_Uint, .Uint = 0 };
+	if (node->Lhs) {
+		eval(v, node->Lhs);
+		PopOperand(v, &result);
+	}
+	v->Frame->Result = result;
+	v->Frame->Returned = true;
 }
 
-void eval_Module(AstEvalVisitor *v, const AstModuleNode *module) {
-	AST_FOREACH(stmt, module->Statements, eval(v, stmt));
+void eval_Module(AstEvalVisitor *v, const AstNode *module) {
+	AST_FOREACH(stmt, v->Ast, module->Lhs, eval(v, stmt));
 }
 
-void eval_Declaration(AstEvalVisitor *v, const AstDeclarationNode *node) {
+void eval_Declaration(AstEvalVisitor *v, const AstNode *node) {
 
 }
 
-void eval_Block(AstEvalVisitor *v, const AstBlockNode *block) {
-	PushScope(v);
-	for (AstNode *statement = block->Statements; statement != NULL; statement = statement->Right) {
-		eval(v, statement);
+void eval_Block(AstEvalVisitor *v, const AstNode *block) {
+	// Functions are visible throughout the block (see resolver.h), so define
+	// them before running anything
+	for (u32 i = 0; i < AST_LIST_LENGTH(v->Ast, block->Lhs); i++) {
+		AstIndex statement = AST_LIST_ITEM(v->Ast, block->Lhs, i);
+		if (AST_NODE(v->Ast, statement)->Type == AstNode_Function)
+			eval_Function(v, statement);
+	}
+	for (u32 i = 0; i < AST_LIST_LENGTH(v->Ast, block->Lhs) && !v->Frame->Returned; i++) {
+		eval(v, AST_LIST_ITEM(v->Ast, block->Lhs, i));
 		while (v->Frame->NumOperands > 0)
 			PopOperand(v, NULL);
 	}
-	PopScope(v);
 }
 
-void eval_If(AstEvalVisitor *v, const AstIfNode *node) {
-	assert(node->Condition);
-	eval(v, node->Condition);
+void eval_If(AstEvalVisitor *v, const AstNode *node) {
+	assert(node->Lhs);
+	eval(v, node->Lhs);
 	Value result;
 	if (PopOperand(v, &result)) {
 		bool b = ToBoolean(&result);
 		if (b) {
-			eval(v, node->TrueBranch);
+			eval(v, AST_EXTRA(v->Ast, node, 0));
 		}
 		else {
-			eval(v, node->FalseBranch);
+			eval(v, AST_EXTRA(v->Ast, node, 1));
 		}
 	}
 }
 
-void eval_Identifier(AstEvalVisitor *v, const AstIdentifierNode *node) {
-	Symbol *sym = GetSymbol(v, &node->Token.Text);
-	if (!sym) {
-		TRACE("failed to resolve symbol '%.*s'", node->Token.Text.Length, (const char *)node->Token.Text.Bytes);
-		abort(); // TODO: this is a legitimate runtime error, need to figure out how to handle it
+void eval_Identifier(AstEvalVisitor *v, const AstNode *node) {
+	PushOperand(v, Lookup(v, node));
+}
+
+void eval_Literal(AstEvalVisitor *v, const AstNode *node) {
+	u32 x = (u32) String_ToUint(&AST_TOKEN(v->Ast, node->Token)->Text);
+	PushOperand(v, &(Value) { .Type = Value_Uint, .Uint = x });
+}
+
+// Pops two operands and pushes the result of the operator on them
+static void ApplyOperator(AstEvalVisitor *v, const Token *oper) {
+	Value a, b;
+	if (!PopOperand(v, &b) || !PopOperand(v, &a) || a.Type != Value_Uint || b.Type != Value_Uint) {
+		SourcePosition at = Ast_Position(v->Ast, oper);
+		LOG(Eval, Error, "%d:%d: operands of '%.*s' must be integers", at.Line, at.Column, oper->Text.Length, (const char *) oper->Text.Bytes);
+		Eval_Abort();
 	}
-	else {
-		Activation *frame = v->Frame;
-		frame->Operands[frame->NumOperands++] = sym->Value;
+	Value result = { .Type = Value_Uint };
+	switch (oper->Type) {
+		case Token_Plus: result.Uint = a.Uint + b.Uint; break;
+		case Token_Minus: result.Uint = a.Uint - b.Uint; break;
+		case Token_Multiply: result.Uint = a.Uint * b.Uint; break;
+		case Token_Divide:
+			if (b.Uint == 0) {
+				SourcePosition at = Ast_Position(v->Ast, oper);
+				LOG(Eval, Error, "%d:%d: division by zero", at.Line, at.Column);
+				Eval_Abort();
+			}
+			result.Uint = a.Uint / b.Uint;
+			break;
+		case Token_CompareEq: result.Uint = a.Uint == b.Uint; break;
+		case Token_CompareNotEq: result.Uint = a.Uint != b.Uint; break;
+		default: {
+			SourcePosition at = Ast_Position(v->Ast, oper);
+			LOG(Eval, Error, "%d:%d: unsupported operator '%.*s'", at.Line, at.Column, oper->Text.Length, (const char *) oper->Text.Bytes);
+			Eval_Abort();
+		}
 	}
+	PushOperand(v, &result);
 }
 
-void eval_Literal(AstEvalVisitor *v, const AstLiteralNode *node) {
-	long x = strtol(node->Token.Text.Bytes, NULL, 10);
-	Activation *frame = v->Frame;
-	frame->Operands[frame->NumOperands++] = (Value) { .Type = Value_Uint, .Uint = x };
-}
-
-void eval_Expression(AstEvalVisitor *v, const AstExpressionNode *expr) {
-
-}
-
-void eval(AstEvalVisitor *v, const AstNode *node) {
-	if (node != NULL) {
-		switch (node->Type) {
-			case AstNode_Function:
-				eval_Function(v, (const AstFunctionNode *) node);
-				break;
-			case AstNode_FunctionCall:
-				eval_FunctionCall(v, (const AstFunctionCallNode *) node);
-				break;
-			case AstNode_Return:
-				break;
-			case AstNode_Module:
-				break;
-			case AstNode_Declaration:
-				break;
-			case AstNode_Block:
-				eval_Block(v, (const AstBlockNode *) node);
-				break;
-			case AstNode_If:
-				eval_If(v, (const AstIfNode *) node);
-				break;
-			case AstNode_Identifier:
-				eval_Identifier(v, (const AstIdentifierNode *) node);
-				break;
-			case AstNode_Literal:
-				eval_Literal(v, (const AstLiteralNode *) node);
-				break;
-			case AstNode_Expression:
-				eval_Expression(v, (const AstExpressionNode *) node);
-				break;
-			default:
-				break;
+void eval_Expression(AstEvalVisitor *v, const AstNode *expr) {
+	eval(v, expr->Lhs);
+	eval(v, expr->Rhs);
+	ApplyOperator(v, AST_TOKEN(v->Ast, expr->Token));
+}
+
+// The generic evaluator: picks what to do by the node's type every time
+static void Dispatch(AstEvalVisitor *v, AstIndex index) {
+	const AstNode *node = AST_NODE(v->Ast, index);
+	switch (node->Type) {
+		case AstNode_Function:
+			// defined on entry to the enclosing block, see eval_Block
+			break;
+		case AstNode_FunctionCall:
+			eval_FunctionCall(v, node);
+			break;
+		case AstNode_Return:
+			eval_Return(v, node);
+			break;
+		case AstNode_Module:
+			break;
+		case AstNode_Declaration:
+			break;
+		case AstNode_Block:
+			eval_Block(v, node);
+			break;
+		case AstNode_If:
+			eval_If(v, node);
+			break;
+		case AstNode_Identifier:
+			eval_Identifier(v, node);
+			break;
+		case AstNode_Literal:
+			eval_Literal(v, node);
+			break;
+		case AstNode_Expression:
+			eval_Expression(v, node);
+			break;
+		default:
+			break;
+	}
+}
+
+// Self-specializing nodes. With Specialize set, every node gets a NodeState
+// whose Exec runs it. Exec starts out as exec_Specialize, which looks at the
+// node, and at what its operands turn out to be the first time it runs, and
+// installs a handler for that case. Handlers that assume something about the
+// values they see check it every time, and when the check fails put the
+// generic evaluator back for good.
+typedef void (*NodeExec)(AstEvalVisitor *, AstIndex);
+
+typedef struct NodeState {
+	NodeExec Exec;
+	union {
+		Value Constant; // Literal
+		Object *Callee; // FunctionCall
+	};
+} NodeState;
+
+static void Despecialize(AstEvalVisitor *v, AstIndex index) {
+	LOG(Eval, Info, "[specialize] node %u (type %d) falls back to the generic evaluator", index, AST_NODE(v->Ast, index)->Type);
+	v->Nodes[index].Exec = Dispatch;
+}
+
+static void exec_Nothing(AstEvalVisitor *v, AstIndex index) {
+}
+
+#define EXEC_NODE(type) \
+	static void exec_##type(AstEvalVisitor *v, AstIndex index) { \
+		eval_##type(v, AST_NODE(v->Ast, index)); \
+	}
+
+EXEC_NODE(Block)
+EXEC_NODE(If)
+EXEC_NODE(Return)
+EXEC_NODE(Identifier)
+
+static void exec_Constant(AstEvalVisitor *v, AstIndex index) {
+	PushOperand(v, &v->Nodes[index].Constant);
+}
+
+static void exec_Global(AstEvalVisitor *v, AstIndex index) {
+	PushOperand(v, &v->Globals->Locals[AST_NODE(v->Ast, index)->Rhs]);
+}
+
+static void exec_Local(AstEvalVisitor *v, AstIndex index) {
+	PushOperand(v, &v->Frame->Locals[AST_NODE(v->Ast, index)->Rhs]);
+}
+
+// Operators on two Uints work on the operand stack in place; anything else
+// (or a zero divisor) goes to ApplyOperator, which knows how to complain
+#define UINT_OPERATORS(X) \
+	X(Token_Plus, Add, a->Uint + b->Uint, true) \
+	X(Token_Minus, Sub, a->Uint - b->Uint, true) \
+	X(Token_Multiply, Mul, a->Uint * b->Uint, true) \
+	X(Token_Divide, Div, a->Uint / b->Uint, b->Uint != 0) \
+	X(Token_CompareEq, Eq, a->Uint == b->Uint, true) \
+	X(Token_CompareNotEq, Ne, a->Uint != b->Uint, true)
+
+#define UINT_OPERATOR(token, name, result, guard) \
+	static void exec_Uint##name(AstEvalVisitor *v, AstIndex index) { \
+		const AstNode *node = AST_NODE(v->Ast, index); \
+		eval(v, node->Lhs); \
+		eval(v, node->Rhs); \
+		Activation *frame = v->Frame; \
+		Value *a = &frame->Operands[frame->NumOperands - 2], *b = a + 1; \
+		if (frame->NumOperands < 2 || a->Type != Value_Uint || b->Type != Value_Uint || !(guard)) { \
+			Despecialize(v, index); \
+			ApplyOperator(v, AST_TOKEN(v->Ast, node->Token)); \
+			return; \
+		} \
+		a->Uint = (result); \
+		frame->NumOperands--; \
+	}
+UINT_OPERATORS(UINT_OPERATOR)
+#undef UINT_OPERATOR
+
+static NodeExec UintOperator(TokenType type) {
+	switch (type) {
+#define UINT_OPERATOR(token, name, result, guard) case token: return exec_Uint##name;
+		UINT_OPERATORS(UINT_OPERATOR)
+#undef UINT_OPERATOR
+		default: return NULL;
+	}
+}
+
+// Calls the function it called last time as long as the callee evaluates to
+// the same object, skipping the checks EvalCallee makes
+static void exec_CachedCall(AstEvalVisitor *v, AstIndex index) {
+	const AstNode *node = AST_NODE(v->Ast, index);
+	Object *callee = v->Nodes[index].Callee;
+	eval(v, node->Lhs);
+	Value operand = { Value_None };
+	if (!PopOperand(v, &operand) || operand.Type != Value_Object || operand.Object != callee) {
+		Despecialize(v, index);
+		if (operand.Type != Value_Object || operand.Object->OpInvoke == NULL)
+			abort();
+		callee = operand.Object;
+	}
+	CallObject(v, node, callee);
+}
+
+static void exec_Specialize(AstEvalVisitor *v, AstIndex index) {
+	NodeState *state = &v->Nodes[index];
+	const AstNode *node = AST_NODE(v->Ast, index);
+	switch (node->Type) {
+		case AstNode_Block:
+			state->Exec = exec_Block;
+			break;
+		case AstNode_If:
+			state->Exec = exec_If;
+			break;
+		case AstNode_Return:
+			state->Exec = exec_Return;
+			break;
+		case AstNode_Literal:
+			eval_Literal(v, node);
+			PopOperand(v, &state->Constant);
+			state->Exec = exec_Constant;
+			break;
+		case AstNode_Identifier:
+			state->Exec = node->Lhs == AST_GLOBAL ? exec_Global : node->Lhs == 0 ? exec_Local : exec_Identifier;
+			break;
+		case AstNode_Expression: {
+			eval(v, node->Lhs);
+			eval(v, node->Rhs);
+			const Token *oper = AST_TOKEN(v->Ast, node->Token);
+			Activation *frame = v->Frame;
+			NodeExec exec = UintOperator(oper->Type);
+			bool uints = frame->NumOperands >= 2
+				&& frame->Operands[frame->NumOperands - 2].Type == Value_Uint
+				&& frame->Operands[frame->NumOperands - 1].Type == Value_Uint;
+			state->Exec = exec && uints ? exec : Dispatch;
+			ApplyOperator(v, oper);
+			return;
 		}
+		case AstNode_FunctionCall:
+			state->Callee = EvalCallee(v, node);
+			state->Exec = exec_CachedCall;
+			CallObject(v, node, state->Callee);
+			return;
+		default:
+			state->Exec = exec_Nothing;
+			break;
 	}
+	state->Exec(v, index);
+}
+
+void eval(AstEvalVisitor *v, AstIndex index) {
+	if (index == AST_NONE)
+		return;
+	if (v->Nodes)
+		v->Nodes[index].Exec(v, index);
+	else
+		Dispatch(v, index);
 }
 
 AstEvalVisitor *AstEvalVisitor_New() {
 	AstEvalVisitor *v = calloc(1, sizeof(AstEvalVisitor));
-	v->Frame = PushFrame(v); // FIXME: no null functions
-	Scope *scope = CurrentScope(v);
+	v->Stack = malloc(EVAL_STACK_SIZE);
+	v->StackEnd = v->Stack + EVAL_STACK_SIZE;
+	return v;
+}
+
+bool AstEvalVisitor_Eval(AstEvalVisitor *v, Ast *ast) {
+	if (!Resolver_Resolve(ast, BUILTINS, countof(BUILTINS)))
+		return false;
+	v->Ast = ast;
+	v->Globals = PushFrame(v, ast->NumGlobals, NULL);
 
 	Object *println = calloc(1, sizeof(Object));
 	println->OpInvoke = io_println_OpInvoke;
 	println->Self = NULL;
-	Value value = { .Type = Value_Object, .Object = println };
-	PutSymbol(scope, &(String) { .Bytes = "println", .Length = 7 }, &value);
-
-	return v;
-}
+	v->Globals->Locals[0] = (Value) { .Type = Value_Object, .Object = println };
 
-void AstEvalVisitor_Eval(AstEvalVisitor *v, const AstNode *node) {
-	eval(v, node);
+	if (v->Compile) {
+		Thunk_Run(v);
+	}
+	else if (v->Iterative) {
+		Loop_Start(v);
+		while (!Loop_Resume(v, EVAL_LOOP_SLICE))
+			;
+		Loop_Release(v);
+	}
+	else {
+		if (v->Specialize) {
+			v->Nodes = malloc(ast->NumNodes * sizeof(NodeState));
+			for (u32 i = 0; i < ast->NumNodes; i++)
+				v->Nodes[i] = (NodeState) { .Exec = exec_Specialize };
+		}
+		eval(v, ast->Root);
+		free(v->Nodes);
+		v->Nodes = NULL;
+	}
+	PopFrame(v);
+	v->Globals = NULL;
+	return true;
 }
 
 u32 NumOperands(const AstEvalVisitor *v) {
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "ast.h"
+#include "config.h"
 
 typedef struct AstEvalVisitor AstEvalVisitor;
 
+typedef struct Activation Activation;
+
 typedef void (*FnInvoke)(AstEvalVisitor *, void *);
 
 typedef struct Object {
@@ -23,22 +26,73 @@ typedef struct Value {
 	union {
 		Object *Object;
 		const void *Pointer;
-		uint64_t Uint;
+		u32 Uint; // 32 bits, as in the VM, so arithmetic wraps the same way
 	};
 } Value;
 
-typedef struct Symbol {
-	String Identifier;
-	Value Value;
-} Symbol;
+// Names are bound to slots by the resolver before evaluation starts, so each
+// activation just has a flat array of locals: parameters first, then the
+// functions defined in its body. The global activation's locals are the
+// globals. Parent is the activation of the enclosing function, which holds
+// the locals one level out.
+//
+// Activations live on one evaluation stack: each is pushed right above its
+// caller's operands, and its own operands grow from the end of its locals
+// up to wherever the next call puts its activation. Returning just makes the
+// caller current again.
+struct Activation {
+	AstIndex Function;
+	Value *Operands;
+	size_t NumOperands;
+	bool Returned;
+	Value Result;
+	struct Activation *Next;
+	struct Activation *Parent;
+	u32 NumLocals;
+	Value Locals[];
+};
 
 typedef struct AstEvalVisitor {
-	struct Activation *Frame;
+	Activation *Frame;
+	Activation *Globals;
+	const Ast *Ast;
+	u8 *Stack, *StackEnd; // where activations and operands live, see eval.c
+	bool Specialize; // let nodes rewrite themselves as they run, see eval.c
+	bool Compile; // run thunks compiled from the tree instead, see eval_thunk.c
+	bool Iterative; // run on an explicit stack instead, see eval_loop.c
+	struct NodeState *Nodes; // one per AST node while specializing
+	struct EvalLoop *Loop; // state of the explicit-stack evaluator
 } AstEvalVisitor;
 
 AstEvalVisitor *AstEvalVisitor_New();
 
-void AstEvalVisitor_Eval(AstEvalVisitor *, const AstNode *);
+// Ends the process after an evaluation error has been reported
+void Eval_Abort();
+
+// Resolves the program's names (see resolver.h), then runs it. Returns false
+// without running anything if some name can't be resolved.
+bool AstEvalVisitor_Eval(AstEvalVisitor *, Ast *);
+
+// Compiles the resolved tree into thunks and runs them, with the globals
+// already in place
+void Thunk_Run(AstEvalVisitor *);
+
+// The explicit-stack evaluator: Loop_Start sets it up to run the resolved
+// tree, and each Loop_Resume runs it for at most the given number of steps,
+// returning true once the program has finished.
+void Loop_Start(AstEvalVisitor *);
+
+bool Loop_Resume(AstEvalVisitor *, u32 steps);
+
+void Loop_Release(AstEvalVisitor *);
+
+Activation *PushFrame(AstEvalVisitor *, u32 numLocals, Activation *parent);
+
+void PopFrame(AstEvalVisitor *);
+
+void PushOperand(AstEvalVisitor *, const Value *);
+
+bool PopOperand(AstEvalVisitor *, Value *);
 
 u32 NumOperands(const AstEvalVisitor *);
 
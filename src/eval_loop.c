@@ -0,0 +1,353 @@
+#include "eval.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+// An evaluator that never recurses on the C stack. What is left to do lives
+// in an explicit stack of tasks, each a node and how far along it is, and one
+// loop runs whichever task is on top. A node that needs a child evaluated
+// advances its own step, pushes the child, and finds the child's value on
+// the value stack when it comes back to the top.
+//
+// Values, tasks and frames are arrays that grow as needed and are only ever
+// referred to by index, so script recursion is bounded by memory rather than
+// the native stack, and the whole state can be left where it is between
+// calls to Loop_Resume.
+//
+// A frame's locals are on the value stack at Base, with its operands right
+// above. Calling a script function leaves the callee and arguments where the
+// call evaluated them: the arguments become the first locals of the new frame.
+// Frame 0 is the globals.
+
+typedef struct LoopTask {
+	AstIndex Node;
+	u32 Step;
+} LoopTask;
+
+typedef struct LoopFrame {
+	u32 Base;
+	u32 NumLocals;
+	u32 Parent; // frame of the enclosing function
+	u32 Tasks; // task count while the function runs, its call on top
+	Value Result;
+} LoopFrame;
+
+// Object.Self for functions defined by the loop
+typedef struct LoopClosure {
+	AstIndex Function;
+	u32 Parent;
+} LoopClosure;
+
+typedef struct EvalLoop {
+	Value *Values;
+	LoopTask *Tasks;
+	LoopFrame *Frames;
+	u32 NumValues, NumTasks, NumFrames;
+	u32 ValueCapacity, TaskCapacity, FrameCapacity;
+} EvalLoop;
+
+// Step of a call whose function is running; anything below is the number of
+// arguments evaluated so far, plus one for the callee
+#define STEP_RETURN UINT32_MAX
+
+#define RESERVE(array, count, capacity, needed) \
+	if ((count) + (needed) > (capacity)) { \
+		(capacity) = (capacity) ? 2 * (capacity) : 64; \
+		while ((count) + (needed) > (capacity)) \
+			(capacity) *= 2; \
+		(array) = realloc((array), (capacity) * sizeof(*(array))); \
+		if ((array) == NULL) { \
+			LOG(Eval, Error, "[loop] out of memory"); \
+			Eval_Abort(); \
+		} \
+	}
+
+static void PushValue(EvalLoop *l, Value value) {
+	RESERVE(l->Values, l->NumValues, l->ValueCapacity, 1);
+	l->Values[l->NumValues++] = value;
+}
+
+static Value PopValue(EvalLoop *l) {
+	assert(l->NumValues > 0);
+	return l->Values[--l->NumValues];
+}
+
+static void PushTask(EvalLoop *l, AstIndex node) {
+	if (node == AST_NONE)
+		return;
+	RESERVE(l->Tasks, l->NumTasks, l->TaskCapacity, 1);
+	l->Tasks[l->NumTasks++] = (LoopTask) { node, 0 };
+}
+
+static LoopFrame *CurrentFrame(EvalLoop *l) {
+	return &l->Frames[l->NumFrames - 1];
+}
+
+static void PushFrameAt(EvalLoop *l, u32 base, u32 numLocals, u32 parent) {
+	RESERVE(l->Frames, l->NumFrames, l->FrameCapacity, 1);
+	RESERVE(l->Values, base, l->ValueCapacity, numLocals);
+	if (base + numLocals > l->NumValues)
+		memset(&l->Values[l->NumValues], 0, (base + numLocals - l->NumValues) * sizeof(Value));
+	l->NumValues = base + numLocals;
+	l->Frames[l->NumFrames++] = (LoopFrame) {
+		.Base = base, .NumLocals = numLocals, .Parent = parent, .Tasks = l->NumTasks,
+		.Result = { .Type = Value_Uint, .Uint = 0 },
+	};
+}
+
+static Value *Lookup(EvalLoop *l, const AstNode *identifier) {
+	const LoopFrame *frame = &l->Frames[0];
+	if (identifier->Lhs != AST_GLOBAL) {
+		frame = CurrentFrame(l);
+		for (u32 depth = identifier->Lhs; depth > 0; depth--)
+			frame = &l->Frames[frame->Parent];
+	}
+	assert(identifier->Rhs < frame->NumLocals);
+	return &l->Values[frame->Base + identifier->Rhs];
+}
+
+static Value Literal(AstEvalVisitor *v, const AstNode *node) {
+	u32 x = (u32) String_ToUint(&AST_TOKEN(v->Ast, node->Token)->Text);
+	return (Value) { .Type = Value_Uint, .Uint = x };
+}
+
+// Pushes a task to evaluate a child, except that names and literals are
+// pushed straight onto the value stack rather than making a trip around
+// the loop
+static void PushChild(AstEvalVisitor *v, EvalLoop *l, AstIndex index) {
+	const AstNode *node = AST_NODE(v->Ast, index);
+	if (node->Type == AstNode_Identifier)
+		PushValue(l, *Lookup(l, node));
+	else if (node->Type == AstNode_Literal)
+		PushValue(l, Literal(v, node));
+	else
+		PushTask(l, index);
+}
+
+static bool ToBoolean(const Value *value) {
+	switch (value->Type) {
+		case Value_Uint:
+			return value->Uint != 0;
+		case Value_Object:
+			return value->Object != NULL;
+		default:
+			abort();
+	}
+}
+
+static Value ApplyOperator(AstEvalVisitor *v, const Token *oper, Value a, Value b) {
+	if (a.Type != Value_Uint || b.Type != Value_Uint) {
+		SourcePosition at = Ast_Position(v->Ast, oper);
+		LOG(Eval, Error, "%d:%d: operands of '%.*s' must be integers", at.Line, at.Column, oper->Text.Length, (const char *) oper->Text.Bytes);
+		Eval_Abort();
+	}
+	Value result = { .Type = Value_Uint };
+	switch (oper->Type) {
+		case Token_Plus: result.Uint = a.Uint + b.Uint; break;
+		case Token_Minus: result.Uint = a.Uint - b.Uint; break;
+		case Token_Multiply: result.Uint = a.Uint * b.Uint; break;
+		case Token_Divide:
+			if (b.Uint == 0) {
+				SourcePosition at = Ast_Position(v->Ast, oper);
+				LOG(Eval, Error, "%d:%d: division by zero", at.Line, at.Column);
+				Eval_Abort();
+			}
+			result.Uint = a.Uint / b.Uint;
+			break;
+		case Token_CompareEq: result.Uint = a.Uint == b.Uint; break;
+		case Token_CompareNotEq: result.Uint = a.Uint != b.Uint; break;
+		default: {
+			SourcePosition at = Ast_Position(v->Ast, oper);
+			LOG(Eval, Error, "%d:%d: unsupported operator '%.*s'", at.Line, at.Column, oper->Text.Length, (const char *) oper->Text.Bytes);
+			Eval_Abort();
+		}
+	}
+	return result;
+}
+
+// OpInvoke for loop functions, which only the loop itself knows how to call
+static void InvokeLoopFunction(AstEvalVisitor *v, void *self) {
+	LOG(Eval, Error, "script functions can't be called from native code here");
+	Eval_Abort();
+}
+
+static void DefineFunctions(AstEvalVisitor *v, EvalLoop *l, const AstNode *block) {
+	for (u32 i = 0; i < AST_LIST_LENGTH(v->Ast, block->Lhs); i++) {
+		AstIndex statement = AST_LIST_ITEM(v->Ast, block->Lhs, i);
+		const AstNode *function = AST_NODE(v->Ast, statement);
+		if (function->Type != AstNode_Function)
+			continue;
+		LoopClosure *closure = malloc(sizeof(LoopClosure));
+		*closure = (LoopClosure) { statement, l->NumFrames - 1 };
+		Object *object = malloc(sizeof(Object));
+		*object = (Object) { .Self = closure, .OpInvoke = InvokeLoopFunction };
+		l->Values[CurrentFrame(l)->Base + AST_EXTRA(v->Ast, function, 3)] = (Value) { .Type = Value_Object, .Object = object };
+	}
+}
+
+// Calls the function below the count arguments on top of the value stack.
+// Script functions get a frame and their body pushed; native ones run right
+// away, in an activation of the tree walker's so they see the operands the
+// way they expect, and their result replaces the callee.
+static void Call(AstEvalVisitor *v, EvalLoop *l, LoopTask *task, u32 count) {
+	u32 base = l->NumValues - count;
+	Value callee = l->Values[base - 1];
+	if (callee.Type != Value_Object || callee.Object == NULL || callee.Object->OpInvoke == NULL) {
+		LOG(Eval, Error, "called something that isn't a function");
+		Eval_Abort();
+	}
+	Object *object = callee.Object;
+	if (object->OpInvoke == InvokeLoopFunction) {
+		const LoopClosure *closure = object->Self;
+		const AstNode *function = AST_NODE(v->Ast, closure->Function);
+		u32 parameters = AST_LIST_LENGTH(v->Ast, function->Lhs);
+		if (count != parameters) {
+			const String *name = &AST_TOKEN(v->Ast, function->Token)->Text;
+			LOG(Eval, Error, "'%.*s' takes %d arguments, %d given", name->Length, (const char *) name->Bytes, parameters, count);
+			Eval_Abort();
+		}
+		task->Step = STEP_RETURN;
+		PushFrameAt(l, base, AST_EXTRA(v->Ast, function, 2), closure->Parent);
+		PushTask(l, AST_EXTRA(v->Ast, function, 1));
+		return;
+	}
+
+	PushFrame(v, 0, NULL);
+	for (u32 i = count; i > 0; i--)
+		PushOperand(v, &l->Values[base + i - 1]);
+	object->OpInvoke(v, object->Self);
+	Value result = { .Type = Value_Uint, .Uint = 0 };
+	PopOperand(v, &result);
+	PopFrame(v);
+	l->NumValues = base - 1;
+	PushValue(l, result);
+	l->NumTasks--;
+}
+
+// Runs the task on top of the stack for one step
+static void Step(AstEvalVisitor *v, EvalLoop *l) {
+	LoopTask *task = &l->Tasks[l->NumTasks - 1];
+	const AstNode *node = AST_NODE(v->Ast, task->Node);
+	switch (node->Type) {
+		case AstNode_Block: {
+			// statements leave nothing behind, see eval_Block
+			LoopFrame *frame = CurrentFrame(l);
+			l->NumValues = frame->Base + frame->NumLocals;
+			if (task->Step == 0)
+				DefineFunctions(v, l, node);
+			u32 count = AST_LIST_LENGTH(v->Ast, node->Lhs);
+			while (task->Step < count && AST_NODE(v->Ast, AST_LIST_ITEM(v->Ast, node->Lhs, task->Step))->Type == AstNode_Function)
+				task->Step++;
+			if (task->Step == count) {
+				l->NumTasks--;
+			}
+			else {
+				AstIndex statement = AST_LIST_ITEM(v->Ast, node->Lhs, task->Step++);
+				PushTask(l, statement);
+			}
+			break;
+		}
+		case AstNode_If:
+			if (task->Step++ == 0) {
+				PushChild(v, l, node->Lhs);
+			}
+			else {
+				Value condition = PopValue(l);
+				AstIndex branch = AST_EXTRA(v->Ast, node, ToBoolean(&condition) ? 0 : 1);
+				l->NumTasks--;
+				PushTask(l, branch);
+			}
+			break;
+		case AstNode_Return:
+			if (task->Step++ == 0 && node->Lhs != AST_NONE) {
+				PushChild(v, l, node->Lhs);
+			}
+			else {
+				LoopFrame *frame = CurrentFrame(l);
+				if (node->Lhs != AST_NONE)
+					frame->Result = PopValue(l);
+				// unwind to the call, or finish at the top level
+				l->NumTasks = frame->Tasks;
+			}
+			break;
+		case AstNode_FunctionCall: {
+			u32 count = AST_LIST_LENGTH(v->Ast, node->Rhs);
+			if (task->Step == STEP_RETURN) {
+				LoopFrame *frame = CurrentFrame(l);
+				Value result = frame->Result;
+				l->NumValues = frame->Base - 1;
+				l->NumFrames--;
+				PushValue(l, result);
+				l->NumTasks--;
+			}
+			else if (task->Step == 0) {
+				task->Step++;
+				PushChild(v, l, node->Lhs);
+			}
+			else if (task->Step <= count) {
+				AstIndex argument = AST_LIST_ITEM(v->Ast, node->Rhs, task->Step - 1);
+				task->Step++;
+				PushChild(v, l, argument);
+			}
+			else {
+				Call(v, l, task, count);
+			}
+			break;
+		}
+		case AstNode_Expression:
+			if (task->Step == 0) {
+				task->Step++;
+				PushChild(v, l, node->Lhs);
+			}
+			else if (task->Step == 1) {
+				task->Step++;
+				PushChild(v, l, node->Rhs);
+			}
+			else {
+				Value b = PopValue(l), a = PopValue(l);
+				PushValue(l, ApplyOperator(v, AST_TOKEN(v->Ast, node->Token), a, b));
+				l->NumTasks--;
+			}
+			break;
+		case AstNode_Identifier:
+			PushValue(l, *Lookup(l, node));
+			l->NumTasks--;
+			break;
+		case AstNode_Literal:
+			PushValue(l, Literal(v, node));
+			l->NumTasks--;
+			break;
+		default:
+			l->NumTasks--;
+			break;
+	}
+}
+
+void Loop_Start(AstEvalVisitor *v) {
+	EvalLoop *l = calloc(1, sizeof(EvalLoop));
+	// the globals, copied from the ones AstEvalVisitor_Eval set up
+	PushFrameAt(l, 0, v->Globals->NumLocals, 0);
+	memcpy(l->Values, v->Globals->Locals, v->Globals->NumLocals * sizeof(Value));
+	PushTask(l, v->Ast->Root);
+	v->Loop = l;
+}
+
+bool Loop_Resume(AstEvalVisitor *v, u32 steps) {
+	EvalLoop *l = v->Loop;
+	for (; steps > 0 && l->NumTasks > 0; steps--)
+		Step(v, l);
+	return l->NumTasks == 0;
+}
+
+void Loop_Release(AstEvalVisitor *v) {
+	EvalLoop *l = v->Loop;
+	if (l) {
+		free(l->Values);
+		free(l->Tasks);
+		free(l->Frames);
+		free(l);
+	}
+	v->Loop = NULL;
+}
@@ -0,0 +1,335 @@
+#include "eval.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <assert.h>
+
+// A middle tier between walking the tree and compiling bytecode: the resolved
+// tree is turned once into thunks, one per node, each holding the C function
+// that runs it and everything it needs already worked out: its children,
+// literal values, the frame depth and slot of a name, the operator of an
+// expression. Running a thunk never looks at a node type or token text again.
+//
+// Thunks return the value of their expression directly, so the operand stack
+// only holds the arguments of calls in progress. Thunks sit in one array
+// indexed like Ast.Nodes, and child lists in one array of pointers indexed
+// like Ast.Children.
+
+typedef struct Thunk Thunk;
+
+typedef Value (*ThunkFn)(AstEvalVisitor *, const Thunk *);
+
+struct Thunk {
+	ThunkFn Run;
+	const Token *Token;
+	union {
+		Value Constant; // Literal
+		struct { const Thunk *Lhs, *Rhs; }; // Expression
+		struct { const Thunk *Condition, *Then, *Else; }; // If
+		struct { const Thunk *Callee, **Arguments; u32 NumArguments; }; // FunctionCall
+		struct { const Thunk **Statements; u32 NumFunctions, NumStatements; }; // Block, functions first
+		struct { const Thunk *Body; u32 NumParameters, NumLocals; }; // Function, Return
+	};
+	u32 Depth, Slot; // Identifier; a Function's slot in its block's frame
+};
+
+typedef struct ThunkBuilder {
+	const Ast *Ast;
+	Thunk *Thunks;
+	const Thunk **Lists;
+} ThunkBuilder;
+
+// Object.Self for functions defined by thunks
+typedef struct ThunkClosure {
+	const Thunk *Function;
+	Activation *Parent;
+} ThunkClosure;
+
+static const Value NOTHING = { .Type = Value_Uint, .Uint = 0 };
+
+static void TypeError(AstEvalVisitor *v, const Thunk *t) {
+	SourcePosition at = Ast_Position(v->Ast, t->Token);
+	LOG(Eval, Error, "%d:%d: operands of '%.*s' must be integers", at.Line, at.Column, t->Token->Text.Length, (const char *) t->Token->Text.Bytes);
+	Eval_Abort();
+}
+
+static Value run_Nothing(AstEvalVisitor *v, const Thunk *t) {
+	return NOTHING;
+}
+
+static Value run_Constant(AstEvalVisitor *v, const Thunk *t) {
+	return t->Constant;
+}
+
+static Value run_Global(AstEvalVisitor *v, const Thunk *t) {
+	return v->Globals->Locals[t->Slot];
+}
+
+static Value run_Local(AstEvalVisitor *v, const Thunk *t) {
+	return v->Frame->Locals[t->Slot];
+}
+
+static Value run_Outer(AstEvalVisitor *v, const Thunk *t) {
+	Activation *frame = v->Frame;
+	for (u32 depth = t->Depth; depth > 0; depth--)
+		frame = frame->Parent;
+	return frame->Locals[t->Slot];
+}
+
+#define THUNK_OPERATORS(X) \
+	X(Token_Plus, Add, a.Uint + b.Uint) \
+	X(Token_Minus, Sub, a.Uint - b.Uint) \
+	X(Token_Multiply, Mul, a.Uint * b.Uint) \
+	X(Token_CompareEq, Eq, a.Uint == b.Uint) \
+	X(Token_CompareNotEq, Ne, a.Uint != b.Uint)
+
+#define THUNK_OPERATOR(token, name, result) \
+	static Value run_##name(AstEvalVisitor *v, const Thunk *t) { \
+		Value a = t->Lhs->Run(v, t->Lhs); \
+		Value b = t->Rhs->Run(v, t->Rhs); \
+		if (a.Type != Value_Uint || b.Type != Value_Uint) \
+			TypeError(v, t); \
+		return (Value) { .Type = Value_Uint, .Uint = (result) }; \
+	}
+THUNK_OPERATORS(THUNK_OPERATOR)
+#undef THUNK_OPERATOR
+
+static Value run_Div(AstEvalVisitor *v, const Thunk *t) {
+	Value a = t->Lhs->Run(v, t->Lhs);
+	Value b = t->Rhs->Run(v, t->Rhs);
+	if (a.Type != Value_Uint || b.Type != Value_Uint)
+		TypeError(v, t);
+	if (b.Uint == 0) {
+		SourcePosition at = Ast_Position(v->Ast, t->Token);
+		LOG(Eval, Error, "%d:%d: division by zero", at.Line, at.Column);
+		Eval_Abort();
+	}
+	return (Value) { .Type = Value_Uint, .Uint = a.Uint / b.Uint };
+}
+
+static bool ToBoolean(const Value *value) {
+	switch (value->Type) {
+		case Value_Uint:
+			return value->Uint != 0;
+		case Value_Object:
+			return value->Object != NULL;
+		default:
+			abort();
+	}
+}
+
+static Value run_If(AstEvalVisitor *v, const Thunk *t) {
+	Value condition = t->Condition->Run(v, t->Condition);
+	const Thunk *branch = ToBoolean(&condition) ? t->Then : t->Else;
+	return branch->Run(v, branch);
+}
+
+static Value run_Return(AstEvalVisitor *v, const Thunk *t) {
+	v->Frame->Result = t->Body->Run(v, t->Body);
+	v->Frame->Returned = true;
+	return NOTHING;
+}
+
+// Functions are never run, only defined by the block they are in
+static Value run_Function(AstEvalVisitor *v, const Thunk *t) {
+	return NOTHING;
+}
+
+static void InvokeThunk(AstEvalVisitor *v, void *self);
+
+static Value run_Block(AstEvalVisitor *v, const Thunk *t) {
+	Activation *frame = v->Frame;
+	// Functions are visible throughout the block, so define them first
+	for (u32 i = 0; i < t->NumFunctions; i++) {
+		const Thunk *function = t->Statements[i];
+		ThunkClosure *closure = malloc(sizeof(ThunkClosure));
+		*closure = (ThunkClosure) { function, frame };
+		Object *object = malloc(sizeof(Object));
+		*object = (Object) { .Self = closure, .OpInvoke = InvokeThunk };
+		frame->Locals[function->Slot] = (Value) { .Type = Value_Object, .Object = object };
+	}
+	const Thunk *const *statement = &t->Statements[t->NumFunctions];
+	for (u32 i = 0; i < t->NumStatements && !frame->Returned; i++)
+		statement[i]->Run(v, statement[i]);
+	return NOTHING;
+}
+
+static void ArgumentCountError(const Thunk *function, u32 count) {
+	const String *name = &function->Token->Text;
+	LOG(Eval, Error, "'%.*s' takes %d arguments, %d given", name->Length, (const char *) name->Bytes, function->NumParameters, count);
+	Eval_Abort();
+}
+
+// Runs a thunk function in the frame pushed for it, once its parameters are
+// in place
+static Value RunFunction(AstEvalVisitor *v, const Thunk *function) {
+	Activation *frame = v->Frame;
+	// falling off the end returns 0, as in compiled code
+	frame->Result = NOTHING;
+	function->Body->Run(v, function->Body);
+	return frame->Result;
+}
+
+// OpInvoke for thunk functions, taking the arguments in reverse on the
+// operand stack like other objects do (see eval.c). run_Call doesn't go
+// through this for them.
+static void InvokeThunk(AstEvalVisitor *v, void *self) {
+	const Thunk *function = ((const ThunkClosure *) self)->Function;
+	Activation *frame = v->Frame;
+	if (frame->NumOperands != function->NumParameters)
+		ArgumentCountError(function, (u32) frame->NumOperands);
+	for (u32 i = 0; i < function->NumParameters; i++)
+		frame->Locals[i] = frame->Operands[function->NumParameters - i - 1];
+	frame->NumOperands = 0;
+	Value result = RunFunction(v, function);
+	PushOperand(v, &result);
+}
+
+static Value run_Call(AstEvalVisitor *v, const Thunk *t) {
+	Value callee = t->Callee->Run(v, t->Callee);
+	if (callee.Type != Value_Object || callee.Object == NULL || callee.Object->OpInvoke == NULL) {
+		LOG(Eval, Error, "called something that isn't a function");
+		Eval_Abort();
+	}
+
+	// The arguments wait on the caller's operand stack, so calls among them
+	// put their frames above
+	Activation *caller = v->Frame;
+	for (u32 i = 0; i < t->NumArguments; i++) {
+		Value argument = t->Arguments[i]->Run(v, t->Arguments[i]);
+		PushOperand(v, &argument);
+	}
+	Value *arguments = &caller->Operands[caller->NumOperands - t->NumArguments];
+
+	Object *object = callee.Object;
+	Value result = NOTHING;
+	if (object->OpInvoke == InvokeThunk) {
+		const ThunkClosure *closure = object->Self;
+		const Thunk *function = closure->Function;
+		if (t->NumArguments != function->NumParameters)
+			ArgumentCountError(function, t->NumArguments);
+		Activation *frame = PushFrame(v, function->NumLocals, closure->Parent);
+		for (u32 i = 0; i < t->NumArguments; i++)
+			frame->Locals[i] = arguments[i];
+		result = RunFunction(v, function);
+	}
+	else {
+		PushFrame(v, 0, NULL);
+		for (u32 i = t->NumArguments; i > 0; i--)
+			PushOperand(v, &arguments[i - 1]);
+		object->OpInvoke(v, object->Self);
+		PopOperand(v, &result);
+	}
+	PopFrame(v);
+	caller->NumOperands -= t->NumArguments;
+	return result;
+}
+
+static const Thunk *Build(ThunkBuilder *b, AstIndex index);
+
+// Builds the thunks of a list, and returns the list of pointers to them
+static const Thunk **BuildList(ThunkBuilder *b, u32 list) {
+	const Thunk **items = &b->Lists[list + 1];
+	for (u32 i = 0; i < AST_LIST_LENGTH(b->Ast, list); i++)
+		items[i] = Build(b, AST_LIST_ITEM(b->Ast, list, i));
+	return items;
+}
+
+static ThunkFn OperatorThunk(const Ast *ast, const Token *oper) {
+	switch (oper->Type) {
+#define THUNK_OPERATOR(token, name, result) case token: return run_##name;
+		THUNK_OPERATORS(THUNK_OPERATOR)
+#undef THUNK_OPERATOR
+		case Token_Divide: return run_Div;
+		default: {
+			SourcePosition at = Ast_Position(ast, oper);
+			LOG(Eval, Error, "%d:%d: unsupported operator '%.*s'", at.Line, at.Column, oper->Text.Length, (const char *) oper->Text.Bytes);
+			Eval_Abort();
+		}
+	}
+}
+
+static const Thunk *Build(ThunkBuilder *b, AstIndex index) {
+	const Ast *ast = b->Ast;
+	const AstNode *node = AST_NODE(ast, index);
+	Thunk *t = &b->Thunks[index];
+	*t = (Thunk) { .Run = run_Nothing, .Token = AST_TOKEN(ast, node->Token) };
+	if (index == AST_NONE)
+		return t;
+	switch (node->Type) {
+		case AstNode_Block: {
+			// functions first, see run_Block
+			const Thunk **items = &b->Lists[node->Lhs + 1];
+			u32 count = AST_LIST_LENGTH(ast, node->Lhs), n = 0;
+			for (u32 i = 0; i < count; i++) {
+				AstIndex statement = AST_LIST_ITEM(ast, node->Lhs, i);
+				if (AST_NODE(ast, statement)->Type == AstNode_Function)
+					items[n++] = Build(b, statement);
+			}
+			t->NumFunctions = n;
+			for (u32 i = 0; i < count; i++) {
+				AstIndex statement = AST_LIST_ITEM(ast, node->Lhs, i);
+				if (AST_NODE(ast, statement)->Type != AstNode_Function)
+					items[n++] = Build(b, statement);
+			}
+			t->Run = run_Block;
+			t->Statements = items;
+			t->NumStatements = n - t->NumFunctions;
+			break;
+		}
+		case AstNode_Function:
+			t->Run = run_Function;
+			t->Body = Build(b, AST_EXTRA(ast, node, 1));
+			t->NumParameters = AST_LIST_LENGTH(ast, node->Lhs);
+			t->NumLocals = AST_EXTRA(ast, node, 2);
+			t->Slot = AST_EXTRA(ast, node, 3);
+			break;
+		case AstNode_If:
+			t->Run = run_If;
+			t->Condition = Build(b, node->Lhs);
+			t->Then = Build(b, AST_EXTRA(ast, node, 0));
+			t->Else = Build(b, AST_EXTRA(ast, node, 1));
+			break;
+		case AstNode_Return:
+			t->Run = run_Return;
+			t->Body = Build(b, node->Lhs);
+			break;
+		case AstNode_FunctionCall:
+			t->Run = run_Call;
+			t->Callee = Build(b, node->Lhs);
+			t->Arguments = BuildList(b, node->Rhs);
+			t->NumArguments = AST_LIST_LENGTH(ast, node->Rhs);
+			break;
+		case AstNode_Expression:
+			t->Run = OperatorThunk(ast, t->Token);
+			t->Lhs = Build(b, node->Lhs);
+			t->Rhs = Build(b, node->Rhs);
+			break;
+		case AstNode_Identifier:
+			t->Run = node->Lhs == AST_GLOBAL ? run_Global : node->Lhs == 0 ? run_Local : run_Outer;
+			t->Depth = node->Lhs;
+			t->Slot = node->Rhs;
+			break;
+		case AstNode_Literal:
+			t->Run = run_Constant;
+			t->Constant = (Value) { .Type = Value_Uint, .Uint = (u32) String_ToUint(&t->Token->Text) };
+			break;
+		default:
+			break;
+	}
+	return t;
+}
+
+void Thunk_Run(AstEvalVisitor *v) {
+	const Ast *ast = v->Ast;
+	ThunkBuilder b = {
+		.Ast = ast,
+		.Thunks = malloc(ast->NumNodes * sizeof(Thunk)),
+		.Lists = malloc(ast->NumChildren * sizeof(Thunk *)),
+	};
+	const Thunk *root = Build(&b, ast->Root);
+	LOG(Eval, Info, "[thunk] built %u thunks", ast->NumNodes);
+	root->Run(v, root);
+	free(b.Thunks);
+	free(b.Lists);
+}
@@ -3,14 +3,50 @@
 #include "types.h"
 
 DECLARE_TYPE(Function);
+DECLARE_TYPE(Instruction);
+DECLARE_TYPE(RegInstruction);
 DECLARE_TYPE(VM);
 
-#define FF_NATIVE 0x01
+#define FF_NATIVE   0x01
+#define FF_VOID     0x02 // returns without leaving a value on the caller's stack
+#define FF_VERIFIED 0x04 // set by Module_Verify
+#define FF_JIT      0x08 // has native code in Jit, see jit.c
+#define FF_REGISTER 0x10 // has register bytecode in RegCode, see regcode.c
+#define FF_FUSED    0x20 // Body was rewritten by Module_Fuse, and is the function's own
+
+// A bytecode instruction decoded into fixed-width form with its operands and
+// branch target already resolved, see VM_DecodeFunction
+struct Instruction {
+	const void *Handler; // dispatch label when VM_COMPUTED_GOTO, else NULL
+	u32 Opcode;
+	u32 PC; // byte offset of the instruction in Body
+	s32 Immediate; // PUSH value, LOAD slot
+	u32 Target; // branch target, as an index into Code
+	s32 Depth; // operand stack depth on entry, -1 if unreachable
+	const Function *Callee;
+};
+
+// A register bytecode instruction, see regcode.h
+struct RegInstruction {
+	const void *Handler; // dispatch label when VM_COMPUTED_GOTO, else NULL
+	u32 Opcode;
+	u32 PC; // byte offset in Body of the stack instruction it came from
+	u16 A, B, C;
+	s32 Immediate;
+	u32 Target; // branch target, as an index into RegCode
+	const Function *Callee;
+};
 
 struct Function {
 	const char *Name; // for debug purposes only
 	u32 NumArgs;
 	u32 Flags;
+	u32 MaxStack; // deepest operand stack, including args, set by Module_Verify
+	const Instruction *Code; // decoded Body, set by Module_Verify
+	const u32 *CodeIndex; // byte offset in Body -> index into Code
+	u32 (*Jit)(VM *, u32 *args); // returns the function's result
+	const RegInstruction *RegCode;
+	const u32 *RegIndex; // byte offset in Body -> index into RegCode
 	union {
 		struct {
 			const u8 *Bytes;
@@ -5,9 +5,12 @@
 #include <stdlib.h>
 
 #include "types.h"
+#include "vm.h"
 
 extern void OutputDebugStringA(const char *str);
 
+void Push(VM *vm, u32 x);
+
 #define LOCK(x)
 #define UNLOCK(x)
 
@@ -41,11 +44,11 @@ static void PrintChar(int ch) {
 
 void PrintUint(const Value *value) {
 	LOCK(mutex);
-	int nc = _scprintf("%zu", value->Uint);
+	int nc = _scprintf("%u", value->Uint);
 	if (WritePos + nc + 1 >= PRINT_BUF_SIZE)
 		Flush();
 	if (nc > 0) {
-		nc = snprintf(&PrintBuf[WritePos], PRINT_BUF_SIZE - WritePos, "%zu", value->Uint);
+		nc = snprintf(&PrintBuf[WritePos], PRINT_BUF_SIZE - WritePos, "%u", value->Uint);
 		if (nc > 0)
 			WritePos += nc;
 	}
@@ -72,3 +75,21 @@ void io_println_OpInvoke(AstEvalVisitor *v, void *unused) {
 	PrintChar('\n');
 	UNLOCK(mutex);
 }
+
+void io_println_Native(VM *vm) {
+	LOCK(mutex);
+	Frame *frame = CURRENT_FRAME(vm);
+	u32 nargs = frame->Function->NumArgs;
+	for (u32 i = 0; i < nargs; i++) {
+		Value operand = { .Type = Value_Uint, .Uint = vm->Memory[ARG_ADDRESS(frame, i)] };
+		PrintUint(&operand);
+		if (i + 1 < nargs) {
+			PrintChar(' ');
+		}
+	}
+	PrintChar('\n');
+	// println is an expression like any other call, so it returns 0
+	frame->SP = frame->BP;
+	Push(vm, 0);
+	UNLOCK(mutex);
+}
@@ -1,5 +1,8 @@
 #pragma once
 
 #include "eval.h"
+#include "vm.h"
 
-void io_println_OpInvoke(AstEvalVisitor *, void *);
\ No newline at end of file
+void io_println_OpInvoke(AstEvalVisitor *, void *);
+
+void io_println_Native(VM *);
\ No newline at end of file
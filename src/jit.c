@@ -0,0 +1,625 @@
+
+#include "jit.h"
+#include "vm.h"
+#include "opcode.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Baseline JIT. Each function is translated one instruction at a time from its
+// decoded form. Because the verifier fixes the stack depth at every
+// instruction, each operand stack slot is simply [rbx + 4 * depth], where rbx
+// holds &Memory[BP]; the top of stack is additionally kept in eax between
+// instructions whenever possible, and written back before branches, calls and
+// branch targets. r12 holds the VM.
+//
+// Generated functions follow the platform C calling convention, as
+// u32 fn(VM *vm, u32 *args), so the interpreter and JIT code call each other
+// freely. A function calling itself is a direct call that only counts the
+// frame against the VM's call stack; every other call goes through JitCall, which
+// pushes a real Frame and dispatches to native, JIT or interpreted code.
+// Native stack is the scarcer of the two, so once it's used up to the VM's
+// NativeStackLimit, self-calls go through JitCall as well, and every call
+// from there on runs interpreted.
+
+#if defined(_M_X64) || defined(__x86_64__)
+
+#ifdef _WIN32
+extern void *VirtualAlloc(void *address, size_t size, u32 type, u32 protect);
+extern int VirtualProtect(void *address, size_t size, u32 protect, u32 *old);
+extern int VirtualFree(void *address, size_t size, u32 type);
+#define MEM_COMMIT 0x1000
+#define MEM_RESERVE 0x2000
+#define MEM_RELEASE 0x8000
+#define PAGE_READWRITE 0x04
+#define PAGE_EXECUTE_READ 0x20
+#else
+#include <sys/mman.h>
+#endif
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12 };
+
+#ifdef _WIN32
+static const int ARGS[] = { RCX, RDX, R8, R9 };
+#define FRAME_RESERVE 40 // shadow space, plus keeping rsp 16-byte aligned
+#else
+static const int ARGS[] = { RDI, RSI, RDX, RCX };
+#define FRAME_RESERVE 8
+#endif
+
+#define VM_DEPTH ((s32) offsetof(VM, CallStack.Depth))
+#define VM_CAPACITY ((s32) offsetof(VM, CallStack.Capacity))
+#define VM_MEMORY ((s32) offsetof(VM, Memory))
+#define VM_MEMORY_SIZE ((s32) offsetof(VM, MemorySize))
+#define VM_NATIVE_LIMIT ((s32) offsetof(VM, NativeStackLimit))
+#define SLOT(d) ((s32) (4 * (d)))
+
+typedef struct Fixup {
+	u32 At; // position of a rel32
+	u32 Target; // instruction index it refers to
+} Fixup;
+
+typedef struct Jit {
+	const Function *Function;
+	u8 *Bytes;
+	u32 Length, Capacity;
+	u32 *Offsets; // instruction index -> code offset
+	bool *IsTarget;
+	Fixup *Fixups;
+	u32 NumFixups;
+	bool Cached; // the top of stack is in eax rather than memory
+} Jit;
+
+static u32 JitCall(VM *vm, const Function *callee, u32 *args) {
+	PANIC_IF(vm, !HAS_FRAME(vm));
+	u32 bp = (u32) (args - vm->Memory);
+	Frame *frame = &vm->CallStack.Frames[vm->CallStack.Depth++];
+	*frame = (Frame) { .Function = callee, .PC = 0, .BP = bp, .SP = bp + callee->NumArgs };
+	u32 value = 0;
+	if (callee->Flags & FF_NATIVE) {
+		callee->Native(vm);
+		if (frame->SP > frame->BP)
+			value = vm->Memory[frame->SP - 1];
+		vm->CallStack.Depth--;
+	}
+	else if (!HAS_STACK(vm, bp + callee->MaxStack)) {
+		VM_Panic(vm, "stack overflow calling %s", callee->Name);
+	}
+	else if ((callee->Flags & FF_JIT) && VM_HasNativeStack(vm)) {
+		value = callee->Jit(vm, args);
+		vm->CallStack.Depth--;
+	}
+	else {
+		value = VM_ExecuteCall(vm);
+	}
+	return value;
+}
+
+// Self-calls don't write their frames, so describe the running function
+// before panicking
+static void SetCurrentFrame(VM *vm, const Function *function, u32 *args) {
+	u32 bp = (u32) (args - vm->Memory);
+	*CURRENT_FRAME(vm) = (Frame) { .Function = function, .PC = 0, .BP = bp, .SP = bp + function->NumArgs };
+}
+
+static void JitOverflow(VM *vm, const Function *function, u32 *args) {
+	SetCurrentFrame(vm, function, args);
+	VM_Panic(vm, "stack overflow calling %s", function->Name);
+}
+
+// Grows the stacks for a self-call whose arguments start at slot base
+static void JitGrow(VM *vm, const Function *function, u32 *args, uint64_t base) {
+	u32 bp = (u32) (args - vm->Memory) + (u32) base;
+	if (!HAS_FRAME(vm) || !HAS_STACK(vm, bp + function->MaxStack))
+		JitOverflow(vm, function, args);
+}
+
+static void JitSoftwarePanic(VM *vm, const Function *function, u32 *args) {
+	SetCurrentFrame(vm, function, args);
+	VM_Panic(vm, "software panic");
+}
+
+static void JitDivideByZero(VM *vm, const Function *function, u32 *args) {
+	SetCurrentFrame(vm, function, args);
+	VM_Panic(vm, "division by zero");
+}
+
+
+static void Emit(Jit *j, const void *bytes, u32 count) {
+	if (j->Length + count > j->Capacity) {
+		j->Capacity = j->Capacity ? 2 * j->Capacity : 256;
+		j->Bytes = realloc(j->Bytes, j->Capacity);
+	}
+	memcpy(&j->Bytes[j->Length], bytes, count);
+	j->Length += count;
+}
+
+static void Byte(Jit *j, u8 x) {
+	Emit(j, &x, 1);
+}
+
+static void Dword(Jit *j, u32 x) {
+	u8 bytes[] = { $(x) };
+	Emit(j, bytes, 4);
+}
+
+static void Qword(Jit *j, uint64_t x) {
+	Dword(j, (u32) x);
+	Dword(j, (u32) (x >> 32));
+}
+
+static void Rex(Jit *j, bool w, int reg, int rm) {
+	u8 rex = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+	if (rex != 0x40)
+		Byte(j, rex);
+}
+
+// op reg, [base + disp32]
+static void OpMem(Jit *j, bool w, u8 opcode, int reg, int base, s32 disp) {
+	Rex(j, w, reg, base);
+	Byte(j, opcode);
+	Byte(j, 0x80 | (reg & 7) << 3 | (base & 7));
+	if ((base & 7) == RSP)
+		Byte(j, 0x24);
+	Dword(j, (u32) disp);
+}
+
+// op rm, reg
+static void OpReg(Jit *j, bool w, u8 opcode, int reg, int rm) {
+	Rex(j, w, reg, rm);
+	Byte(j, opcode);
+	Byte(j, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void MovImm64(Jit *j, int reg, uint64_t x) {
+	Rex(j, true, 0, reg);
+	Byte(j, 0xB8 + (reg & 7));
+	Qword(j, x);
+}
+
+static void CallAbsolute(Jit *j, const void *target) {
+	MovImm64(j, RAX, (uint64_t) (uintptr_t) target);
+	Byte(j, 0xFF); // call rax
+	Byte(j, 0xD0);
+}
+
+static void PanicCall(Jit *j, const void *helper) {
+	OpReg(j, true, 0x89, R12, ARGS[0]);
+	MovImm64(j, ARGS[1], (uint64_t) (uintptr_t) j->Function);
+	OpReg(j, true, 0x89, RBX, ARGS[2]);
+	CallAbsolute(j, helper);
+}
+
+// Emits a rel32 jump (jcc when cc != 0) to an instruction, patched at the end
+static void Branch(Jit *j, u8 cc, u32 target) {
+	if (cc) {
+		Byte(j, 0x0F);
+		Byte(j, cc);
+	}
+	else {
+		Byte(j, 0xE9);
+	}
+	j->Fixups[j->NumFixups++] = (Fixup) { j->Length, target };
+	Dword(j, 0);
+}
+
+static void PatchHere(Jit *j, u32 at) {
+	u32 rel = j->Length - (at + 4);
+	memcpy(&j->Bytes[at], &rel, 4);
+}
+
+static void Flush(Jit *j, s32 depth) {
+	if (j->Cached) {
+		OpMem(j, false, 0x89, RAX, RBX, SLOT(depth - 1));
+		j->Cached = false;
+	}
+}
+
+// Loads the two operands of a binary operator into eax (left) and either ecx
+// or memory (right); returns true if the right operand is in ecx.
+static bool BinaryOperands(Jit *j, s32 depth) {
+	bool inRegister = j->Cached;
+	if (inRegister)
+		OpReg(j, false, 0x89, RAX, RCX);
+	OpMem(j, false, 0x8B, RAX, RBX, SLOT(depth - 2));
+	return inRegister;
+}
+
+static void Arithmetic(Jit *j, s32 depth, u8 opMem, u8 opReg) {
+	if (BinaryOperands(j, depth))
+		OpReg(j, false, opReg, RCX, RAX);
+	else
+		OpMem(j, false, opMem, RAX, RBX, SLOT(depth - 1));
+	j->Cached = true;
+}
+
+static void Multiply(Jit *j, s32 depth) {
+	if (BinaryOperands(j, depth)) {
+		Byte(j, 0x0F);
+		OpReg(j, false, 0xAF, RAX, RCX);
+	}
+	else {
+		Byte(j, 0x0F);
+		OpMem(j, false, 0xAF, RAX, RBX, SLOT(depth - 1));
+	}
+	j->Cached = true;
+}
+
+// Unsigned, like the interpreter; a zero divisor panics
+static void Divide(Jit *j, s32 depth) {
+	if (!BinaryOperands(j, depth))
+		OpMem(j, false, 0x8B, RCX, RBX, SLOT(depth - 1));
+	OpReg(j, false, 0x85, RCX, RCX); // test ecx, ecx
+	u8 jnz[] = { 0x0F, 0x85 };
+	Emit(j, jnz, 2);
+	u32 toDivide = j->Length;
+	Dword(j, 0);
+	PanicCall(j, JitDivideByZero);
+	PatchHere(j, toDivide);
+	OpReg(j, false, 0x31, RDX, RDX); // xor edx, edx
+	OpReg(j, false, 0xF7, 6, RCX); // div ecx
+	j->Cached = true;
+}
+
+static void Compare(Jit *j, s32 depth, u8 setcc) {
+	if (BinaryOperands(j, depth))
+		OpReg(j, false, 0x39, RCX, RAX);
+	else
+		OpMem(j, false, 0x3B, RAX, RBX, SLOT(depth - 1));
+	u8 bytes[] = { 0x0F, setcc, 0xC0, 0x0F, 0xB6, 0xC0 }; // setcc al; movzx eax, al
+	Emit(j, bytes, sizeof(bytes));
+	j->Cached = true;
+}
+
+static void Prologue(Jit *j) {
+	u8 bytes[] = { 0x53, 0x41, 0x54, 0x48, 0x83, 0xEC, FRAME_RESERVE }; // push rbx; push r12; sub rsp
+	Emit(j, bytes, sizeof(bytes));
+	OpReg(j, true, 0x89, ARGS[0], R12);
+	OpReg(j, true, 0x89, ARGS[1], RBX);
+}
+
+static void Epilogue(Jit *j) {
+	u8 bytes[] = { 0x48, 0x83, 0xC4, FRAME_RESERVE, 0x41, 0x5C, 0x5B, 0xC3 }; // add rsp; pop r12; pop rbx; ret
+	Emit(j, bytes, sizeof(bytes));
+}
+
+// Calls through JitCall, which pushes a real frame
+static void CallThrough(Jit *j, const Function *callee, s32 base) {
+	OpReg(j, true, 0x89, R12, ARGS[0]);
+	MovImm64(j, ARGS[1], (uint64_t) (uintptr_t) callee);
+	OpMem(j, true, 0x8D, ARGS[2], RBX, SLOT(base));
+	CallAbsolute(j, JitCall);
+}
+
+static void SelfCall(Jit *j, s32 base) {
+	const Function *function = j->Function;
+
+	// Short of native stack, go through JitCall, which runs the call interpreted
+	OpMem(j, true, 0x3B, RSP, R12, VM_NATIVE_LIMIT); // cmp rsp, NativeStackLimit
+	u8 jbe[] = { 0x0F, 0x86 };
+	Emit(j, jbe, 2);
+	u32 toInterpret = j->Length;
+	Dword(j, 0);
+
+	// Same checks as a CALL in the interpreter: frame count, then stack memory;
+	// JitGrow commits more of either, or panics
+	OpMem(j, false, 0x8B, RCX, R12, VM_CAPACITY);
+	OpMem(j, false, 0x39, RCX, R12, VM_DEPTH);
+	u8 jae[] = { 0x0F, 0x83 };
+	Emit(j, jae, 2);
+	u32 toGrow1 = j->Length;
+	Dword(j, 0);
+	OpMem(j, true, 0x8D, RAX, RBX, SLOT(base + function->MaxStack));
+	OpMem(j, true, 0x2B, RAX, R12, VM_MEMORY); // sub rax, Memory
+	OpReg(j, true, 0xC1, 5, RAX); // shr rax, 2
+	Byte(j, 2);
+	OpMem(j, false, 0x3B, RAX, R12, VM_MEMORY_SIZE);
+	u8 ja[] = { 0x0F, 0x87 };
+	Emit(j, ja, 2);
+	u32 toGrow2 = j->Length;
+	Dword(j, 0);
+	Byte(j, 0xE9);
+	u32 toCall1 = j->Length;
+	Dword(j, 0);
+
+	PatchHere(j, toGrow1);
+	PatchHere(j, toGrow2);
+	MovImm64(j, ARGS[3], (uint64_t) base);
+	PanicCall(j, JitGrow);
+	Byte(j, 0xE9);
+	u32 toCall2 = j->Length;
+	Dword(j, 0);
+
+	PatchHere(j, toCall1);
+	PatchHere(j, toCall2);
+	OpMem(j, false, 0xFF, 0, R12, VM_DEPTH); // inc
+	OpReg(j, true, 0x89, R12, ARGS[0]);
+	OpMem(j, true, 0x8D, ARGS[1], RBX, SLOT(base));
+	Byte(j, 0xE8);
+	Dword(j, (u32) -(s32) (j->Length + 4));
+	OpMem(j, false, 0xFF, 1, R12, VM_DEPTH); // dec
+	Byte(j, 0xE9);
+	u32 toDone = j->Length;
+	Dword(j, 0);
+
+	PatchHere(j, toInterpret);
+	CallThrough(j, function, base);
+	PatchHere(j, toDone);
+}
+
+static bool CompileInstruction(Jit *j, const Instruction *instr);
+
+// Compiles a superinstruction as the sequence it stands for; each part shares
+// the decoded operands and only needs its own entry depth
+static bool CompileSequence(Jit *j, const Instruction *instr, const u8 *sequence) {
+	Instruction part = *instr;
+	for (u32 i = 0; i < MAX_SEQUENCE && sequence[i] != NOP; i++) {
+		part.Opcode = sequence[i];
+		if (!CompileInstruction(j, &part))
+			return false;
+		switch (part.Opcode) {
+			case PUSH:
+				part.Depth++;
+				break;
+			case CALL:
+				part.Depth -= (s32) part.Callee->NumArgs;
+				if ((part.Callee->Flags & FF_VOID) == 0)
+					part.Depth++;
+				break;
+			default:
+				part.Depth--; // binary operators and BZ
+				break;
+		}
+	}
+	return true;
+}
+
+static bool CompileInstruction(Jit *j, const Instruction *instr) {
+	s32 d = instr->Depth;
+	switch (instr->Opcode) {
+		case NOP:
+			break;
+		case PUSH:
+			Flush(j, d);
+			Byte(j, 0xB8);
+			Dword(j, (u32) instr->Immediate);
+			j->Cached = true;
+			break;
+		case LOAD:
+			Flush(j, d);
+			OpMem(j, false, 0x8B, RAX, RBX, SLOT(instr->Immediate));
+			j->Cached = true;
+			break;
+		case POP:
+			j->Cached = false;
+			break;
+		case DUP:
+			if (j->Cached)
+				OpMem(j, false, 0x89, RAX, RBX, SLOT(d - 1));
+			else
+				OpMem(j, false, 0x8B, RAX, RBX, SLOT(d - 1));
+			j->Cached = true;
+			break;
+		case XCHG:
+			Flush(j, d);
+			OpMem(j, false, 0x8B, RAX, RBX, SLOT(d - 2));
+			OpMem(j, false, 0x8B, RCX, RBX, SLOT(d - 1));
+			OpMem(j, false, 0x89, RCX, RBX, SLOT(d - 2));
+			j->Cached = true;
+			break;
+		case CALL:
+		case CALL_SELF: {
+			const Function *callee = instr->Callee;
+			s32 base = d - (s32) callee->NumArgs;
+			Flush(j, d);
+			if (callee == j->Function) {
+				SelfCall(j, base);
+			}
+			else {
+				CallThrough(j, callee, base);
+			}
+			j->Cached = (callee->Flags & FF_VOID) == 0;
+			break;
+		}
+		case RET:
+			if ((j->Function->Flags & FF_VOID) == 0 && !j->Cached)
+				OpMem(j, false, 0x8B, RAX, RBX, SLOT(d - 1));
+			Epilogue(j);
+			j->Cached = false;
+			break;
+		case ADD:
+			Arithmetic(j, d, 0x03, 0x01);
+			break;
+		case SUB:
+			Arithmetic(j, d, 0x2B, 0x29);
+			break;
+		case MUL:
+			Multiply(j, d);
+			break;
+		case DIV:
+			Divide(j, d);
+			break;
+		case EQ:
+			Compare(j, d, 0x94);
+			break;
+		case NE:
+			Compare(j, d, 0x95);
+			break;
+		case LT:
+			Compare(j, d, 0x92);
+			break;
+		case LTE:
+			Compare(j, d, 0x96);
+			break;
+		case BZ:
+		case BNZ:
+			if (j->Cached) {
+				OpReg(j, false, 0x85, RAX, RAX);
+			}
+			else {
+				OpMem(j, false, 0x83, 7, RBX, SLOT(d - 1));
+				Byte(j, 0);
+			}
+			j->Cached = false;
+			Branch(j, instr->Opcode == BZ ? 0x84 : 0x85, instr->Target);
+			break;
+		case BNE:
+			if (!j->Cached)
+				OpMem(j, false, 0x8B, RAX, RBX, SLOT(d - 1));
+			OpMem(j, false, 0x39, RAX, RBX, SLOT(d - 2));
+			j->Cached = false;
+			Branch(j, 0x85, instr->Target);
+			break;
+		case JMP:
+			Flush(j, d);
+			Branch(j, 0, instr->Target);
+			break;
+		case PANIC:
+			Flush(j, d);
+			PanicCall(j, JitSoftwarePanic);
+			break;
+		case TAILCALL:
+			return CompileSequence(j, instr, (const u8[MAX_SEQUENCE]) { CALL, RET });
+		case TAILCALL_SELF: {
+			// Move the arguments into place and start over, in the same frame
+			s32 base = d - (s32) j->Function->NumArgs;
+			Flush(j, d);
+			for (s32 i = 0; i < (s32) j->Function->NumArgs; i++) {
+				OpMem(j, false, 0x8B, RAX, RBX, SLOT(base + i));
+				OpMem(j, false, 0x89, RAX, RBX, SLOT(i));
+			}
+			Branch(j, 0, 0);
+			break;
+		}
+#define X(M, ...) \
+		case M: \
+			return CompileSequence(j, instr, (const u8[MAX_SEQUENCE]) { __VA_ARGS__ });
+		SUPERINSTRUCTIONS
+#undef X
+		default:
+			// HALT only appears in the entry function, which always runs interpreted
+			return false;
+	}
+	return true;
+}
+
+// Each function's code gets a mapping of its own, which starts with the
+// mapping's size so that Jit_Release can unmap it; the code follows, aligned
+#define CODE_HEADER 16
+
+static void FreeExecutable(u8 *mapping, size_t size) {
+#ifdef _WIN32
+	(void) size;
+	VirtualFree(mapping, 0, MEM_RELEASE);
+#else
+	munmap(mapping, size);
+#endif
+}
+
+static void *MakeExecutable(const u8 *bytes, u32 length) {
+	size_t size = CODE_HEADER + (size_t) length;
+#ifdef _WIN32
+	u32 old;
+	u8 *mapping = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (mapping == NULL)
+		return NULL;
+	memcpy(mapping, &size, sizeof(size));
+	memcpy(mapping + CODE_HEADER, bytes, length);
+	bool ok = VirtualProtect(mapping, size, PAGE_EXECUTE_READ, &old) != 0;
+#else
+	u8 *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED)
+		return NULL;
+	memcpy(mapping, &size, sizeof(size));
+	memcpy(mapping + CODE_HEADER, bytes, length);
+	bool ok = mprotect(mapping, size, PROT_READ | PROT_EXEC) == 0;
+#endif
+	if (!ok) {
+		FreeExecutable(mapping, size);
+		return NULL;
+	}
+	return mapping + CODE_HEADER;
+}
+
+void Jit_Release(Function *function) {
+	if ((function->Flags & FF_JIT) == 0)
+		return;
+	u8 *mapping = (u8 *) (uintptr_t) function->Jit - CODE_HEADER;
+	size_t size;
+	memcpy(&size, mapping, sizeof(size));
+	FreeExecutable(mapping, size);
+	function->Jit = NULL;
+	function->Flags &= ~FF_JIT;
+}
+
+static bool CompileFunction(Function *function) {
+	u32 count = 0;
+	while (function->Code[count].PC < function->Body.Length)
+		count++;
+
+	Jit j = {
+		.Function = function,
+		.Offsets = calloc(count, sizeof(u32)),
+		.IsTarget = calloc(count, sizeof(bool)),
+		.Fixups = calloc(count, sizeof(Fixup))
+	};
+	for (u32 i = 0; i < count; i++) {
+		const Instruction *instr = &function->Code[i];
+		if (Opcode_IsBranch(instr->Opcode))
+			j.IsTarget[instr->Target] = true;
+	}
+
+	bool ok = true;
+	Prologue(&j);
+	for (u32 i = 0; i < count && ok; i++) {
+		const Instruction *instr = &function->Code[i];
+		if (instr->Depth < 0)
+			continue; // unreachable
+		if (j.IsTarget[i])
+			Flush(&j, instr->Depth);
+		j.Offsets[i] = j.Length;
+		ok = CompileInstruction(&j, instr);
+	}
+
+	if (ok) {
+		for (u32 i = 0; i < j.NumFixups; i++) {
+			u32 rel = j.Offsets[j.Fixups[i].Target] - (j.Fixups[i].At + 4);
+			memcpy(&j.Bytes[j.Fixups[i].At], &rel, 4);
+		}
+		void *code = MakeExecutable(j.Bytes, j.Length);
+		if (code) {
+			function->Jit = (u32 (*)(VM *, u32 *)) code;
+			function->Flags |= FF_JIT;
+			TRACE("[jit] %s: %d bytes", function->Name, j.Length);
+		}
+		ok = code != NULL;
+	}
+
+	free(j.Bytes);
+	free(j.Offsets);
+	free(j.IsTarget);
+	free(j.Fixups);
+	return ok;
+}
+
+u32 Jit_CompileModule(Module *module) {
+	u32 count = 0;
+	for (u32 i = 1; i < module->NumFunctions; i++) {
+		Function *function = &module->Functions[i];
+		if ((function->Flags & (FF_VERIFIED | FF_JIT)) == FF_VERIFIED && CompileFunction(function))
+			count++;
+	}
+	return count;
+}
+
+#else
+
+u32 Jit_CompileModule(Module *module) {
+	return 0;
+}
+
+void Jit_Release(Function *function) {
+}
+
+#endif
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "module.h"
+
+// Compiles every verified bytecode function it can to x86-64 machine code and
+// marks it FF_JIT. Anything it can't handle, or everything when not running on
+// x86-64, stays with the interpreter. Returns the number of functions compiled.
+u32 Jit_CompileModule(Module *);
+
+// Frees the function's machine code, if it has any, and clears FF_JIT
+void Jit_Release(Function *);
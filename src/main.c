@@ -4,9 +4,7 @@
 #include <ctype.h>
 #include <string.h>
 #include <assert.h>
-
-#include <sys/types.h>
-#include <sys/stat.h>
+#include <time.h>
 
 #include "vm.h"
 #include "module.h"
@@ -16,19 +14,127 @@
 #include "parser.h"
 #include "ast.h"
 #include "eval.h"
+#include "compiler.h"
+#include "jit.h"
+#include "source.h"
+#include "recorder.h"
+#include "cache.h"
 
-void printToken(const Token *token) {
+void printToken(Scanner *scanner, const Token *token) {
     const char *type = TokenType_ToString(token->Type);
-    TRACE("Token { .Type=%s, .Text='%.*s', .Line=%d, .Column=%d }", type, token->Text.Length, token->Text.Bytes, token->Line, token->Column);
+    SourcePosition at = Scanner_Position(scanner, token);
+    TRACE("Token { .Type=%s, .Text='%.*s', .Line=%d, .Column=%d }", type, token->Text.Length, token->Text.Bytes, at.Line, at.Column);
 }
 
-void scan(const u8 *buf, size_t size) {
-    Scanner *scanner = Scanner_New(buf, (u32) size);
+void scan(Scanner *scanner) {
     Token token;
     TRACE("<begin token list>");
     while (Scanner_ReadNext(scanner, &token))
-        printToken(&token);
-	 TRACE("<end token list>");
+        printToken(scanner, &token);
+    TRACE("<end token list>");
+    Scanner_Release(scanner);
+}
+
+// Wall clock seconds, since clock() adds up the time of every thread on some
+// systems
+static double now() {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, int rounds, u32 count, const char *units, size_t size, double seconds) {
+    if (seconds <= 0)
+        seconds = 1e-9;
+    TRACE("%s%d rounds, %u %s in %.3f s: %.1f M%s/s, %.1f MB/s", what, rounds, count, units, seconds,
+        count / seconds / 1e6, units, (double) size * rounds / seconds / (1 << 20));
+}
+
+// Parses the text over and over, to see how fast the parser is
+void benchParse(const u8 *buf, size_t size, int rounds) {
+    u32 nodes = 0;
+    double start = now();
+    for (int i = 0; i < rounds; i++) {
+        Scanner *scanner = Scanner_New(buf, (u32) size);
+        Parser *parser = Parser_New(scanner);
+        Ast *ast = Parser_BuildAst(parser);
+        if (ast->Root == AST_NONE)
+            ERROR("[parser] the script doesn't parse");
+        nodes += ast->NumNodes;
+        Ast_Release(ast);
+        Parser_Release(parser);
+        Scanner_Release(scanner);
+    }
+    report("[parser] ", rounds, nodes, "nodes", size, now() - start);
+}
+
+// Prints the tokens found by Scanner_Tokenize
+void printTokens(const u8 *buf, size_t size, u32 threads) {
+    u32 count;
+    Token *tokens = Scanner_Tokenize(buf, (u32) size, threads, &count);
+    Scanner *scanner = Scanner_New(buf, (u32) size);
+    TRACE("<begin token list>");
+    for (u32 i = 0; i < count; i++)
+        printToken(scanner, &tokens[i]);
+    TRACE("<end token list>");
+    Scanner_Release(scanner);
+    free(tokens);
+}
+
+// Scans the text over and over without printing anything, to see how fast
+// the scanner is
+void benchScan(const u8 *buf, size_t size, int rounds) {
+    u32 tokens = 0;
+    double start = now();
+    for (int i = 0; i < rounds; i++) {
+        Scanner *scanner = Scanner_New(buf, (u32) size);
+        Token token;
+        while (Scanner_ReadNext(scanner, &token))
+            tokens++;
+        Scanner_Release(scanner);
+    }
+    report("[scanner] ", rounds, tokens, "tokens", size, now() - start);
+}
+
+static bool sameTokens(const Token *x, const Token *y) {
+    return x->Type == y->Type && x->Pos == y->Pos && String_Equals(&x->Text, &y->Text) &&
+        (x->Atom == y->Atom || String_Equals(Atom_Name(x->Atom), Atom_Name(y->Atom)));
+}
+
+// Tokenizes the text on 1, 2, 4... up to the given number of threads,
+// checking the tokens are the ones a scan on one thread gives
+void benchTokenize(const u8 *buf, size_t size, int rounds, u32 maxThreads) {
+    Scanner *scanner = Scanner_New(buf, (u32) size);
+    u32 count = 0, capacity = 1024;
+    Token *expected = malloc(capacity * sizeof(Token));
+    while (Scanner_ReadNext(scanner, &expected[count])) {
+        if (++count == capacity)
+            expected = realloc(expected, (capacity *= 2) * sizeof(Token));
+    }
+    Scanner_Release(scanner);
+
+    for (u32 threads = 1;; threads = threads * 2 < maxThreads ? threads * 2 : maxThreads) {
+        u32 tokens = 0;
+        bool same = true;
+        double start = now();
+        for (int i = 0; i < rounds; i++) {
+            u32 n;
+            Token *t = Scanner_Tokenize(buf, (u32) size, threads, &n);
+            same = same && n == count;
+            for (u32 j = 0; same && j < n; j++)
+                same = sameTokens(&t[j], &expected[j]);
+            tokens += n;
+            free(t);
+        }
+        char what[32];
+        snprintf(what, sizeof(what), "[scanner] %u threads, ", threads);
+        report(what, rounds, tokens, "tokens", size, now() - start);
+        if (!same)
+            ERROR("[scanner] tokens on %u threads differ from those on one", threads);
+        if (threads == maxThreads)
+            break;
+    }
+    free(expected);
 }
 
 char *fill(char *buf, char ch, int count) {
@@ -58,7 +164,7 @@ char *indent(char *buf, int count) {
 typedef struct AstVisitor AstVisitor;
 typedef struct PrintVisitor PrintVisitor;
 
-#define X(f,T) void (* ## f ## )(T *, const Ast ## f ## Node *);
+#define X(f,T) void (* ## f ## )(T *, const Ast *, AstIndex);
 
 typedef struct AstVisitorVtbl {
 	VISITOR_VTBL_FNS(AstVisitor)
@@ -80,84 +186,79 @@ typedef struct PrintVisitor {
 } PrintVisitor;
 
 
-void print(const AstNode *node, int level) {
+void print(const Ast *ast, AstIndex index, int level) {
 	char buf[512];
 	char *ind = indent(buf, level);
 	level += 1;
-	if (node != NULL) {
+	if (index != AST_NONE) {
+		const AstNode *node = AST_NODE(ast, index);
+		const Token *token = AST_TOKEN(ast, node->Token);
 		switch (node->Type) {
 			case AstNode_Module: {
-				AST_FOREACH(x, AST_CAST(AstModuleNode, node)->Statements, print(x, level));
+				AST_FOREACH(x, ast, node->Lhs, print(ast, x, level));
 				break;
 			}
 			case AstNode_Function: {
-				AstFunctionNode *fn = AST_CAST(AstFunctionNode, node);
-				if (fn->ReturnType.Type == Token_None)
-					TRACE("%s[function: %.*s]", ind, TOKEN(fn->Identifier));
+				const Token *returnType = AST_TOKEN(ast, AST_EXTRA(ast, node, 0));
+				if (returnType->Type == Token_None)
+					TRACE("%s[function: %.*s]", ind, TOKEN(*token));
 				else
-					TRACE("%s[function: %.*s -> %.*s]", ind, TOKEN(fn->Identifier), TOKEN(fn->ReturnType));
-				AST_FOREACH(x, AST_CAST(AstNode, fn->Body), print(x, level));
-				TRACE("%s[/function: %.*s]", ind, TOKEN(fn->Identifier));
+					TRACE("%s[function: %.*s -> %.*s]", ind, TOKEN(*token), TOKEN(*returnType));
+				print(ast, AST_EXTRA(ast, node, 1), level);
+				TRACE("%s[/function: %.*s]", ind, TOKEN(*token));
 				break;
 			}
 			case AstNode_If: {
-				AstIfNode *iff = AST_CAST(AstIfNode, node);
+				// not in buf, which ind points into
+				char tmp[256];
+				indent(tmp, level);
 				TRACE("%s[if]", ind);
-				TRACE("%s[condition]", indent(buf, level));
-				print(iff->Condition, level + 1);
-				TRACE("%s[/condition]", indent(buf, level));
-				TRACE("%s[if-true]", indent(buf, level));
-				print(iff->TrueBranch, level + 1);
-				TRACE("%s[/if-true]", indent(buf, level));
-				TRACE("%s[if-false]", indent(buf, level));
-				print(iff->FalseBranch, level + 1);
-				TRACE("%s[/if-false]", ind);
+				TRACE("%s[condition]", tmp);
+				print(ast, node->Lhs, level + 1);
+				TRACE("%s[/condition]", tmp);
+				TRACE("%s[if-true]", tmp);
+				print(ast, AST_EXTRA(ast, node, 0), level + 1);
+				TRACE("%s[/if-true]", tmp);
+				TRACE("%s[if-false]", tmp);
+				print(ast, AST_EXTRA(ast, node, 1), level + 1);
+				TRACE("%s[/if-false]", tmp);
 				break;
 			}
 			case AstNode_Block: {
 				TRACE("%s[block]", ind);
-				AST_FOREACH(x, AST_CAST(AstBlockNode, node)->Statements, print(x, level));
+				AST_FOREACH(x, ast, node->Lhs, print(ast, x, level));
 				TRACE("%s[/block]", ind);
 				break;
 			}
 			case AstNode_Return: {
 				TRACE("%s[return]", ind);
-				print((AstNode *) AST_CAST(AstReturnNode, node)->Expression, level);
+				print(ast, node->Lhs, level);
 				TRACE("%s[/return]", ind);
 				break;
 			}
 			case AstNode_Expression: {
-				AstExpressionNode *expr = AST_CAST(AstExpressionNode, node);
-				TRACE("%s[expression: %.*s]", ind, TOKEN(expr->Operator));
-				print(node->Left, level);
-				print(node->Right, level);
-				TRACE("%s[/expression]", ind, TOKEN(expr->Operator));
+				TRACE("%s[expression: %.*s]", ind, TOKEN(*token));
+				print(ast, node->Lhs, level);
+				print(ast, node->Rhs, level);
+				TRACE("%s[/expression]", ind);
 				break;
 			}
 			case AstNode_Literal: {
-				const AstLiteralNode *lit = AST_CAST(AstLiteralNode, node);
-				const char *quote = lit->Token.Type == Token_StringLiteral ? "'" : "";
-				TRACE("%s[literal: %s%.*s%s]", ind, quote, TOKEN(lit->Token), quote);
+				const char *quote = token->Type == Token_StringLiteral ? "'" : "";
+				TRACE("%s[literal: %s%.*s%s]", ind, quote, TOKEN(*token), quote);
 				break;
 			}
 			case AstNode_Identifier: {
-				TRACE("%s[identifier: %.*s]", ind, TOKEN(AST_CAST(AstIdentifierNode, node)->Token));
+				TRACE("%s[identifier: %.*s]", ind, TOKEN(*token));
 				break;
 			}
 			case AstNode_FunctionCall: {
 				char tmp[256];
 				indent(tmp, level);
 				TRACE("%s[function-call]", ind);
-				AstFunctionCallNode *fncall = AST_CAST(AstFunctionCallNode, node);
-				print(fncall->Function, level);
-				int i = 0;
-				AstNode *arg = fncall->Arguments;
-				while (arg) {
-					i++;
-					arg = arg->Right;
-				}
-				TRACE("%s[arguments: %d]", tmp, i);
-				AST_FOREACH(x, fncall->Arguments, print(x->Left, level + 1));
+				print(ast, node->Lhs, level);
+				TRACE("%s[arguments: %d]", tmp, AST_LIST_LENGTH(ast, node->Rhs));
+				AST_FOREACH(x, ast, node->Rhs, print(ast, x, level + 1));
 				TRACE("%s[/arguments]", tmp);
 				TRACE("%s[/function-call]", ind);
 				break;
@@ -170,49 +271,264 @@ void print(const AstNode *node, int level) {
 	}
 }
 
-void parse(const u8 *buf, size_t size) {
-	Scanner *s = Scanner_New(buf, (u32)size);
+static bool UseEvaluator = false;
+static bool Specialize = false;
+static bool CompileThunks = false;
+static bool Iterative = false;
+static bool TraceVM = false;
+static bool UseJit = false;
+static bool Failed = false; // the script didn't open, resolve or compile
+static bool UseFusion = true;
+static bool UseRegisters = false;
+static int BenchScanRounds = 0;
+static int BenchParseRounds = 0;
+static bool PrintTokens = false;
+static bool Stream = false;
+static u32 Threads = 0;
+static const char *RecordPath = NULL;
+static const char *EmitPath = NULL;
+static const char *CacheDir = NULL;
+static bool PrintCacheStats = false;
+static const char *DecodePath = NULL;
+static DecodeFormat Decode = DECODE_TEXT;
+static VMLimits Limits = { .MaxMemory = DEFAULT_MAX_MEMORY, .MaxFrames = DEFAULT_MAX_FRAMES };
+
+void run(const Module *module) {
+	VM vm;
+	if (!VM_Init(&vm, module, &Limits))
+		return;
+	if (TraceVM)
+		vm.Flags |= VMFLAG_TRACE;
+	if (UseRegisters)
+		vm.Flags |= VMFLAG_REGISTER;
+	if (RecordPath && Recorder_Start(RECORDER_CAPACITY, RecordPath))
+		vm.Flags |= VMFLAG_RECORD;
+	while ((vm.Flags & VMFLAG_HALT) == 0)
+		VM_Run(&vm);
+	if (vm.Flags & VMFLAG_RECORD) {
+		if (Recorder_Save(module))
+			TRACE("[recorder] saved to %s", RecordPath);
+		Recorder_Stop();
+	}
+	VM_Free(&vm);
+}
+
+// Runs a compiled module, or one loaded from a file
+void execute(Module *module) {
+	// the passes are run outside TRACE, which skips its arguments when
+	// logging is off
+	if (UseFusion) {
+		u32 fused = Module_Fuse(module);
+		TRACE("[peephole] fused %u instructions", fused);
+	}
+	if (UseRegisters) {
+		u32 translated = Module_TranslateRegisters(module);
+		TRACE("[regcode] translated %u functions", translated);
+	}
+	if (UseJit) {
+		u32 compiled = Jit_CompileModule(module);
+		TRACE("[jit] compiled %u functions", compiled);
+	}
+	run(module);
+}
+
+// Parses what the scanner reads and runs it, or saves it with --emit. buf is
+// the whole text, for the cache, or NULL for a streamed script.
+void parse(Scanner *s, const u8 *buf, size_t size) {
 	Parser *p = Parser_New(s);
-	AstNode *program = Parser_BuildAst(p);
-	print(program, 0);
-	
-	AstEvalVisitor *v = AstEvalVisitor_New();
-	AstEvalVisitor_Eval(v, program);
+	Ast *ast = Parser_BuildAst(p);
+	Parser_Release(p);
+	Scanner_Release(s);
+	print(ast, ast->Root, 0);
+
+	if (UseEvaluator) {
+		AstEvalVisitor *v = AstEvalVisitor_New();
+		v->Specialize = Specialize;
+		v->Compile = CompileThunks;
+		v->Iterative = Iterative;
+		if (!AstEvalVisitor_Eval(v, ast))
+			Failed = true;
+	}
+	else {
+		Compiler *c = Compiler_New();
+		Module *module = Compiler_BuildModule(c, ast);
+		Compiler_Release(c);
+		if (module == NULL)
+			Failed = true;
+		if (module && CacheDir && buf)
+			Cache_Store(CacheDir, buf, (u32) size, module);
+		if (module && EmitPath) {
+			if (Module_Save(module, EmitPath))
+				TRACE("[module] saved to %s", EmitPath);
+		}
+		else if (module)
+			execute(module);
+		Compiler_ReleaseModule(module);
+	}
+	Ast_Release(ast);
 }
 
-int main(int argc, const char *argv[]) {
-    FILE *file = NULL;
-    const char *filename = "scripts/fib.vm";
-    if (fopen_s(&file, filename, "rb") != 0) {
+// Runs the module cached for the script, if there is one
+bool runCached(const u8 *buf, u32 size) {
+	if (CacheDir == NULL || UseEvaluator || EmitPath)
+		return false;
+	Source entry;
+	Module *module = Cache_Load(CacheDir, buf, size, &entry);
+	if (module == NULL)
+		return false;
+	execute(module);
+	Module_Unload(module);
+	Source_Release(&entry);
+	return true;
+}
+
+void printCacheStats(const char *dir) {
+	CacheStats stats;
+	Cache_Stats(dir, &stats);
+	uint64_t lookups = stats.Hits + stats.Misses;
+	TRACE("[cache] %llu hits, %llu misses (%.1f%% hit rate), %llu stores, %llu rejected",
+		(unsigned long long) stats.Hits, (unsigned long long) stats.Misses,
+		lookups ? 100.0 * stats.Hits / lookups : 0.0,
+		(unsigned long long) stats.Stores, (unsigned long long) stats.Rejected);
+}
+
+// Reads the file a chunk at a time as it's parsed, so its text is never held
+// whole. With --tokens the tokens are only printed, since the file may be a
+// pipe that can't be read twice.
+void stream(const char *filename) {
+    FILE *file = stdin;
+    if (strcmp(filename, "-") != 0 && fopen_s(&file, filename, "rb") != 0) {
         fprintf(stderr, "could not open file '%s' for reading\n", filename);
+        Failed = true;
+        return;
+    }
+    Scanner *s = Scanner_NewStream(Source_ReadFile, file);
+    if (PrintTokens)
+        scan(s);
+    else
+        parse(s, NULL, 0);
+    if (file != stdin)
+        fclose(file);
+}
+
+void load(const char *filename) {
+    Source source;
+    if (!Source_Open(&source, filename)) {
+        Failed = true;
+        return;
+    }
+    if (source.Length >= 4 && memcmp(source.Text, MODULE_MAGIC, 4) == 0) {
+        Module *module = Module_Load(source.Text, source.Length);
+        if (module)
+            execute(module);
+        else
+            Failed = true;
+        Module_Unload(module);
     }
-    else {
-        struct stat st;
-        if (fstat(_fileno(file), &st) == 0) {
-            if (st.st_size > 0) {
-                u8 *buf = malloc(st.st_size + 1);
-                if (buf) {
-                    if (fread(buf, 1, st.st_size, file) == st.st_size) {
-                        scan(buf, st.st_size);
-								parse(buf, st.st_size);
-                    }
-                    free(buf);
-                }
+    else if (source.Length > 0) {
+        if (BenchScanRounds > 0 && Threads > 0) {
+            benchTokenize(source.Text, source.Length, BenchScanRounds, Threads);
+        }
+        else if (BenchScanRounds > 0) {
+            benchScan(source.Text, source.Length, BenchScanRounds);
+        }
+        else if (BenchParseRounds > 0) {
+            benchParse(source.Text, source.Length, BenchParseRounds);
+        }
+        else {
+            if (PrintTokens && Threads > 0)
+                printTokens(source.Text, source.Length, Threads);
+            else if (PrintTokens)
+                scan(Scanner_New(source.Text, source.Length));
+            if (!runCached(source.Text, source.Length))
+                parse(Scanner_New(source.Text, source.Length), source.Text, source.Length);
+        }
+    }
+    Source_Release(&source);
+}
+
+int main(int argc, const char *argv[]) {
+    const char **filenames = calloc(argc, sizeof(const char *));
+    int numFiles = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--eval") == 0)
+            UseEvaluator = true;
+        else if (strcmp(argv[i], "--specialize") == 0)
+            UseEvaluator = Specialize = true;
+        else if (strcmp(argv[i], "--thunks") == 0)
+            UseEvaluator = CompileThunks = true;
+        else if (strcmp(argv[i], "--loop") == 0)
+            UseEvaluator = Iterative = true;
+        else if (strcmp(argv[i], "--trace") == 0) {
+            TraceVM = true;
+            TraceLevels[TraceCategory_VM] = TraceLevel_Debug;
+        }
+        else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            if (!Trace_Configure(argv[++i])) {
+                fprintf(stderr, "bad --log setting '%s'\n", argv[i]);
+                free(filenames);
+                return 1;
             }
         }
-        fclose(file);
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+            RecordPath = argv[++i];
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+            CacheDir = argv[++i];
+        else if (strcmp(argv[i], "--cache-stats") == 0)
+            PrintCacheStats = true;
+        else if (strcmp(argv[i], "--emit") == 0 && i + 1 < argc)
+            EmitPath = argv[++i];
+        else if (strcmp(argv[i], "--decode") == 0 && i + 1 < argc)
+            DecodePath = argv[++i];
+        else if (strcmp(argv[i], "--chrome") == 0)
+            Decode = DECODE_CHROME;
+        else if (strcmp(argv[i], "--jit") == 0)
+            UseJit = true;
+        else if (strcmp(argv[i], "--no-fuse") == 0)
+            UseFusion = false;
+        else if (strcmp(argv[i], "--registers") == 0)
+            UseRegisters = true;
+        else if (strcmp(argv[i], "--tokens") == 0)
+            PrintTokens = true;
+        else if (strcmp(argv[i], "--stream") == 0)
+            Stream = true;
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            Threads = (u32) strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--bench-scan") == 0 && i + 1 < argc)
+            BenchScanRounds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--bench-parse") == 0 && i + 1 < argc)
+            BenchParseRounds = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--max-stack") == 0 && i + 1 < argc)
+            Limits.MaxMemory = (u32) strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--max-frames") == 0 && i + 1 < argc)
+            Limits.MaxFrames = (u32) strtoul(argv[++i], NULL, 0);
+        else
+            filenames[numFiles++] = argv[i];
     }
 
-#if 0
-	VM vm;
-	memset(&vm, 0, sizeof(vm));
-	vm.Module = LoadModule();
-	const Function *global = &vm.Module->Functions[0];
-	Frame frame = (Frame){.Function = global, .PC = 0, .BP = 0, .SP = 0};
-	vm.CallStack.Frames[vm.CallStack.Depth++] = frame;
-	while ((vm.Flags & VMFLAG_HALT) == 0)
-		VM_Run(&vm);
-#endif
+    if (DecodePath) {
+        free(filenames);
+        return Recorder_Decode(DecodePath, Decode, stdout) ? 0 : 1;
+    }
+    if (numFiles == 0 && PrintCacheStats && CacheDir) {
+        printCacheStats(CacheDir);
+        free(filenames);
+        return 0;
+    }
+    if (numFiles == 0) {
+        fprintf(stderr, "usage: %s [options] file... ('-' reads standard input)\n", argv[0]);
+        free(filenames);
+        return 1;
+    }
+    for (int i = 0; i < numFiles; i++) {
+        if (Stream)
+            stream(filenames[i]);
+        else
+            load(filenames[i]);
+    }
+    if (PrintCacheStats && CacheDir)
+        printCacheStats(CacheDir);
+    free(filenames);
 
-	return 0;                                         
+	return Failed ? 1 : 0;
 }
\ No newline at end of file
@@ -2,8 +2,11 @@
 #include "module.h"
 #include "opcode.h"
 #include "vm.h"
+#include "jit.h"
 #include "trace.h"
 
+#include <stdlib.h>
+
 // function fib(x) {
 //	if (x == 0) return 0;
 //  if (x == 1) return 0;
@@ -17,7 +20,7 @@ u8 FibBody[] = {
 	DUP,
 	PUSH, $(1), // Check to see if it is an end case
 	LTE,
-	BZ, 6,
+	BZ, $(6),
 	PUSH, $(1),
 	RET,
 	DUP, // Start of recursive case ... fib(x-2)
@@ -42,7 +45,7 @@ u8 MainBody[] = {
 	DUP,
 	PUSH, $(10), // test against limit
 	LT,
-	BNZ, -26,
+	BNZ, $(-29),
 	RET
 };
 
@@ -96,7 +99,7 @@ Function myModule_Functions[] = {
 		.Name = "println",
 		.NumArgs = 1,
 		.Native = Println, 
-		.Flags = FF_NATIVE
+		.Flags = FF_NATIVE | FF_VOID
 	}
 };
 
@@ -118,5 +121,33 @@ Module myModule = {
 };
 
 const Module *LoadModule() {
+	static bool verified = false;
+	if (!verified && !Module_Verify(&myModule))
+		return NULL;
+	verified = true;
 	return &myModule;
-}
\ No newline at end of file
+}
+
+void Module_ReleaseCode(Module *module) {
+	for (u32 i = 0; i < module->NumFunctions; i++) {
+		Function *function = &module->Functions[i];
+		if (function->Flags & FF_NATIVE)
+			continue;
+		Jit_Release(function);
+		free((void *) function->Code);
+		free((void *) function->CodeIndex);
+		free((void *) function->RegCode);
+		free((void *) function->RegIndex);
+		function->Code = NULL;
+		function->CodeIndex = NULL;
+		function->RegCode = NULL;
+		function->RegIndex = NULL;
+		function->Flags &= ~(FF_VERIFIED | FF_REGISTER);
+		if (function->Flags & FF_FUSED) {
+			free((void *) function->Body.Bytes);
+			function->Body.Bytes = NULL;
+			function->Body.Length = 0;
+			function->Flags &= ~FF_FUSED;
+		}
+	}
+}
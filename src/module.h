@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdio.h>
+
 #include "types.h"
 #include "function.h"
 
@@ -47,9 +49,57 @@ typedef struct ConstantTable {
 } ConstantTable;
 
 typedef struct Module {
-	const Function *Functions;
+	Function *Functions;
 	u32 NumFunctions;
     ConstantTable *Constants;
 } Module;
 
-const Module *LoadModule();
\ No newline at end of file
+const Module *LoadModule();
+
+// Checks every bytecode function in the module, marks it FF_VERIFIED and
+// decodes it for the fast interpreter loop.
+// Returns false, after reporting the first problem, if any function fails.
+bool Module_Verify(Module *);
+
+// Rewrites the common instruction sequences in every verified bytecode function
+// into superinstructions (see SUPERINSTRUCTIONS in opcode.h), then verifies and
+// decodes those functions again. Programs behave exactly as they did unfused.
+// Call it before running the module or compiling it with the JIT. Returns the
+// number of instructions rewritten, counting tail and self calls.
+u32 Module_Fuse(Module *);
+
+// Translates every verified bytecode function into register bytecode as well
+// (see regcode.c) and marks it FF_REGISTER; a VM with VMFLAG_REGISTER set runs
+// those with VM_ExecuteRegisters. Returns the number of functions translated.
+u32 Module_TranslateRegisters(Module *);
+
+// Frees what Module_Verify and the passes above added to the functions: decoded,
+// fused, register and JIT code. Each function's Body is left alone unless
+// Module_Fuse replaced it, in which case the fused body is freed and the
+// function has no code left.
+void Module_ReleaseCode(Module *);
+
+// A module can be saved to a file and loaded back, without compiling the
+// script again. The file has a header, a constant pool, a function table that
+// refers to each function's CONSTANT_METHOD, and a data section holding the
+// strings and bytecode. Loading copies nothing out of the data section: each
+// function's Body.Bytes and Name, and each string and byte array constant,
+// point into the bytes given to Module_Load, which must outlive the module
+// and are only ever read. Map the file (see Source_Open) to start without
+// reading it. Natives are saved by name and bound again when loaded.
+//
+// Numbers are in the byte order of the machine that saved the module.
+
+#define MODULE_MAGIC "EXMM"
+
+bool Module_Save(const Module *, const char *path);
+
+// Writes the module at the file's current position, which must be a multiple
+// of four bytes from where it will be loaded from
+bool Module_Write(const Module *, FILE *);
+
+// Returns the module, verified, or NULL if the bytes aren't a valid module
+Module *Module_Load(const u8 *bytes, u32 length);
+
+// Frees what Module_Load allocated, leaving the bytes it was loaded from alone
+void Module_Unload(Module *);
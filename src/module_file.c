@@ -0,0 +1,247 @@
+#include "module.h"
+#include "compiler.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MODULE_VERSION 1
+
+// Offsets are from the start of the file, and every table is 4-byte aligned
+typedef struct ModuleFileHeader {
+	char Magic[4];
+	u32 Version;
+	u32 NumConstants;
+	u32 NumFunctions;
+	u32 Constants; // offset of NumConstants ModuleFileConstants
+	u32 Functions; // offset of NumFunctions ModuleFileFunctions
+	u32 Data; // offset of the data section
+	u32 DataLength;
+} ModuleFileHeader;
+
+typedef struct ModuleFileConstant {
+	u32 Type; // ConstantType
+	// CONSTANT_STRING, CONSTANT_BYTEARRAY: offset into the data section and
+	// length; a string is followed by a zero byte, not counted in its length.
+	// CONSTANT_METHOD: ClassInfo, Name, NumParams, Body, as in MethodInfo.
+	// CONSTANT_CLASS: Name.
+	u32 Fields[4];
+} ModuleFileConstant;
+
+typedef struct ModuleFileFunction {
+	u32 Method; // index of the function's CONSTANT_METHOD, Body 0 for natives
+	u32 Flags; // FF_NATIVE and FF_VOID, the rest are worked out again
+} ModuleFileFunction;
+
+typedef union AnyConstant {
+	Constant Constant;
+	StringConstant String;
+	ByteArrayConstant ByteArray;
+	MethodInfo Method;
+	ClassInfo Class;
+} AnyConstant;
+
+typedef struct Buffer {
+	u8 *Bytes;
+	u32 Length, Capacity;
+} Buffer;
+
+static u32 Append(Buffer *buffer, const void *bytes, u32 count) {
+	if (buffer->Length + count > buffer->Capacity) {
+		buffer->Capacity = buffer->Capacity ? 2 * buffer->Capacity : 256;
+		while (buffer->Length + count > buffer->Capacity)
+			buffer->Capacity *= 2;
+		buffer->Bytes = realloc(buffer->Bytes, buffer->Capacity);
+	}
+	u32 at = buffer->Length;
+	memcpy(&buffer->Bytes[at], bytes, count);
+	buffer->Length += count;
+	return at;
+}
+
+static u32 AddConstant(Buffer *constants, u32 type, u32 a, u32 b, u32 c, u32 d) {
+	ModuleFileConstant constant = { type, { a, b, c, d } };
+	return Append(constants, &constant, sizeof(constant)) / sizeof(constant);
+}
+
+// The pool is built from the functions rather than copied from
+// Module.Constants, since Module_Fuse may have replaced a function's body
+bool Module_Write(const Module *module, FILE *file) {
+	Buffer constants = { 0 }, functions = { 0 }, data = { 0 };
+	AddConstant(&constants, CONSTANT_NONE, 0, 0, 0, 0);
+	for (u32 i = 0; i < module->NumFunctions; i++) {
+		const Function *function = &module->Functions[i];
+		u32 length = (u32) strlen(function->Name);
+		u32 name = AddConstant(&constants, CONSTANT_STRING, Append(&data, function->Name, length + 1), length, 0, 0);
+		u32 body = 0;
+		if ((function->Flags & FF_NATIVE) == 0) {
+			u32 at = Append(&data, function->Body.Bytes, function->Body.Length);
+			body = AddConstant(&constants, CONSTANT_BYTEARRAY, at, function->Body.Length, 0, 0);
+		}
+		ModuleFileFunction entry = {
+			.Method = AddConstant(&constants, CONSTANT_METHOD, 0, name, function->NumArgs, body),
+			.Flags = function->Flags & (FF_NATIVE | FF_VOID),
+		};
+		Append(&functions, &entry, sizeof(entry));
+	}
+
+	ModuleFileHeader header = {
+		.Magic = MODULE_MAGIC,
+		.Version = MODULE_VERSION,
+		.NumConstants = constants.Length / sizeof(ModuleFileConstant),
+		.NumFunctions = module->NumFunctions,
+		.Constants = sizeof(ModuleFileHeader),
+		.Functions = sizeof(ModuleFileHeader) + constants.Length,
+		.Data = sizeof(ModuleFileHeader) + constants.Length + functions.Length,
+		.DataLength = data.Length,
+	};
+
+	fwrite(&header, sizeof(header), 1, file);
+	fwrite(constants.Bytes, 1, constants.Length, file);
+	fwrite(functions.Bytes, 1, functions.Length, file);
+	fwrite(data.Bytes, 1, data.Length, file);
+	free(constants.Bytes);
+	free(functions.Bytes);
+	free(data.Bytes);
+	return ferror(file) == 0;
+}
+
+bool Module_Save(const Module *module, const char *path) {
+	FILE *file;
+	if (fopen_s(&file, path, "wb") != 0) {
+		ERROR("[module] could not open '%s' for writing", path);
+		return false;
+	}
+	bool ok = Module_Write(module, file);
+	if (fclose(file) != 0)
+		ok = false;
+	if (!ok)
+		ERROR("[module] could not write '%s'", path);
+	return ok;
+}
+
+// True if count entries of size bytes at offset lie within length bytes
+static bool InBounds(u32 offset, u32 count, u32 size, u32 length) {
+	return offset % 4 == 0 && (uint64_t) offset + (uint64_t) count * size <= length;
+}
+
+#define FAIL(...) { ERROR("[module] " __VA_ARGS__); Module_Unload(module); return NULL; }
+
+Module *Module_Load(const u8 *bytes, u32 length) {
+	const ModuleFileHeader *header = (const ModuleFileHeader *) bytes;
+	if (length < sizeof(ModuleFileHeader) || memcmp(header->Magic, MODULE_MAGIC, 4) != 0) {
+		ERROR("[module] not a module");
+		return NULL;
+	}
+	if (header->Version != MODULE_VERSION) {
+		ERROR("[module] version %u, expected %u", header->Version, MODULE_VERSION);
+		return NULL;
+	}
+	if (header->NumFunctions == 0 || header->NumConstants == 0
+		|| !InBounds(header->Constants, header->NumConstants, sizeof(ModuleFileConstant), length)
+		|| !InBounds(header->Functions, header->NumFunctions, sizeof(ModuleFileFunction), length)
+		|| (uint64_t) header->Data + header->DataLength > length) {
+		ERROR("[module] truncated or corrupt header");
+		return NULL;
+	}
+	const ModuleFileConstant *fileConstants = (const ModuleFileConstant *) &bytes[header->Constants];
+	const ModuleFileFunction *fileFunctions = (const ModuleFileFunction *) &bytes[header->Functions];
+	const u8 *data = &bytes[header->Data];
+
+	// the module and its constant table share a block, and the constants share another
+	u32 numConstants = header->NumConstants;
+	Module *module = calloc(1, sizeof(Module) + sizeof(ConstantTable));
+	if (module == NULL) {
+		ERROR("[module] out of memory");
+		return NULL;
+	}
+	ConstantTable *table = (ConstantTable *) (module + 1);
+	AnyConstant *pool = calloc(numConstants, sizeof(AnyConstant));
+	table->Entries = malloc(numConstants * sizeof(Constant *));
+	module->Functions = calloc(header->NumFunctions, sizeof(Function));
+	module->Constants = table;
+	if (pool == NULL || table->Entries == NULL || module->Functions == NULL) {
+		free(pool);
+		free(table->Entries);
+		table->Entries = NULL;
+		FAIL("out of memory");
+	}
+	for (u32 i = 0; i < numConstants; i++)
+		table->Entries[i] = &pool[i].Constant;
+	table->Count = numConstants;
+
+	for (u32 i = 0; i < numConstants; i++) {
+		const ModuleFileConstant *constant = &fileConstants[i];
+		const u32 *f = constant->Fields;
+		switch (constant->Type) {
+			case CONSTANT_NONE:
+				pool[i].Constant = (Constant) { CONSTANT_NONE };
+				break;
+			case CONSTANT_STRING:
+				if ((uint64_t) f[0] + f[1] >= header->DataLength || data[f[0] + f[1]] != 0)
+					FAIL("string constant %u is out of bounds", i);
+				pool[i].String = (StringConstant) { CONSTANT_STRING, (const char *) &data[f[0]], f[1] };
+				break;
+			case CONSTANT_BYTEARRAY:
+				if ((uint64_t) f[0] + f[1] > header->DataLength)
+					FAIL("byte array constant %u is out of bounds", i);
+				pool[i].ByteArray = (ByteArrayConstant) { CONSTANT_BYTEARRAY, (u8 *) &data[f[0]], f[1] };
+				break;
+			case CONSTANT_METHOD:
+				pool[i].Method = (MethodInfo) { CONSTANT_METHOD, f[0], f[1], f[2], f[3] };
+				break;
+			case CONSTANT_CLASS:
+				pool[i].Class = (ClassInfo) { CONSTANT_CLASS, f[0] };
+				break;
+			default:
+				FAIL("constant %u has unknown type %u", i, constant->Type);
+		}
+	}
+
+	module->NumFunctions = header->NumFunctions;
+	for (u32 i = 0; i < header->NumFunctions; i++) {
+		u32 index = fileFunctions[i].Method;
+		if (index >= numConstants || pool[index].Constant.Type != CONSTANT_METHOD)
+			FAIL("function %u has no method", i);
+		const MethodInfo *method = &pool[index].Method;
+		if (method->Name >= numConstants || pool[method->Name].Constant.Type != CONSTANT_STRING)
+			FAIL("function %u has no name", i);
+		// LOAD only reaches this many
+		if (method->NumParams > UINT8_MAX + 1)
+			FAIL("function %u has too many parameters", i);
+		Function *function = &module->Functions[i];
+		function->Name = pool[method->Name].String.Value;
+		function->NumArgs = method->NumParams;
+		if (fileFunctions[i].Flags & FF_NATIVE) {
+			if (!Compiler_FindNative(function->Name, function))
+				FAIL("no native called '%s' that takes %u arguments", function->Name, function->NumArgs);
+		}
+		else {
+			if (method->Body >= numConstants || pool[method->Body].Constant.Type != CONSTANT_BYTEARRAY)
+				FAIL("function '%s' has no body", function->Name);
+			function->Body.Bytes = pool[method->Body].ByteArray.Bytes;
+			function->Body.Length = (u32) pool[method->Body].ByteArray.Count;
+		}
+		function->Flags |= fileFunctions[i].Flags & FF_VOID;
+	}
+	// the VM starts at function 0 with nothing on the stack
+	if ((module->Functions[0].Flags & FF_NATIVE) || module->Functions[0].NumArgs != 0)
+		FAIL("function 0 is not top-level code");
+
+	if (!Module_Verify(module))
+		FAIL("failed verification");
+	return module;
+}
+
+void Module_Unload(Module *module) {
+	if (module == NULL)
+		return;
+	Module_ReleaseCode(module);
+	if (module->Constants && module->Constants->Count > 0) {
+		// the pool is one block, starting with the first entry
+		free(module->Constants->Entries[0]);
+		free(module->Constants->Entries);
+	}
+	free(module->Functions);
+	free(module);
+}
@@ -1,31 +1,80 @@
 #pragma once
 
+#include "types.h"
+
+// X(mnemonic, operand bytes)
+//
+// The entries after PANIC are only produced by Module_Fuse (see peephole.c).
+// Each covers exactly the bytes of the sequence it replaces: only the first
+// opcode byte is rewritten, so every operand keeps its original offset and
+// branch offsets elsewhere in the function stay valid. In a superinstruction,
+// a trailing CALL index or BZ offset is the last four bytes.
 #define MNEMONICS \
-	X(NOP) \
-	X(PUSH) \
-	X(POP) \
-	X(DUP) \
-	X(XCHG) \
-	X(CALL) \
-	X(RET) \
-	X(ADD) \
-	X(SUB) \
-	X(MUL) \
-	X(DIV) \
-	X(BZ) \
-	X(BNZ) \
-	X(BNE) \
-	X(LT) \
-	X(LTE) \
-	X(HALT) \
-	X(PANIC)
-
-#define X(m) m,
+	X(NOP, 0) \
+	X(PUSH, 4) \
+	X(POP, 0) \
+	X(DUP, 0) \
+	X(XCHG, 0) \
+	X(LOAD, 1) \
+	X(CALL, 4) \
+	X(RET, 0) \
+	X(ADD, 0) \
+	X(SUB, 0) \
+	X(MUL, 0) \
+	X(DIV, 0) \
+	X(BZ, 4) \
+	X(BNZ, 4) \
+	X(BNE, 4) \
+	X(JMP, 4) \
+	X(EQ, 0) \
+	X(NE, 0) \
+	X(LT, 0) \
+	X(LTE, 0) \
+	X(HALT, 0) \
+	X(PANIC, 0) \
+	X(CALL_SELF, 4) /* CALL of the running function */ \
+	X(TAILCALL, 5) /* CALL fi; RET, reusing the frame */ \
+	X(TAILCALL_SELF, 5) \
+	X(PUSH_ADD, 5) \
+	X(PUSH_SUB, 5) \
+	X(PUSH_CALL, 9) \
+	X(PUSH_ADD_CALL, 10) \
+	X(PUSH_SUB_CALL, 10) \
+	X(PUSH_EQ_BZ, 10) \
+	X(PUSH_NE_BZ, 10) \
+	X(PUSH_LT_BZ, 10) \
+	X(PUSH_LTE_BZ, 10)
+
+// X(superinstruction, sequence it replaces...), longest sequences first so
+// that Module_Fuse prefers them
+#define SUPERINSTRUCTIONS \
+	X(PUSH_ADD_CALL, PUSH, ADD, CALL) \
+	X(PUSH_SUB_CALL, PUSH, SUB, CALL) \
+	X(PUSH_EQ_BZ, PUSH, EQ, BZ) \
+	X(PUSH_NE_BZ, PUSH, NE, BZ) \
+	X(PUSH_LT_BZ, PUSH, LT, BZ) \
+	X(PUSH_LTE_BZ, PUSH, LTE, BZ) \
+	X(PUSH_ADD, PUSH, ADD) \
+	X(PUSH_SUB, PUSH, SUB) \
+	X(PUSH_CALL, PUSH, CALL)
+
+#define MAX_SEQUENCE 3
+
+#define X(m, n) m,
 typedef enum {
 	MNEMONICS
+	NUM_OPCODES
 } Opcode;
 #undef X
 
+extern const u8 OPERAND_SIZES[NUM_OPCODES];
+
+#define INSTRUCTION_SIZE(op) (1 + OPERAND_SIZES[op])
+
+// True for opcodes that end in a branch offset, relative to the end of the
+// instruction
+bool Opcode_IsBranch(u32 opcode);
+
 /*
 enum Opcode {
 	PUSH = 0x01,
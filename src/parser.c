@@ -14,22 +14,29 @@ typedef enum {
 
 struct Parser {
 	Scanner *Scanner;
+	bool Streaming; // the scanner reuses its buffer, so kept tokens need their text copied
 	Token Token;
 	ParseErrorType Error;
+	Ast *Ast;
+	AstIndex *Scratch; // items of the lists being parsed, innermost last
+	u32 NumScratch, ScratchCapacity;
 };
 
-#define AST_NEW(T) calloc(1, sizeof(T))
-#define AST_NODE(X) (&(X)->Base)
-
 Parser *Parser_New(Scanner *scanner) {
 	Parser *p = calloc(1, sizeof(Parser));
 	p->Scanner = scanner;
+	p->Streaming = Scanner_Streaming(scanner);
 	p->Token = TOKEN_EMPTY;
 	p->Error = 0;
 	Scanner_ReadNext(p->Scanner, &p->Token);
 	return p;
 }
 
+void Parser_Release(Parser *p) {
+	free(p->Scratch);
+	free(p);
+}
+
 static void SetError(Parser *p, int error) {
 	if (p->Error == 0)
 		p->Error = error;
@@ -39,6 +46,9 @@ static bool Peek(Parser *p, TokenType type, Token *token) {
 	bool match = p->Error == ParseError_None && p->Token.Type == type;
 	if (match && token) {
 		*token = p->Token;
+		// an identifier's atom already holds a copy of its name
+		if (p->Streaming)
+			token->Text = token->Atom != ATOM_NONE ? *Atom_Name(token->Atom) : Ast_CopyText(p->Ast, &token->Text);
 	}
 	return match;
 }
@@ -46,7 +56,7 @@ static bool Peek(Parser *p, TokenType type, Token *token) {
 static bool Match(Parser *p, TokenType type, Token *token) {
 	bool match = Peek(p, type, token);
 	if (match) {
-		TRACE("[parser] matched %s -> '%.*s'", TokenType_ToString(type), p->Token.Text.Length, (const char *) p->Token.Text.Bytes);
+		LOG(Parser, Debug, "[parser] matched %s -> '%.*s'", TokenType_ToString(type), p->Token.Text.Length, (const char *) p->Token.Text.Bytes);
 		Scanner_ReadNext(p->Scanner, &p->Token);
 	}
 	return match;
@@ -56,49 +66,62 @@ static bool MatchType(Parser *p, Token *token) {
 	return Match(p, Token_KeywordInt, token) || Match(p, Token_KeywordUint, token);
 }
 
-static bool MatchBinaryOperator(Parser *p, Token *token) {
-	TokenType types[] = { Token_CompareEq, Token_CompareNotEq, Token_Plus, Token_Minus };
-	for (size_t i = 0; i < countof(types); i++)
-		if (Match(p, types[i], token))
-			return true;
-	return false;
+// Binding strength of each binary operator, 0 for any other token
+static const u8 Precedence[] = {
+#define X(A,B,P) P,
+	TOKEN_TYPES
+#undef X
+};
+
+static AstIndex NewNode(Parser *p, AstNodeType type, const Token *token, AstIndex lhs, AstIndex rhs) {
+	AstNode node = { .Type = type, .Token = token ? Ast_AddToken(p->Ast, token) : 0, .Lhs = lhs, .Rhs = rhs };
+	return Ast_AddNode(p->Ast, &node);
+}
+
+// Lists are collected on the scratch stack while their items are parsed,
+// since those may contain lists of their own, then copied out whole
+static void PushItem(Parser *p, AstIndex item) {
+	if (p->NumScratch == p->ScratchCapacity) {
+		p->ScratchCapacity = p->ScratchCapacity ? 2 * p->ScratchCapacity : 64;
+		p->Scratch = realloc(p->Scratch, p->ScratchCapacity * sizeof(AstIndex));
+	}
+	p->Scratch[p->NumScratch++] = item;
+}
+
+static u32 PopList(Parser *p, u32 mark) {
+	u32 count = p->NumScratch - mark;
+	p->NumScratch = mark;
+	if (count == 0)
+		return 0;
+	u32 list = Ast_AddChildren(p->Ast, &count, 1);
+	Ast_AddChildren(p->Ast, &p->Scratch[mark], count);
+	return list;
 }
 
-static AstBlockNode *StatementBlock(Parser *p);
-static AstNode *Statement(Parser *p);
-static AstNode *Expression(Parser *p);
-static AstNode *ArgumentList(Parser *p);
+static AstIndex StatementBlock(Parser *p);
+static AstIndex Statement(Parser *p);
+static AstIndex Expression(Parser *p);
+static u32 ArgumentList(Parser *p);
 
-static AstIdentifierNode *Identifier(Parser *p) {
+static AstIndex Identifier(Parser *p) {
 	Token token;
 	if (Match(p, Token_Identifier, &token)) {
-		AstIdentifierNode *node = AST_NEW(AstIdentifierNode);
-		*node = (AstIdentifierNode) { {.Type = AstNode_Identifier }, .Token = token };
-		return node;
+		return NewNode(p, AstNode_Identifier, &token, AST_NONE, AST_NONE);
 	}
-	return NULL;
+	return AST_NONE;
 }
 
-static AstLiteralNode *Literal(Parser *p) {
+static AstIndex Literal(Parser *p) {
 	Token token;
 	if (Match(p, Token_IntegerLiteral, &token) || Match(p, Token_StringLiteral, &token)) {
-		AstLiteralNode *node = AST_NEW(AstLiteralNode);
-		*node = (AstLiteralNode) { { .Type = AstNode_Literal }, .Token = token };
-		return node;
+		return NewNode(p, AstNode_Literal, &token, AST_NONE, AST_NONE);
 	}
-	return NULL;
-}
-
-static AstExpressionNode *MakeBinaryExpression(AstNode *lhs, AstNode *rhs, const Token *oper) {
-	AstExpressionNode *expr = AST_NEW(AstExpressionNode);
-	*expr = (AstExpressionNode) { {.Type = AstNode_Expression, .Left = lhs, .Right = rhs }, .Operator = *oper };
-	TRACE("[parser] returning expression");
-	return expr;
+	return AST_NONE;
 }
 
-AstNode *Subexpression(Parser *p) {
+static AstIndex Subexpression(Parser *p) {
 	if (Match(p, Token_LParen, NULL)) {
-		AstNode *node = Expression(p);
+		AstIndex node = Expression(p);
 		if (Match(p, Token_RParen, NULL)) {
 			return node;
 		}
@@ -106,125 +129,152 @@ AstNode *Subexpression(Parser *p) {
 			SetError(p, -1);
 		}
 	}
-	return NULL;
+	return AST_NONE;
 }
 
 
-static AstNode *Factor(Parser *p) {
-	AstNode *node = AST_NODE(Literal(p));
+static AstIndex Factor(Parser *p) {
+	AstIndex node = Literal(p);
 	if (!node) {
-		node = AST_NODE(Identifier(p));
+		node = Identifier(p);
 	}
 	if (!node) {
 		node = Subexpression(p);
 	}
 	if (Match(p, Token_LParen, NULL)) {
-		AstNode *arguments = ArgumentList(p);
+		u32 arguments = ArgumentList(p);
 		if (Match(p, Token_RParen, NULL)) {
-			AstFunctionCallNode *fn = AST_NEW(AstFunctionCallNode);
-			*fn = (AstFunctionCallNode) { {.Type = AstNode_FunctionCall }, .Arguments = arguments, .Function = node, };
-			return AST_NODE(fn);
+			return NewNode(p, AstNode_FunctionCall, NULL, node, arguments);
 		}
 		else {
 			SetError(p, -1);
-			return NULL;
+			return AST_NONE;
 		}
 	}
 	return node;
 }
 
-static AstNode *Term(Parser *p) {
-	AstNode *node = Factor(p);
-	if (node) {
-		Token oper;
-		if (Match(p, Token_Multiply, &oper) || Match(p, Token_Divide, &oper)) {
-			AstNode *tail = Factor(p);
-			if (tail) {
-				return AST_NODE(MakeBinaryExpression(node, tail, &oper));
-			}
-			else {
-				SetError(p, -1);
-			}
-		}
-	}
-	return node;
+// Values are unsigned and wrap around, so these give the same result
+// however a run of them is grouped
+static bool IsAssociative(TokenType type) {
+	return type == Token_Plus || type == Token_Multiply;
+}
+
+static TokenType ScratchOperator(Parser *p, u32 at) {
+	return AST_TOKEN(p->Ast, p->Scratch[at])->Type;
+}
+
+// Builds a balanced tree of the operands from first to last on the scratch
+// stack, which alternate with the operators between them
+static AstIndex Balance(Parser *p, u32 first, u32 last) {
+	if (first == last)
+		return p->Scratch[first];
+	u32 mid = first + 2 * (((last - first) / 2 + 1) / 2);
+	AstNode node = { .Type = AstNode_Expression, .Token = p->Scratch[mid - 1], .Lhs = Balance(p, first, mid - 2), .Rhs = Balance(p, mid, last) };
+	return Ast_AddNode(p->Ast, &node);
+}
+
+// The scratch stack above an expression's mark holds operands with the
+// operators between them: lhs, operator token, rhs. Folds the operator on
+// top and its operands into an expression node, or a whole run of the same
+// associative operator into a balanced tree, so that a long sum is only as
+// deep as its logarithm.
+static void Reduce(Parser *p, u32 mark) {
+	u32 last = p->NumScratch - 1;
+	TokenType type = ScratchOperator(p, last - 1);
+	u32 first = last - 2;
+	while (IsAssociative(type) && first >= mark + 2 && ScratchOperator(p, first - 1) == type)
+		first -= 2;
+	p->Scratch[first] = Balance(p, first, last);
+	p->NumScratch = first + 1;
+	LOG(Parser, Debug, "[parser] returning expression");
 }
 
-static AstNode *Expression(Parser *p) {
-	// EXPR ::= EXPR-HEAD EXPR-TAIL
-	// EXPR-HEAD ::= IDENTIFIER
-	// EXPR-HEAD ::= LITERAL
-	// EXPR-HEAD ::= true | false
-	// EXPR-TAIL ::= BINARY-OPERATOR EXPR
-	AstNode *node = Factor(p);
-	if (node) {
+static AstIndex Expression(Parser *p) {
+	// EXPR ::= FACTOR {BINARY-OPERATOR FACTOR}
+	// Operators bind by their precedence in TOKEN_TYPES, and operators of
+	// the same precedence from left to right. Operands wait on the scratch
+	// stack until an operator that binds no tighter than the one before them
+	// comes along, so the stack only grows with the number of precedence
+	// levels and runs of associative operators, however long the expression.
+	u32 mark = p->NumScratch;
+	AstIndex operand = Factor(p);
+	if (!operand)
+		return AST_NONE;
+	PushItem(p, operand);
+	for (;;) {
+		TokenType next = p->Error == ParseError_None ? p->Token.Type : Token_None;
+		while (p->NumScratch - mark >= 3) {
+			TokenType top = ScratchOperator(p, p->NumScratch - 2);
+			if (Precedence[top] < Precedence[next] || (top == next && IsAssociative(top)))
+				break;
+			Reduce(p, mark);
+		}
+		if (Precedence[next] == 0)
+			break;
 		Token oper;
-		if (MatchBinaryOperator(p, &oper)) {
-			AstNode *tail = Expression(p);
-			if (tail) {
-				return AST_NODE(MakeBinaryExpression(node, tail, &oper));
-			}
-			else {
-				SetError(p, -1);
-			}
+		Match(p, next, &oper);
+		PushItem(p, Ast_AddToken(p->Ast, &oper));
+		if ((operand = Factor(p)) == AST_NONE) {
+			SetError(p, -1);
+			p->NumScratch = mark;
+			return AST_NONE;
 		}
+		PushItem(p, operand);
 	}
-	return node;
+	p->NumScratch = mark;
+	return p->Scratch[mark];
 }
 
-static AstNode *ArgumentList(Parser *p) {
-	AstNode *cell = AST_NEW(AstNode);
-	AstNode *expr = Expression(p);
-	cell->Left = expr;
-	if (expr && Match(p, Token_Comma, NULL)) {
-		AstNode *tail = ArgumentList(p);
-		cell->Right = tail;
+static u32 ArgumentList(Parser *p) {
+	u32 mark = p->NumScratch;
+	AstIndex expr;
+	while ((expr = Expression(p)) != AST_NONE) {
+		PushItem(p, expr);
+		if (!Match(p, Token_Comma, NULL))
+			break;
 	}
-	return cell;
+	return PopList(p, mark);
 }
 
-static AstDeclarationNode *Parameter(Parser *p) {
+static AstIndex Parameter(Parser *p) {
 	Token identifier;
 	if (Match(p, Token_Identifier, &identifier)) {
 		if (Match(p, Token_Colon, NULL)) {
 			Token type;
 			if (MatchType(p, &type)) {
-				AstDeclarationNode *decl = AST_NEW(AstDeclarationNode);
-				*decl = (AstDeclarationNode) { { .Type = AstNode_Declaration }, .Identifier = identifier, .Type = type };
-				TRACE("[parser] returning parameter");
+				AstIndex decl = NewNode(p, AstNode_Declaration, &identifier, Ast_AddToken(p->Ast, &type), AST_NONE);
+				LOG(Parser, Debug, "[parser] returning parameter");
 				return decl;
 			}
 		}
 		SetError(p, -1);
 	}
-	return NULL;
+	return AST_NONE;
 }
 
-static AstDeclarationNode *ParameterList(Parser *p) {
-	AstDeclarationNode *parameter = Parameter(p);
-	if (parameter) {
-		parameter->Base.Right = (AstNode *) ParameterList(p);
-	}
-	return parameter;
+static u32 ParameterList(Parser *p) {
+	u32 mark = p->NumScratch;
+	AstIndex parameter;
+	while ((parameter = Parameter(p)) != AST_NONE)
+		PushItem(p, parameter);
+	return PopList(p, mark);
 }
 
-static AstNode *Function(Parser *p) {
+static AstIndex Function(Parser *p) {
 	if (Match(p, Token_KeywordFunction, NULL)) {
 		Token name;
 		if (Match(p, Token_Identifier, &name)) {
 			if (Match(p, Token_LParen, NULL)) {
-				AstDeclarationNode *parameters = ParameterList(p);
+				u32 parameters = ParameterList(p);
 				if (Match(p, Token_RParen, NULL)) {
 					if (Match(p, Token_Colon, NULL)) {
 						Token returnType;
 						if (MatchType(p, &returnType)) {
-							AstBlockNode *body = StatementBlock(p);
+							AstIndex body = StatementBlock(p);
 							if (body) {
-								AstFunctionNode *function = AST_NEW(AstFunctionNode);
-								*function = (AstFunctionNode) { 
-									{ .Type = AstNode_Function }, .Identifier = name, .Parameters = parameters, .ReturnType = returnType, .Body = body 
-								};
-								return AST_NODE(function);
+								u32 extra[] = { Ast_AddToken(p->Ast, &returnType), body, 0, 0 };
+								return NewNode(p, AstNode_Function, &name, parameters, Ast_AddChildren(p->Ast, extra, countof(extra)));
 							}
 						}
 					}
@@ -233,47 +283,44 @@ static AstNode *Function(Parser *p) {
 		}
 	}
 	SetError(p, -1);
-	return NULL;
+	return AST_NONE;
 }
 
-static AstNode *IfStatement(Parser *p) {
+static AstIndex IfStatement(Parser *p) {
 	if (Match(p, Token_KeywordIf, NULL)) {
 		if (Match(p, Token_LParen, NULL)) {
-			AstNode *condition = Expression(p);
+			AstIndex condition = Expression(p);
 			if (condition) {
 				if (Match(p, Token_RParen, NULL)) {
-					AstNode *trueBranch = Statement(p);
-					AstNode *falseBranch = NULL;
+					AstIndex trueBranch = Statement(p);
+					AstIndex falseBranch = AST_NONE;
 					if (Match(p, Token_KeywordElse, NULL)) {
 						falseBranch = Statement(p);
 					}
-					AstIfNode *node = AST_NEW(AstIfNode);
-					*node = (AstIfNode) { { .Type = AstNode_If }, .Condition = condition, .TrueBranch = trueBranch, .FalseBranch = falseBranch };
-					return AST_NODE(node);
+					u32 extra[] = { trueBranch, falseBranch };
+					return NewNode(p, AstNode_If, NULL, condition, Ast_AddChildren(p->Ast, extra, countof(extra)));
 				}
 			}
 		}
 		SetError(p, -1);
 	}
-	return NULL;
+	return AST_NONE;
 }
 
-static AstNode *ReturnStatement(Parser *p) {
+static AstIndex ReturnStatement(Parser *p) {
 	if (Match(p, Token_KeywordReturn, NULL)) {
-		AstExpressionNode *expr = (AstExpressionNode *) Expression(p);
+		AstIndex expr = Expression(p);
 		if (Match(p, Token_Semicolon, NULL)) {
-			AstReturnNode *node = AST_NEW(AstReturnNode);
-			*node = (AstReturnNode) { {.Type = AstNode_Return }, .Expression = expr };
-			return AST_NODE(node);
+			return NewNode(p, AstNode_Return, NULL, expr, AST_NONE);
 		}
 		else {
 			SetError(p, -1);
 		}
 	}
-	return NULL;
+	return AST_NONE;
 }
 
-static AstNode *Statement(Parser *p) {
+static AstIndex Statement(Parser *p) {
 	if (Peek(p, Token_KeywordFunction, NULL)) {
 		return Function(p);
 	}
@@ -281,60 +328,57 @@ static AstNode *Statement(Parser *p) {
 		return IfStatement(p);
 	}
 	else if (Peek(p, Token_LBrace, NULL)) {
-		return (AstNode *) StatementBlock(p);
+		return StatementBlock(p);
 	}
 	else if (Peek(p, Token_KeywordReturn, NULL)) {
-		return (AstNode *) ReturnStatement(p);
+		return ReturnStatement(p);
 	}
 	else {
-		AstNode *expr = Expression(p);
-		return (expr && Match(p, Token_Semicolon, NULL)) ? expr : NULL;
+		AstIndex expr = Expression(p);
+		return (expr && Match(p, Token_Semicolon, NULL)) ? expr : AST_NONE;
 	}
 }
 
-static AstNode *StatementList(Parser *p) {
+static u32 StatementList(Parser *p) {
 	// STATEMENT-LIST ::= STATEMENT [STATEMENT-LIST]
-	AstNode *statement = Statement(p);
-	if (statement) {
-		statement->Right = StatementList(p);
-	}
-	return statement;
+	u32 mark = p->NumScratch;
+	AstIndex statement;
+	while ((statement = Statement(p)) != AST_NONE)
+		PushItem(p, statement);
+	return PopList(p, mark);
 }
 
-static AstBlockNode *StatementBlock(Parser *p) {
+static AstIndex StatementBlock(Parser *p) {
 	if (Match(p, Token_LBrace, NULL)) {
-		AstNode *statements = StatementList(p);
+		u32 statements = StatementList(p);
 		if (Match(p, Token_RBrace, NULL)) {
-			AstBlockNode *block = AST_NEW(AstBlockNode);
-			*block = (AstBlockNode) { { .Type = AstNode_Block }, .Statements = statements };
-			block->Statements = statements;
-			return block;
+			return NewNode(p, AstNode_Block, NULL, statements, AST_NONE);
 		}
 		SetError(p, -1);
 	}
-	return NULL;
+	return AST_NONE;
 }
 
-static AstNode *Module(Parser *p) {
+static AstIndex Module(Parser *p) {
 	// MODULE ::= STATEMENT-LIST EOF (more to come later)
-	AstNode *statements = StatementList(p);
+	u32 statements = StatementList(p);
 	if (statements) {
 		if (Match(p, Token_EndOfStream, NULL)) {
-			//static const char *name = "$global";
-			//AstFunctionNode *function = AST_NEW(AstFunctionNode);
-			//function->Base.Type = AstNode_Function;
-			//function->Identifier = (Token) { .Type = Token_Identifier, .Text = name, .Length = (u32) strlen(name) };
-			//function->Body = AST_NEW(AstBlockNode);
-			//*function->Body = (AstBlockNode) { { .Type = AstNode_Block }, .Statements = statements };
-			AstBlockNode *block = calloc(1, sizeof(AstBlockNode));
-			block->Base.Type = AstNode_Block;
-			block->Statements = statements;
-			return AST_NODE(block);
+			return NewNode(p, AstNode_Block, NULL, statements, AST_NONE);
 		}
 	}
-	return NULL;
+	return AST_NONE;
 }
 
-AstNode *Parser_BuildAst(Parser *p) {
-	return (AstNode *) Module(p);
+Ast *Parser_BuildAst(Parser *p) {
+	p->Ast = Ast_New();
+	p->Ast->Root = Module(p);
+	// after parsing, since a streaming scanner only has the lines it's read
+	p->Ast->Lines = Scanner_Lines(p->Scanner);
+	free(p->Scratch);
+	p->Scratch = NULL;
+	p->NumScratch = p->ScratchCapacity = 0;
+	Ast *ast = p->Ast;
+	p->Ast = NULL;
+	return ast;
 }
\ No newline at end of file
@@ -7,4 +7,9 @@ typedef struct Parser Parser;
 
 Parser *Parser_New(Scanner *);
 
-AstNode *Parser_BuildAst(Parser *);
\ No newline at end of file
+// Releases the parser but not its scanner
+void Parser_Release(Parser *);
+
+// Returns the tree, whose Root is AST_NONE if the program didn't parse.
+// Release it with Ast_Release.
+Ast *Parser_BuildAst(Parser *);
\ No newline at end of file
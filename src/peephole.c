@@ -0,0 +1,130 @@
+#include "module.h"
+#include "vm.h"
+#include "opcode.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Superinstruction fusion. Each function gets a copy of its body in which the
+// first opcode of every SUPERINSTRUCTIONS sequence is replaced by the fused
+// one; the rest of the sequence's bytes stay where they were as its operands.
+// Sizes and offsets don't change, so a sequence is only fused when no branch
+// lands inside it. The function is then verified and decoded again, and left
+// as it was if that fails.
+//
+// Calls are rewritten the same way: a CALL of the running function becomes
+// CALL_SELF, and a CALL that is immediately returned becomes TAILCALL (or
+// TAILCALL_SELF), which reuses the frame, provided the RET would return
+// exactly what the callee does. Those are done first, so that a sequence
+// ending in a tail call isn't fused into a superinstruction instead.
+
+static const struct {
+	u8 Opcode;
+	u8 Sequence[MAX_SEQUENCE];
+} PATTERNS[] = {
+#define X(M, ...) { M, { __VA_ARGS__ } },
+	SUPERINSTRUCTIONS
+#undef X
+};
+
+// Unreachable code never runs and the verifier doesn't check its operands, so
+// it's left as it is
+static bool Reachable(const Function *function, u32 pc) {
+	return function->Code[function->CodeIndex[pc]].Depth >= 0;
+}
+
+// Returns the call form to use for the CALL at pc
+static u8 CallOpcode(const Module *module, u32 index, const u8 *bytes, const bool *targets, u32 pc) {
+	const Function *function = &module->Functions[index];
+	const Function *callee = &module->Functions[*(const u32 *) &bytes[pc + 1]];
+	bool self = callee == function;
+	bool tail = bytes[pc + 5] == RET && !targets[pc + 5]
+		&& index != 0
+		&& (callee->Flags & FF_NATIVE) == 0
+		&& (callee->Flags & FF_VOID) == (function->Flags & FF_VOID);
+	if (tail)
+		return self ? TAILCALL_SELF : TAILCALL;
+	return self ? CALL_SELF : CALL;
+}
+
+// Returns the superinstruction that starts at pc, or NOP
+static u8 Match(const u8 *bytes, u32 length, const bool *targets, u32 pc) {
+	for (size_t i = 0; i < countof(PATTERNS); i++) {
+		const u8 *sequence = PATTERNS[i].Sequence;
+		u32 at = pc;
+		u32 n = 0;
+		while (n < MAX_SEQUENCE && sequence[n] != NOP) {
+			if (at >= length || bytes[at] != sequence[n] || (n > 0 && targets[at]))
+				break;
+			at += INSTRUCTION_SIZE(sequence[n++]);
+		}
+		if (n == MAX_SEQUENCE || sequence[n] == NOP)
+			return PATTERNS[i].Opcode;
+	}
+	return NOP;
+}
+
+static u32 FuseFunction(Module *module, u32 index) {
+	Function *function = &module->Functions[index];
+	const u8 *bytes = function->Body.Bytes;
+	u32 length = function->Body.Length;
+
+	bool *targets = calloc(length, sizeof(bool));
+	for (u32 pc = 0; pc < length; pc += INSTRUCTION_SIZE(bytes[pc])) {
+		u32 next = pc + INSTRUCTION_SIZE(bytes[pc]);
+		if (Opcode_IsBranch(bytes[pc]) && Reachable(function, pc))
+			targets[next + *(const s32 *) &bytes[next - 4]] = true;
+	}
+
+	u8 *fused = malloc(length);
+	memcpy(fused, bytes, length);
+	u32 count = 0;
+	for (u32 pc = 0; pc < length; pc += INSTRUCTION_SIZE(bytes[pc])) {
+		if (bytes[pc] == CALL && Reachable(function, pc) && (fused[pc] = CallOpcode(module, index, bytes, targets, pc)) != CALL)
+			count++;
+	}
+	for (u32 pc = 0; pc < length; pc += INSTRUCTION_SIZE(fused[pc])) {
+		u8 opcode = Match(fused, length, targets, pc);
+		if (opcode != NOP) {
+			fused[pc] = opcode;
+			count++;
+		}
+	}
+	free(targets);
+
+	if (count == 0) {
+		free(fused);
+		return 0;
+	}
+
+	Function original = *function;
+	function->Body.Bytes = fused;
+	function->Flags = (function->Flags & ~FF_VERIFIED) | FF_FUSED;
+	function->Code = NULL;
+	function->CodeIndex = NULL;
+	if (!Module_Verify(module)) {
+		ERROR("[peephole] %s: fused code failed verification, keeping the original", function->Name);
+		free((void *) function->Code);
+		free((void *) function->CodeIndex);
+		free(fused);
+		*function = original;
+		return 0;
+	}
+	free((void *) original.Code);
+	free((void *) original.CodeIndex);
+	if (original.Flags & FF_FUSED)
+		free((void *) original.Body.Bytes);
+	TRACE("[peephole] %s: %d instructions rewritten", function->Name, count);
+	return count;
+}
+
+u32 Module_Fuse(Module *module) {
+	u32 count = 0;
+	for (u32 i = 0; i < module->NumFunctions; i++) {
+		Function *function = &module->Functions[i];
+		if ((function->Flags & (FF_NATIVE | FF_VERIFIED | FF_JIT)) == FF_VERIFIED)
+			count += FuseFunction(module, i);
+	}
+	return count;
+}
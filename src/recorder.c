@@ -0,0 +1,241 @@
+#include "recorder.h"
+#include "vm.h"
+#include "opcode.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+#define RECORDING_MAGIC "EXMT"
+#define RECORDING_VERSION 2
+
+const char *GetMnemonic(Opcode opcode);
+
+// A recording is this header, then each function's name as a u32 length and
+// its bytes, then the records
+typedef struct RecordingHeader {
+	char Magic[4];
+	u32 Version;
+	u32 RecordSize;
+	u32 NumFunctions;
+	u32 NumRecords;
+	u32 Reserved;
+	uint64_t Total; // records ever written, so Total - NumRecords were overwritten
+} RecordingHeader;
+
+typedef struct Ring {
+	TraceRecord *Records;
+	u32 Mask;
+	uint64_t Count;
+	const char *Path;
+} Ring;
+
+static THREAD_LOCAL Ring Recording;
+
+bool Recorder_Start(u32 capacity, const char *path) {
+	Recorder_Stop();
+	u32 size = 1;
+	while (size < capacity && size < (1u << 31))
+		size <<= 1;
+	Recording.Records = malloc(size * sizeof(TraceRecord));
+	if (Recording.Records == NULL) {
+		ERROR("[recorder] could not allocate %u records", size);
+		return false;
+	}
+	Recording.Mask = size - 1;
+	Recording.Count = 0;
+	Recording.Path = path;
+	return true;
+}
+
+void Recorder_Stop(void) {
+	free(Recording.Records);
+	memset(&Recording, 0, sizeof(Recording));
+}
+
+void Recorder_Record(const VM *vm, const Frame *frame) {
+	if (Recording.Records == NULL)
+		return;
+	TraceRecord *record = &Recording.Records[Recording.Count++ & Recording.Mask];
+	const u8 *bytes = &frame->Function->Body.Bytes[frame->PC];
+	u32 size = bytes[0] < NUM_OPCODES ? OPERAND_SIZES[bytes[0]] : 0;
+	record->PC = frame->PC;
+	record->Function = (u32) (frame->Function - vm->Module->Functions);
+	record->Frame = vm->CallStack.Depth;
+	record->Depth = frame->SP - frame->BP;
+	record->Opcode = bytes[0];
+	record->Operands[0] = size == 1 ? bytes[1] : 0;
+	record->Operands[1] = 0;
+	if (size >= 4)
+		memcpy(&record->Operands[0], bytes + 1, 4);
+	if (size >= 8)
+		memcpy(&record->Operands[1], bytes + 1 + size - 4, 4);
+}
+
+bool Recorder_Save(const Module *module) {
+	if (Recording.Records == NULL || Recording.Path == NULL)
+		return false;
+	FILE *file;
+	if (fopen_s(&file, Recording.Path, "wb") != 0) {
+		ERROR("[recorder] could not open '%s' for writing", Recording.Path);
+		return false;
+	}
+	uint64_t count = Recording.Count;
+	u32 numRecords = count > Recording.Mask ? Recording.Mask + 1 : (u32) count;
+	RecordingHeader header = {
+		.Magic = RECORDING_MAGIC,
+		.Version = RECORDING_VERSION,
+		.RecordSize = sizeof(TraceRecord),
+		.NumFunctions = module->NumFunctions,
+		.NumRecords = numRecords,
+		.Total = count,
+	};
+	fwrite(&header, sizeof(header), 1, file);
+	for (u32 i = 0; i < module->NumFunctions; i++) {
+		const char *name = module->Functions[i].Name;
+		u32 length = (u32) strlen(name);
+		fwrite(&length, sizeof(length), 1, file);
+		fwrite(name, 1, length, file);
+	}
+	// oldest first: the ring wraps at the next slot to be written
+	u32 start = (u32) ((count - numRecords) & Recording.Mask);
+	u32 first = Recording.Mask + 1 - start < numRecords ? Recording.Mask + 1 - start : numRecords;
+	fwrite(&Recording.Records[start], sizeof(TraceRecord), first, file);
+	fwrite(Recording.Records, sizeof(TraceRecord), numRecords - first, file);
+	bool ok = ferror(file) == 0;
+	fclose(file);
+	if (!ok)
+		ERROR("[recorder] could not write '%s'", Recording.Path);
+	return ok;
+}
+
+// Returns the function an instruction calls, or -1
+static s32 Callee(const TraceRecord *record) {
+	switch (record->Opcode) {
+		case CALL:
+		case TAILCALL:
+			return record->Operands[0];
+		case PUSH_CALL:
+		case PUSH_ADD_CALL:
+		case PUSH_SUB_CALL:
+			return record->Operands[1];
+		case CALL_SELF:
+		case TAILCALL_SELF:
+			return record->Function;
+		default:
+			return -1;
+	}
+}
+
+static void DecodeText(const TraceRecord *record, char **names, u32 numFunctions, FILE *out) {
+	u32 size = OPERAND_SIZES[record->Opcode];
+	fprintf(out, "%10s+%04Xh %4d %4.02Xh   %s",
+		names[record->Function], record->PC, record->Depth, record->Opcode, GetMnemonic(record->Opcode));
+	if (size > 0)
+		fprintf(out, " %d", record->Operands[0]);
+	if (size >= 8)
+		fprintf(out, " %d", record->Operands[1]);
+	s32 callee = Callee(record);
+	if (callee >= 0 && (u32) callee < numFunctions)
+		fprintf(out, " (%s)", names[callee]);
+	fputc('\n', out);
+	if (record->Opcode == CALL || record->Opcode == RET)
+		fputc('\n', out);
+}
+
+typedef struct OpenCall {
+	u32 Frame, Function;
+} OpenCall;
+
+static void ChromeEvent(FILE *out, bool *first, const char *name, char phase, uint64_t ts) {
+	fprintf(out, "%s\n{\"name\":\"", *first ? "" : ",");
+	for (const char *c = name; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			fputc('\\', out);
+		fputc(*c, out);
+	}
+	fprintf(out, "\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":1}", phase, (unsigned long long) ts);
+	*first = false;
+}
+
+// Calls still open when the recording starts or ends are cut off there
+static void DecodeChrome(const TraceRecord *record, uint64_t ts, char **names, OpenCall *open, u32 *numOpen, bool *first, FILE *out) {
+	// a frame that's gone, or was replaced by a tail call, has returned
+	while (*numOpen > 0) {
+		const OpenCall *top = &open[*numOpen - 1];
+		if (top->Frame < record->Frame || (top->Frame == record->Frame && top->Function == record->Function))
+			break;
+		ChromeEvent(out, first, names[top->Function], 'E', ts);
+		--*numOpen;
+	}
+	if (*numOpen == 0 || open[*numOpen - 1].Frame < record->Frame) {
+		open[(*numOpen)++] = (OpenCall) { record->Frame, record->Function };
+		ChromeEvent(out, first, names[record->Function], 'B', ts);
+	}
+}
+
+bool Recorder_Decode(const char *path, DecodeFormat format, FILE *out) {
+	FILE *file;
+	if (fopen_s(&file, path, "rb") != 0) {
+		ERROR("[recorder] could not open '%s' for reading", path);
+		return false;
+	}
+	RecordingHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.Magic, RECORDING_MAGIC, 4) != 0
+		|| header.Version != RECORDING_VERSION || header.RecordSize != sizeof(TraceRecord)) {
+		ERROR("[recorder] '%s' is not a recording", path);
+		fclose(file);
+		return false;
+	}
+
+	bool ok = true;
+	char **names = calloc(header.NumFunctions, sizeof(char *));
+	for (u32 i = 0; ok && i < header.NumFunctions; i++) {
+		u32 length;
+		ok = fread(&length, sizeof(length), 1, file) == 1 && length < (1 << 16)
+			&& (names[i] = calloc(length + 1, 1)) != NULL
+			&& fread(names[i], 1, length, file) == length;
+	}
+
+	OpenCall *open = format == DECODE_CHROME ? malloc((UINT16_MAX + 1) * sizeof(OpenCall)) : NULL;
+	u32 numOpen = 0;
+	bool first = true;
+	uint64_t ts = header.Total - header.NumRecords;
+	if (format == DECODE_CHROME)
+		fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	else if (ts > 0)
+		fprintf(out, "(%llu earlier instructions not recorded)\n", (unsigned long long) ts);
+
+	for (u32 i = 0; ok && i < header.NumRecords; i++, ts++) {
+		TraceRecord record;
+		ok = fread(&record, sizeof(record), 1, file) == 1
+			&& record.Function < header.NumFunctions && record.Opcode < NUM_OPCODES;
+		if (!ok)
+			break;
+		if (format == DECODE_CHROME)
+			DecodeChrome(&record, ts, names, open, &numOpen, &first, out);
+		else
+			DecodeText(&record, names, header.NumFunctions, out);
+	}
+
+	if (format == DECODE_CHROME) {
+		while (numOpen > 0)
+			ChromeEvent(out, &first, names[open[--numOpen].Function], 'E', ts);
+		fprintf(out, "\n]}\n");
+	}
+	if (!ok)
+		ERROR("[recorder] '%s' is truncated or corrupt", path);
+
+	free(open);
+	for (u32 i = 0; i < header.NumFunctions; i++)
+		free(names[i]);
+	free(names);
+	fclose(file);
+	return ok;
+}
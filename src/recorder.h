@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "types.h"
+#include "module.h"
+
+DECLARE_TYPE(VM);
+DECLARE_TYPE(Frame);
+
+// A VM with VMFLAG_RECORD set writes a fixed-size binary record for every
+// instruction it steps through, instead of formatting a trace line. Records
+// go into a ring buffer that belongs to the calling thread, so recording takes
+// no locks; once the ring is full the oldest records are overwritten.
+//
+// Recorder_Save writes the ring to the file given to Recorder_Start, oldest
+// record first. VM_Panic saves it on the way down, or it can be saved at any
+// point in between. Recorder_Decode reads such a file back, in the same byte
+// order it was written in.
+
+typedef struct TraceRecord {
+	u32 PC;
+	u32 Function; // index into Module.Functions
+	u32 Frame; // call stack depth, 1 for $global
+	u32 Depth; // operand stack depth before the instruction
+	u8 Opcode;
+	u8 Reserved[3];
+	// The first four bytes of the operands, or the only byte; and for the
+	// superinstructions with two operands the last four, where they keep their
+	// CALL index or BZ offset
+	s32 Operands[2];
+} TraceRecord;
+
+typedef enum {
+	DECODE_TEXT, // the lines StepBytecode traces, one per instruction
+	DECODE_CHROME, // Chrome trace JSON, one span per call, one tick per instruction
+} DecodeFormat;
+
+// Gives the calling thread a ring of at least `capacity` records, dropping
+// whatever it recorded before
+bool Recorder_Start(u32 capacity, const char *path);
+
+void Recorder_Stop(void);
+
+void Recorder_Record(const VM *vm, const Frame *frame);
+
+// Returns false if nothing was being recorded or the file can't be written
+bool Recorder_Save(const Module *module);
+
+// Writes the records in the file to `out`. Returns false if the file can't
+// be read or isn't a recording.
+bool Recorder_Decode(const char *path, DecodeFormat format, FILE *out);
@@ -0,0 +1,414 @@
+#include "module.h"
+#include "vm.h"
+#include "opcode.h"
+#include "regcode.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Translation from verified stack bytecode to register bytecode. The verifier
+// fixes the operand stack depth at every instruction, so stack slot i can
+// simply become register i. What makes the result shorter is that each slot
+// is tracked symbolically as it's pushed: a LOAD, DUP or PUSH only records
+// where the value is, and a comparison only records its operands, so
+//
+//   LOAD 0; PUSH 2; SUB           ->  SUBI r1, r0, 2
+//   LOAD 0; PUSH 1; EQ; BZ off    ->  BNEI r0, 1, target
+//
+// Pending slots are written to their registers (flushed) before anything
+// that depends on the actual stack contents: calls, branches, branch targets
+// and panics. A pending slot only ever refers to registers below it that
+// are in place, which is why writing the top of the stack never invalidates
+// one, and a pending comparison is only ever the top of the stack.
+
+typedef enum {
+	Slot_InPlace, // the value is in the slot's own register
+	Slot_Copy, // the value is in Register
+	Slot_Constant,
+	Slot_Condition // Register Compare (Right or Constant), not computed yet
+} SlotKind;
+
+typedef struct Slot {
+	SlotKind Kind;
+	u32 Register;
+	s32 Constant;
+	u32 Right;
+	bool RightConstant;
+	u8 Compare; // EQ, NE, LT or LTE
+} Slot;
+
+typedef struct Translator {
+	const Function *Function;
+	Slot *Stack;
+	u32 Depth;
+	RegInstruction *Code;
+	u32 Count, Capacity;
+	u32 PC; // of the stack instruction being translated
+	u32 *Index; // becomes RegIndex
+} Translator;
+
+static RegInstruction *Emit(Translator *t, RegOpcode opcode, u32 a, u32 b, u32 c) {
+	if (t->Count == t->Capacity) {
+		t->Capacity = t->Capacity ? 2 * t->Capacity : 64;
+		t->Code = realloc(t->Code, t->Capacity * sizeof(RegInstruction));
+	}
+	RegInstruction *instr = &t->Code[t->Count++];
+	*instr = (RegInstruction) { .Opcode = opcode, .PC = t->PC, .A = (u16) a, .B = (u16) b, .C = (u16) c };
+	return instr;
+}
+
+static RegOpcode CompareOpcode(u8 compare) {
+	switch (compare) {
+		case EQ: return REG_EQ;
+		case NE: return REG_NE;
+		case LT: return REG_LT;
+		default: return REG_LTE;
+	}
+}
+
+// The branch taken when "left compare right" is (or, with !onTrue, isn't) true
+static RegOpcode BranchOpcode(u8 compare, bool onTrue, bool immediate) {
+	RegOpcode opcode;
+	switch (compare) {
+		case EQ: opcode = onTrue ? REG_BEQ : REG_BNE; break;
+		case NE: opcode = onTrue ? REG_BNE : REG_BEQ; break;
+		case LT: opcode = onTrue ? REG_BLT : REG_BGTE; break;
+		default: opcode = onTrue ? REG_BLTE : REG_BGT; break;
+	}
+	// the immediate forms are declared in the same order
+	return immediate ? opcode - REG_BEQ + REG_BEQI : opcode;
+}
+
+static void Materialize(Translator *t, u32 i) {
+	Slot *slot = &t->Stack[i];
+	switch (slot->Kind) {
+		case Slot_InPlace:
+			return;
+		case Slot_Copy:
+			Emit(t, REG_MOV, i, slot->Register, 0);
+			break;
+		case Slot_Constant:
+			Emit(t, REG_MOVI, i, 0, 0)->Immediate = slot->Constant;
+			break;
+		case Slot_Condition: {
+			// i is the top of the stack, so the register above it is free
+			u32 right = slot->Right;
+			if (slot->RightConstant) {
+				right = i + 1;
+				Emit(t, REG_MOVI, right, 0, 0)->Immediate = slot->Constant;
+			}
+			Emit(t, CompareOpcode(slot->Compare), i, slot->Register, right);
+			break;
+		}
+	}
+	slot->Kind = Slot_InPlace;
+}
+
+static void Flush(Translator *t, u32 depth) {
+	for (u32 i = 0; i < depth; i++)
+		Materialize(t, i);
+}
+
+// Returns the register holding slot i, writing it there first if necessary
+static u32 Source(Translator *t, u32 i) {
+	if (t->Stack[i].Kind == Slot_Copy)
+		return t->Stack[i].Register;
+	Materialize(t, i);
+	return i;
+}
+
+// Pushes a copy of slot i, which refers to the same place
+static void PushCopy(Translator *t, u32 i) {
+	if (t->Depth > 0 && t->Stack[t->Depth - 1].Kind == Slot_Condition)
+		Materialize(t, t->Depth - 1);
+	Slot slot = t->Stack[i];
+	if (slot.Kind == Slot_InPlace)
+		slot = (Slot) { .Kind = Slot_Copy, .Register = i };
+	t->Stack[t->Depth++] = slot;
+}
+
+static void PushConstant(Translator *t, s32 value) {
+	if (t->Depth > 0 && t->Stack[t->Depth - 1].Kind == Slot_Condition)
+		Materialize(t, t->Depth - 1);
+	t->Stack[t->Depth++] = (Slot) { .Kind = Slot_Constant, .Constant = value };
+}
+
+static void Arithmetic(Translator *t, u32 opcode) {
+	u32 d = t->Depth;
+	if (t->Stack[d - 1].Kind == Slot_Condition)
+		Materialize(t, d - 1);
+	const Slot *a = &t->Stack[d - 2], *b = &t->Stack[d - 1];
+	t->Depth--;
+
+	if (a->Kind == Slot_Constant && b->Kind == Slot_Constant && opcode != DIV) {
+		u32 x = (u32) a->Constant, y = (u32) b->Constant;
+		s32 value = (s32) (opcode == ADD ? x + y : opcode == SUB ? x - y : x * y);
+		t->Stack[d - 2] = (Slot) { .Kind = Slot_Constant, .Constant = value };
+		return;
+	}
+
+	if (b->Kind == Slot_Constant && (opcode == ADD || opcode == SUB)) {
+		s32 value = b->Constant;
+		u32 left = Source(t, d - 2);
+		Emit(t, opcode == ADD ? REG_ADDI : REG_SUBI, d - 2, left, 0)->Immediate = value;
+	}
+	else if (a->Kind == Slot_Constant && opcode == ADD) {
+		s32 value = a->Constant;
+		u32 right = Source(t, d - 1);
+		Emit(t, REG_ADDI, d - 2, right, 0)->Immediate = value;
+	}
+	else {
+		static const RegOpcode OPCODES[] = { [ADD] = REG_ADD, [SUB] = REG_SUB, [MUL] = REG_MUL, [DIV] = REG_DIV };
+		u32 left = Source(t, d - 2);
+		u32 right = Source(t, d - 1);
+		Emit(t, OPCODES[opcode], d - 2, left, right);
+	}
+	t->Stack[d - 2] = (Slot) { .Kind = Slot_InPlace };
+}
+
+static void Compare(Translator *t, u32 opcode) {
+	u32 d = t->Depth;
+	if (t->Stack[d - 1].Kind == Slot_Condition)
+		Materialize(t, d - 1);
+	const Slot *a = &t->Stack[d - 2], *b = &t->Stack[d - 1];
+	t->Depth--;
+
+	if (a->Kind == Slot_Constant && b->Kind == Slot_Constant) {
+		u32 x = (u32) a->Constant, y = (u32) b->Constant;
+		bool value = opcode == EQ ? x == y : opcode == NE ? x != y : opcode == LT ? x < y : x <= y;
+		t->Stack[d - 2] = (Slot) { .Kind = Slot_Constant, .Constant = value };
+		return;
+	}
+
+	Slot condition = { .Kind = Slot_Condition, .Compare = (u8) opcode };
+	if (b->Kind == Slot_Constant) {
+		condition.RightConstant = true;
+		condition.Constant = b->Constant;
+	}
+	else {
+		condition.Right = Source(t, d - 1);
+	}
+	condition.Register = Source(t, d - 2);
+	t->Stack[d - 2] = condition;
+}
+
+// Pops the condition of a BZ or BNZ and emits the branch
+static void ConditionalBranch(Translator *t, const Instruction *instr, bool onTrue) {
+	Slot slot = t->Stack[--t->Depth];
+	Flush(t, t->Depth);
+	switch (slot.Kind) {
+		case Slot_Condition: {
+			RegInstruction *branch = Emit(t, BranchOpcode(slot.Compare, onTrue, slot.RightConstant), slot.Register, slot.Right, 0);
+			branch->Immediate = slot.Constant;
+			branch->Target = instr->Target;
+			break;
+		}
+		case Slot_Constant:
+			if ((slot.Constant != 0) == onTrue)
+				Emit(t, REG_JMP, 0, 0, 0)->Target = instr->Target;
+			break;
+		default: {
+			u32 reg = slot.Kind == Slot_Copy ? slot.Register : t->Depth;
+			Emit(t, onTrue ? REG_BNZ : REG_BZ, reg, 0, 0)->Target = instr->Target;
+			break;
+		}
+	}
+}
+
+static void Call(Translator *t, RegOpcode opcode, const Function *callee) {
+	Flush(t, t->Depth);
+	t->Depth -= callee->NumArgs;
+	Emit(t, opcode, t->Depth, 0, 0)->Callee = callee;
+	if ((callee->Flags & FF_VOID) == 0)
+		t->Stack[t->Depth++] = (Slot) { .Kind = Slot_InPlace };
+}
+
+// Translates one stack instruction, or one part of a superinstruction, which
+// shares the decoded operands of the whole
+static bool Translate(Translator *t, const Instruction *instr, u32 opcode) {
+	switch (opcode) {
+		case NOP:
+			break;
+		case PUSH:
+			PushConstant(t, instr->Immediate);
+			break;
+		case POP:
+			t->Depth--;
+			break;
+		case DUP:
+			PushCopy(t, t->Depth - 1);
+			break;
+		case XCHG:
+			Materialize(t, t->Depth - 2);
+			Materialize(t, t->Depth - 1);
+			Emit(t, REG_SWAP, t->Depth - 2, t->Depth - 1, 0);
+			break;
+		case LOAD:
+			// an argument slot that has been popped holds whatever was last
+			// pushed there, which pending slots may not have written yet
+			if ((u32) instr->Immediate >= t->Depth)
+				return false;
+			PushCopy(t, (u32) instr->Immediate);
+			break;
+		case ADD:
+		case SUB:
+		case MUL:
+		case DIV:
+			Arithmetic(t, opcode);
+			break;
+		case EQ:
+		case NE:
+		case LT:
+		case LTE:
+			Compare(t, opcode);
+			break;
+		case BZ:
+		case BNZ:
+			ConditionalBranch(t, instr, opcode == BNZ);
+			break;
+		case BNE: {
+			if (t->Stack[t->Depth - 1].Kind == Slot_Condition)
+				Materialize(t, t->Depth - 1);
+			Slot right = t->Stack[--t->Depth];
+			Flush(t, t->Depth);
+			RegInstruction *branch;
+			if (right.Kind == Slot_Constant) {
+				branch = Emit(t, REG_BNEI, t->Depth - 1, 0, 0);
+				branch->Immediate = right.Constant;
+			}
+			else {
+				branch = Emit(t, REG_BNE, t->Depth - 1, right.Kind == Slot_Copy ? right.Register : t->Depth, 0);
+			}
+			branch->Target = instr->Target;
+			break;
+		}
+		case JMP:
+			Flush(t, t->Depth);
+			Emit(t, REG_JMP, 0, 0, 0)->Target = instr->Target;
+			break;
+		case CALL:
+		case CALL_SELF:
+			Call(t, REG_CALL, instr->Callee);
+			break;
+		case TAILCALL:
+		case TAILCALL_SELF:
+			// TAILCALL only falls through to the RET when it can't reuse the
+			// frame, and then returns to it like a CALL, so that RET gets the
+			// PC of the RET byte it replaced
+			Call(t, REG_TAILCALL, instr->Callee);
+			t->PC = instr->PC + 5;
+			t->Index[t->PC] = t->Count;
+			return Translate(t, instr, RET);
+		case RET:
+			if (t->Depth > 0)
+				Emit(t, REG_RET, Source(t, t->Depth - 1), 0, 0);
+			else
+				Emit(t, REG_RETV, 0, 0, 0);
+			break;
+		case HALT:
+			Flush(t, t->Depth);
+			Emit(t, REG_HALT, 0, 0, 0);
+			break;
+		case PANIC:
+			Flush(t, t->Depth);
+			Emit(t, REG_PANIC, 0, 0, 0);
+			break;
+#define X(M, ...) \
+		case M: { \
+			static const u8 sequence[MAX_SEQUENCE] = { __VA_ARGS__ }; \
+			for (u32 i = 0; i < MAX_SEQUENCE && sequence[i] != NOP; i++) { \
+				if (!Translate(t, instr, sequence[i])) \
+					return false; \
+			} \
+			break; \
+		}
+		SUPERINSTRUCTIONS
+#undef X
+		default:
+			return false;
+	}
+	return true;
+}
+
+static bool TranslateFunction(Function *function) {
+	// registers are numbered up to MaxStack, in the u16 operands
+	if (function->MaxStack + 1 > UINT16_MAX) {
+		TRACE("[regcode] %s: too many registers, staying on the stack VM", function->Name);
+		return false;
+	}
+
+	u32 count = 0;
+	while (function->Code[count].PC < function->Body.Length)
+		count++;
+
+	Translator t = {
+		.Function = function,
+		.Stack = calloc(function->MaxStack + 1, sizeof(Slot)),
+		.Depth = function->NumArgs
+	};
+	bool *isTarget = calloc(count, sizeof(bool));
+	u32 *labels = calloc(count, sizeof(u32));
+	u32 *index = calloc(function->Body.Length, sizeof(u32));
+	t.Index = index;
+	for (u32 i = 0; i < count; i++) {
+		if (Opcode_IsBranch(function->Code[i].Opcode))
+			isTarget[function->Code[i].Target] = true;
+	}
+
+	bool ok = true;
+	bool live = true; // control falls into the next instruction
+	u32 reachable = 0;
+	for (u32 i = 0; i < count && ok; i++) {
+		const Instruction *instr = &function->Code[i];
+		if (instr->Depth < 0) {
+			live = false;
+			continue;
+		}
+		t.PC = instr->PC;
+		index[instr->PC] = t.Count;
+		if (isTarget[i]) {
+			if (live)
+				Flush(&t, t.Depth);
+			t.Depth = (u32) instr->Depth;
+			memset(t.Stack, 0, t.Depth * sizeof(Slot));
+			labels[i] = t.Count;
+		}
+		ok = Translate(&t, instr, instr->Opcode);
+		live = instr->Opcode != JMP && instr->Opcode != RET && instr->Opcode != HALT && instr->Opcode != PANIC;
+		reachable++;
+	}
+
+	if (ok) {
+		// branches were emitted with stack instruction indices
+		for (u32 i = 0; i < t.Count; i++) {
+			if (t.Code[i].Opcode >= REG_BZ && t.Code[i].Opcode <= REG_JMP)
+				t.Code[i].Target = labels[t.Code[i].Target];
+		}
+		VM_LinkRegisterCode(t.Code, t.Count);
+		function->RegCode = t.Code;
+		function->RegIndex = index;
+		function->Flags |= FF_REGISTER;
+		TRACE("[regcode] %s: %d stack instructions, %d register instructions", function->Name, reachable, t.Count);
+	}
+	else {
+		TRACE("[regcode] %s: can't translate, staying on the stack VM", function->Name);
+		free(t.Code);
+		free(index);
+	}
+
+	free(t.Stack);
+	free(isTarget);
+	free(labels);
+	return ok;
+}
+
+u32 Module_TranslateRegisters(Module *module) {
+	u32 count = 0;
+	for (u32 i = 0; i < module->NumFunctions; i++) {
+		Function *function = &module->Functions[i];
+		if ((function->Flags & (FF_NATIVE | FF_VERIFIED | FF_REGISTER)) == FF_VERIFIED && TranslateFunction(function))
+			count++;
+	}
+	return count;
+}
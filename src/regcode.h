@@ -0,0 +1,49 @@
+#pragma once
+
+#include "types.h"
+
+// X(mnemonic) for the register bytecode, see regcode.c. A, B and C are
+// registers, which are the frame's operand stack slots numbered from BP, so
+// the arguments are r0..r(NumArgs-1). Conditional branches compare unsigned.
+#define REG_MNEMONICS \
+	X(MOV) /* rA = rB */ \
+	X(MOVI) /* rA = imm */ \
+	X(SWAP) /* rA <-> rB */ \
+	X(ADD) /* rA = rB + rC */ \
+	X(SUB) \
+	X(MUL) \
+	X(DIV) \
+	X(ADDI) /* rA = rB + imm */ \
+	X(SUBI) \
+	X(EQ) /* rA = rB == rC */ \
+	X(NE) \
+	X(LT) \
+	X(LTE) \
+	X(BZ) /* if rA == 0 goto target */ \
+	X(BNZ) \
+	X(BEQ) /* if rA == rB goto target */ \
+	X(BNE) \
+	X(BLT) \
+	X(BLTE) \
+	X(BGT) \
+	X(BGTE) \
+	X(BEQI) /* if rA == imm goto target */ \
+	X(BNEI) \
+	X(BLTI) \
+	X(BLTEI) \
+	X(BGTI) \
+	X(BGTEI) \
+	X(JMP) \
+	X(CALL) /* args in rA.., result to rA */ \
+	X(TAILCALL) /* as CALL, but reuses the frame if it can; a RET follows */ \
+	X(RET) /* return rA */ \
+	X(RETV) /* return nothing */ \
+	X(HALT) \
+	X(PANIC)
+
+#define X(m) REG_ ## m,
+typedef enum {
+	REG_MNEMONICS
+	NUM_REG_OPCODES
+} RegOpcode;
+#undef X
@@ -0,0 +1,194 @@
+#include "resolver.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Binding {
+	Atom Name;
+	u32 Level; // function nesting level it was bound at, 0 for globals
+	u32 Slot;
+	AstIndex Function; // the function it names, AST_NONE for a parameter or builtin
+} Binding;
+
+// A function named other than as the function a call calls
+typedef struct ValueUse {
+	const AstNode *Identifier;
+	AstIndex Function;
+} ValueUse;
+
+typedef struct Resolver {
+	Ast *Ast;
+	Binding *Bindings; // visible names, innermost last
+	u32 NumBindings, Capacity;
+	u32 Level;
+	u32 NextSlot, MaxSlot; // of the function being resolved
+	AstIndex *Enclosing; // function being resolved at each level
+	u32 EnclosingCapacity;
+	bool *Captures; // per node, for functions that read an enclosing function's locals
+	ValueUse *Uses;
+	u32 NumUses, UseCapacity;
+	u32 Errors;
+} Resolver;
+
+static void Resolve(Resolver *r, AstIndex index);
+
+static Atom NameOf(Resolver *r, const AstNode *node) {
+	return AST_TOKEN(r->Ast, node->Token)->Atom;
+}
+
+static u32 Declare(Resolver *r, Atom name, u32 first, AstIndex function) {
+	for (u32 i = first; i < r->NumBindings; i++) {
+		if (r->Bindings[i].Name == name) {
+			const String *text = Atom_Name(name);
+			ERROR("[resolver] '%.*s' is already defined", text->Length, text->Bytes);
+			r->Errors++;
+			return r->Bindings[i].Slot;
+		}
+	}
+	if (r->NumBindings == r->Capacity) {
+		r->Capacity = r->Capacity ? 2 * r->Capacity : 64;
+		r->Bindings = realloc(r->Bindings, r->Capacity * sizeof(Binding));
+	}
+	u32 slot = r->NextSlot++;
+	if (r->NextSlot > r->MaxSlot)
+		r->MaxSlot = r->NextSlot;
+	r->Bindings[r->NumBindings++] = (Binding) { name, r->Level, slot, function };
+	return slot;
+}
+
+static void ResolveIdentifier(Resolver *r, AstNode *node, bool callee) {
+	Atom name = NameOf(r, node);
+	for (u32 i = r->NumBindings; i > 0; i--) {
+		const Binding *binding = &r->Bindings[i - 1];
+		if (binding->Name == name) {
+			node->Lhs = binding->Level == 0 ? AST_GLOBAL : r->Level - binding->Level;
+			node->Rhs = binding->Slot;
+			// every function between here and where the name was bound reads
+			// through the activations around it
+			if (binding->Level != 0) {
+				for (u32 level = binding->Level + 1; level <= r->Level; level++)
+					r->Captures[r->Enclosing[level]] = true;
+			}
+			if (binding->Function != AST_NONE && !callee) {
+				if (r->NumUses == r->UseCapacity) {
+					r->UseCapacity = r->UseCapacity ? 2 * r->UseCapacity : 16;
+					r->Uses = realloc(r->Uses, r->UseCapacity * sizeof(ValueUse));
+				}
+				r->Uses[r->NumUses++] = (ValueUse) { node, binding->Function };
+			}
+			return;
+		}
+	}
+	const Token *token = AST_TOKEN(r->Ast, node->Token);
+	SourcePosition at = Ast_Position(r->Ast, token);
+	ERROR("[resolver] %d:%d: unresolved identifier '%.*s'", at.Line, at.Column, token->Text.Length, token->Text.Bytes);
+	r->Errors++;
+}
+
+// Resolves statements that share a scope, declaring the functions among them
+// first so they can be called before the point they are defined
+static void ResolveScope(Resolver *r, const AstIndex *statements, u32 count) {
+	u32 first = r->NumBindings, slot = r->NextSlot;
+	for (u32 i = 0; i < count; i++) {
+		const AstNode *node = AST_NODE(r->Ast, statements[i]);
+		if (node->Type == AstNode_Function)
+			AST_EXTRA(r->Ast, node, 3) = Declare(r, NameOf(r, node), first, statements[i]);
+	}
+	for (u32 i = 0; i < count; i++)
+		Resolve(r, statements[i]);
+	r->NumBindings = first;
+	r->NextSlot = slot;
+}
+
+static void ResolveFunction(Resolver *r, AstIndex index) {
+	const AstNode *node = AST_NODE(r->Ast, index);
+	u32 slot = r->NextSlot, max = r->MaxSlot;
+	r->Level++;
+	r->NextSlot = r->MaxSlot = 0;
+	if (r->Level >= r->EnclosingCapacity) {
+		r->EnclosingCapacity = r->EnclosingCapacity ? 2 * r->EnclosingCapacity : 16;
+		r->Enclosing = realloc(r->Enclosing, r->EnclosingCapacity * sizeof(AstIndex));
+	}
+	r->Enclosing[r->Level] = index;
+
+	u32 first = r->NumBindings;
+	AST_FOREACH(param, r->Ast, node->Lhs, Declare(r, NameOf(r, AST_NODE(r->Ast, param)), first, AST_NONE));
+	AstIndex body = AST_EXTRA(r->Ast, node, 1);
+	ResolveScope(r, &body, 1);
+	AST_EXTRA(r->Ast, node, 2) = r->MaxSlot;
+
+	r->NumBindings = first;
+	r->Level--;
+	r->NextSlot = slot;
+	r->MaxSlot = max;
+}
+
+static void Resolve(Resolver *r, AstIndex index) {
+	if (index == AST_NONE)
+		return;
+	AstNode *node = AST_NODE(r->Ast, index);
+	switch (node->Type) {
+		case AstNode_Block:
+			ResolveScope(r, &AST_LIST_ITEM(r->Ast, node->Lhs, 0), AST_LIST_LENGTH(r->Ast, node->Lhs));
+			break;
+		case AstNode_Function:
+			ResolveFunction(r, index);
+			break;
+		case AstNode_If:
+			Resolve(r, node->Lhs);
+			ResolveScope(r, &AST_EXTRA(r->Ast, node, 0), 1);
+			ResolveScope(r, &AST_EXTRA(r->Ast, node, 1), 1);
+			break;
+		case AstNode_Return:
+			Resolve(r, node->Lhs);
+			break;
+		case AstNode_FunctionCall:
+			if (AST_NODE(r->Ast, node->Lhs)->Type == AstNode_Identifier)
+				ResolveIdentifier(r, AST_NODE(r->Ast, node->Lhs), true);
+			else
+				Resolve(r, node->Lhs);
+			AST_FOREACH(argument, r->Ast, node->Rhs, Resolve(r, argument));
+			break;
+		case AstNode_Expression:
+			Resolve(r, node->Lhs);
+			Resolve(r, node->Rhs);
+			break;
+		case AstNode_Identifier:
+			ResolveIdentifier(r, node, false);
+			break;
+		default:
+			break;
+	}
+}
+
+// A function that reads its enclosing functions' locals finds them through
+// their activations, which are gone once they return, so it can only be
+// called from inside them, by name
+static void CheckUses(Resolver *r) {
+	for (u32 i = 0; i < r->NumUses; i++) {
+		if (!r->Captures[r->Uses[i].Function])
+			continue;
+		const Token *token = AST_TOKEN(r->Ast, r->Uses[i].Identifier->Token);
+		SourcePosition at = Ast_Position(r->Ast, token);
+		ERROR("[resolver] %d:%d: '%.*s' uses the variables of a function around it, so it can only be called, not used as a value",
+			at.Line, at.Column, token->Text.Length, token->Text.Bytes);
+		r->Errors++;
+	}
+}
+
+bool Resolver_Resolve(Ast *ast, const char *const *builtins, u32 numBuiltins) {
+	Resolver r = { .Ast = ast, .Captures = calloc(ast->NumNodes, sizeof(bool)) };
+	for (u32 i = 0; i < numBuiltins; i++)
+		Declare(&r, Atom_Intern(&(String) { (u8 *) builtins[i], strlen(builtins[i]) }), 0, AST_NONE);
+	Resolve(&r, ast->Root);
+	CheckUses(&r);
+	ast->NumGlobals = r.MaxSlot;
+	free(r.Bindings);
+	free(r.Enclosing);
+	free(r.Captures);
+	free(r.Uses);
+	if (r.Errors > 0)
+		ERROR("[resolver] %d errors", r.Errors);
+	return r.Errors == 0;
+}
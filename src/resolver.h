@@ -0,0 +1,19 @@
+#pragma once
+
+#include "ast.h"
+
+// Binds every identifier in the tree to where its value will live, so the
+// evaluator never looks a name up at run time. Names are lexically scoped:
+// a block (or an if branch) opens a scope, and the functions defined in it
+// are visible throughout it, as the compiler sees them. Each function gets a
+// flat array of locals, parameters first; the top level's locals are the
+// globals, and the builtins are globals 0 to numBuiltins - 1.
+//
+// A nested function that uses the variables of a function around it can
+// only be called by name, not returned, passed or otherwise used as a value:
+// it would outlive the activation those variables are in.
+//
+// Fills in each identifier's depth and slot, each function's local count and
+// slot, and Ast.NumGlobals (see ast.h). Reports every name it can't resolve
+// and returns false if there were any.
+bool Resolver_Resolve(Ast *, const char *const *builtins, u32 numBuiltins);
@@ -1,10 +1,14 @@
 
 #include "scanner.h"
+#include "config.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
+
+#if SCANNER_SIMD
+#include <immintrin.h>
+#endif
 
 #define TAKE_WHILE(sc, tok, test) \
 	do { \
@@ -14,23 +18,67 @@
 		if (tok) tok->Text.Length = sc->Pos - pos; \
 	} while (0)
 
+typedef struct ChunkNames ChunkNames;
+static u32 AddName(ChunkNames *, const String *);
+
 struct Scanner {
-    u32 Pos, Line, Column;
+    u32 Pos;
     const u8 *Text;
     u32 TextLength;
 	 bool Done;
+	 LineIndex Lines;
+	 // a streaming scanner's Text is a window of Buffer, which starts at Base in
+	 // the whole input; Pos is relative to it, and Token.Pos is Base + Pos
+	 ScannerRead Read;
+	 void *Context;
+	 u8 *Buffer;
+	 u32 Capacity;
+	 u32 Base;
+	 bool AtEnd;
+	 ChunkNames *Names; // set when scanning for Scanner_Tokenize, see ChunkNames
+	 // a streaming scanner's Lines are filled in up to LineCursor as the
+	 // window moves past them, since the text is gone by the time they're
+	 // asked for
+	 u32 LineCursor;
 };
 
+// Filled in once, by the first scanner made on any thread
+static u8 CharClasses[256];
+static void BuildCharClasses();
+static void StartLineIndex(LineIndex *);
+
+#ifdef _WIN32
+typedef struct { void *Ptr; } INIT_ONCE;
+extern int InitOnceExecuteOnce(INIT_ONCE *once, int (*fn)(INIT_ONCE *, void *, void **), void *param, void **context);
+static INIT_ONCE Once;
+static int BuildCharClassesOnce(INIT_ONCE *once, void *param, void **context);
+#define BUILD_CHAR_CLASSES() InitOnceExecuteOnce(&Once, BuildCharClassesOnce, NULL, NULL)
+#else
+#include <pthread.h>
+static pthread_once_t Once = PTHREAD_ONCE_INIT;
+#define BUILD_CHAR_CLASSES() pthread_once(&Once, BuildCharClasses)
+#endif
+
 Scanner *Scanner_New(const u8 *text, u32 length) {
+    BUILD_CHAR_CLASSES();
     Scanner *s = calloc(1, sizeof(Scanner));
     s->Text = text;
     s->TextLength = length;
-    s->Line = 1;
-    s->Column = 1;
+    s->Lines = (LineIndex) { text, length };
+    return s;
+}
+
+Scanner *Scanner_NewStream(ScannerRead read, void *context) {
+    Scanner *s = Scanner_New(NULL, 0);
+    s->Read = read;
+    s->Context = context;
+    StartLineIndex(&s->Lines);
     return s;
 }
 
 void Scanner_Release(Scanner *scanner) {
+    LineIndex_Release(&scanner->Lines);
+    free(scanner->Buffer);
     free(scanner);
 }
 
@@ -45,125 +93,605 @@ static bool Peek(Scanner *scanner, int *codePoint) {
     }   
 }
 
-static bool Lookahead(Scanner *scanner, int *codePoint) {
-    if (scanner->Pos + 1 < scanner->TextLength) {
-        *codePoint = scanner->Text[scanner->Pos + 1];
-        return true;
-    }
-    else {
-        *codePoint = -1;
-        return false;
-    }   
+static int NextChar(Scanner *scanner) {
+    return scanner->Text[scanner->Pos++];
 }
 
-static bool Match1(Scanner *scanner, const char *set) {
-	int pk;
-	return Peek(scanner, &pk) && strchr(set, pk);
+// Character classes spelled out in ASCII, rather than with ctype, so that
+// the vector code below can match them exactly whatever the locale
+static bool IsSpace(int ch) {
+	return ch == ' ' || (ch >= '\t' && ch <= '\r');
 }
 
-static bool Match2(Scanner *scanner, const char *set1, const char *set2) {
-	int pk, la;
-	if (Peek(scanner, &pk) && Lookahead(scanner, &la))
-		return strchr(set1, pk) && strchr(set2, la);
-	return false;
+static bool IsDigit(int ch) {
+	return ch >= '0' && ch <= '9';
 }
 
-static int NextChar(Scanner *scanner) {
-    int ch = scanner->Text[scanner->Pos++];
-    if (ch == '\n') {
-        scanner->Line++;
-        scanner->Column = 1;
-    }
-    else {
-        scanner->Column++;
-    }
-    return ch;
+static bool IsIdentifierStart(int ch) {
+	return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '_';
+}
+
+static bool IsIdentifierChar(int ch) {
+	return IsIdentifierStart(ch) || IsDigit(ch);
+}
+
+// What the first character of a token says about the token, which is all
+// Scanner_ReadNext switches on. Characters of no class make tokens of one
+// character, or Token_Unexpected.
+typedef enum {
+	Char_Other,
+	Char_Space,
+	Char_Digit,
+	Char_Letter,
+	Char_Quote,
+	Char_Slash, // divide or a comment
+	Char_Compound, // may be followed by '='
+} CharClass;
+
+static void BuildCharClasses() {
+	for (int ch = 0; ch < 256; ch++) {
+		CharClass cls = Char_Other;
+		if (IsSpace(ch))
+			cls = Char_Space;
+		else if (IsDigit(ch))
+			cls = Char_Digit;
+		else if (IsIdentifierStart(ch))
+			cls = Char_Letter;
+		else if (ch == '"' || ch == '\'')
+			cls = Char_Quote;
+		else if (ch == '/')
+			cls = Char_Slash;
+		else if (ch && strchr("!=><|&", ch))
+			cls = Char_Compound;
+		CharClasses[ch] = (u8) cls;
+	}
+}
+
+#ifdef _WIN32
+static int BuildCharClassesOnce(INIT_ONCE *once, void *param, void **context) {
+	BuildCharClasses();
+	return 1;
+}
+#endif
+
+// Spans: each returns where, from pos on, the run it's named for ends, or
+// the length of the text if it doesn't. Whole vectors are looked at while
+// there are enough bytes left, and the rest one at a time.
+#if SCANNER_SIMD == 32
+typedef __m256i Vector;
+#define LOAD(p) _mm256_loadu_si256((const __m256i *) (p))
+#define SPLAT(b) _mm256_set1_epi8((char) (b))
+#define EQ(x, y) _mm256_cmpeq_epi8(x, y)
+#define OR(x, y) _mm256_or_si256(x, y)
+#define SUB(x, y) _mm256_sub_epi8(x, y)
+#define MIN(x, y) _mm256_min_epu8(x, y)
+#define MASK(x) ((u32) _mm256_movemask_epi8(x))
+#define ALL_BITS 0xFFFFFFFFu
+#elif SCANNER_SIMD == 16
+typedef __m128i Vector;
+#define LOAD(p) _mm_loadu_si128((const __m128i *) (p))
+#define SPLAT(b) _mm_set1_epi8((char) (b))
+#define EQ(x, y) _mm_cmpeq_epi8(x, y)
+#define OR(x, y) _mm_or_si128(x, y)
+#define SUB(x, y) _mm_sub_epi8(x, y)
+#define MIN(x, y) _mm_min_epu8(x, y)
+#define MASK(x) ((u32) _mm_movemask_epi8(x))
+#define ALL_BITS 0xFFFFu
+#endif
+
+#if SCANNER_SIMD
+// Bytes of v from lo to hi: v - lo wraps around below lo, so it's in range
+// when it's no bigger than hi - lo
+static Vector InRange(Vector v, u8 lo, u8 hi) {
+	Vector offset = SUB(v, SPLAT(lo));
+	return EQ(MIN(offset, SPLAT(hi - lo)), offset);
 }
 
-static int IsIdentifierChar(int ch) {
-   return isalpha(ch) || isdigit(ch) || ch == '_';
+static u32 FirstBit(u32 mask) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (u32) index;
+#else
+	return (u32) __builtin_ctz(mask);
+#endif
 }
 
-static int IsNotNewline(int ch) {
-	return ch != '\n';
+// Returns from the calling span at the first byte of a vector in stop, the
+// bitmask of bytes where the span ends
+#define SCAN_VECTORS(text, pos, length, v, stop) \
+	for (; (pos) + SCANNER_SIMD <= (length); (pos) += SCANNER_SIMD) { \
+		Vector v = LOAD(&(text)[pos]); \
+		u32 _stop = (stop); \
+		if (_stop) \
+			return (pos) + FirstBit(_stop); \
+	}
+#else
+#define SCAN_VECTORS(text, pos, length, v, stop)
+#endif
+
+static u32 SpanWhitespace(const u8 *text, u32 pos, u32 length) {
+	SCAN_VECTORS(text, pos, length, v, ~MASK(OR(EQ(v, SPLAT(' ')), InRange(v, '\t', '\r'))) & ALL_BITS);
+	while (pos < length && IsSpace(text[pos]))
+		pos++;
+	return pos;
+}
+
+static u32 SpanIdentifier(const u8 *text, u32 pos, u32 length) {
+	// setting bit 5 folds upper case letters onto lower case ones and nothing
+	// else onto a letter
+	SCAN_VECTORS(text, pos, length, v, ~MASK(OR(OR(InRange(OR(v, SPLAT(0x20)), 'a', 'z'), InRange(v, '0', '9')), EQ(v, SPLAT('_')))) & ALL_BITS);
+	while (pos < length && IsIdentifierChar(text[pos]))
+		pos++;
+	return pos;
+}
+
+// Up to the next occurrence of the byte
+static u32 SpanUntil(const u8 *text, u32 pos, u32 length, u8 byte) {
+	SCAN_VECTORS(text, pos, length, v, MASK(EQ(v, SPLAT(byte))));
+	while (pos < length && text[pos] != byte)
+		pos++;
+	return pos;
+}
+
+// Up to the */ that ends a comment
+static u32 SpanComment(const u8 *text, u32 pos, u32 length) {
+	for (;; pos++) {
+		pos = SpanUntil(text, pos, length, '*');
+		if (pos + 1 >= length)
+			return length;
+		if (text[pos + 1] == '/')
+			return pos;
+	}
+}
+
+// Moves past the span, making it the token's text
+static void TakeTo(Scanner *scanner, Token *token, u32 end) {
+	token->Text.Length = end - scanner->Pos;
+	scanner->Pos = end;
+}
+
+static u32 Min(u32 x, u32 y) {
+	return x < y ? x : y;
 }
 
 static void ScanNumericLiteral(Scanner *scanner, Token *token) {
 	int ch;
-	TAKE_WHILE(scanner, token, Peek(scanner, &ch) && isdigit(ch));
+	TAKE_WHILE(scanner, token, Peek(scanner, &ch) && IsDigit(ch));
 	token->Type = Token_IntegerLiteral;
 }
 
 void InitToken(Token *token, const Scanner *scanner) {
-	token->Line = scanner->Line;
-	token->Column = scanner->Column;
+	token->Pos = scanner->Base + scanner->Pos;
 	token->Text = (String) { .Bytes = (u8 *) &scanner->Text[scanner->Pos], .Length = 0 };
+	token->Atom = ATOM_NONE;
 }
 
-bool Scanner_ReadNext(Scanner *scanner, Token *token) {
-    Token t;
-    if (token == NULL)
-        token = &t;
+static bool ReadToken(Scanner *scanner, Token *token) {
 	 InitToken(token, scanner);
 	 if (scanner->Done)
 		 return false;
-	 int ch;
-	 while (Peek(scanner, &ch)) {
-        u32 pos = scanner->Pos;
+	 const u8 *text = scanner->Text;
+	 u32 length = scanner->TextLength;
+	 while (scanner->Pos < length) {
 		  InitToken(token, scanner);
-        if (isspace(ch)) {
-			  // whitespace
-			  TAKE_WHILE(scanner, token, Peek(scanner, &ch) && isspace(ch));
-        }
-		  else if (Match2(scanner, "/", "/")) {
-			  // single line comment
-			  TAKE_WHILE(scanner, token, Peek(scanner, &ch) && ch != '\n');
-		  }
-		  else if (Match2(scanner, "/", "*")) {
-			  // multi-line comment
-			  TAKE_WHILE(scanner, token, !Match2(scanner, "*", "/"));
-			  NextChar(scanner);
-			  NextChar(scanner);
-		  }
-        else if (isdigit(ch)) {
-			  // numeric literal
+		  u8 ch = text[scanner->Pos];
+		  int next = scanner->Pos + 1 < length ? text[scanner->Pos + 1] : -1;
+		  switch (CharClasses[ch]) {
+		  case Char_Space:
+			  TakeTo(scanner, token, SpanWhitespace(text, scanner->Pos, length));
+			  continue;
+		  case Char_Slash:
+			  if (next == '/') {
+				  // single line comment
+				  TakeTo(scanner, token, SpanUntil(text, scanner->Pos, length, '\n'));
+				  continue;
+			  }
+			  if (next == '*') {
+				  // multi-line comment, which takes the rest of the text if it isn't closed
+				  TakeTo(scanner, token, SpanComment(text, scanner->Pos, length));
+				  scanner->Pos = Min(scanner->Pos + 2, length);
+				  continue;
+			  }
+			  break;
+		  case Char_Digit:
 			  ScanNumericLiteral(scanner, token);
 			  return true;
-        }
-		  else if (ch == '"' || ch == '\'') {
-			  // string literal
-			  char quote[2] = { ch, '\0' };
+		  case Char_Quote:
+			  // string literal, which takes the rest of the text if it isn't closed
 			  NextChar(scanner);
 			  token->Text.Bytes++;
-			  TAKE_WHILE(scanner, token, !Match1(scanner, quote));
-			  NextChar(scanner);
+			  TakeTo(scanner, token, SpanUntil(text, scanner->Pos, length, ch));
+			  scanner->Pos = Min(scanner->Pos + 1, length);
 			  token->Type = Token_StringLiteral;
 			  return true;
-		  }
-		  else if (isalpha(ch) || ch == '_') {
+		  case Char_Letter: {
 			  // keyword or identifier
-			  TAKE_WHILE(scanner, token, Peek(scanner, &ch) && (isalpha(ch) || isdigit(ch) || ch == '_'));
-			  TokenType type = TokenType_FromString(&token->Text);
+			  TakeTo(scanner, token, SpanIdentifier(text, scanner->Pos, length));
+			  TokenType type = TokenType_Keyword(token->Text.Bytes, token->Text.Length);
 			  token->Type = type != Token_None ? type : Token_Identifier;
+			  if (token->Type == Token_Identifier)
+				  token->Atom = scanner->Names ? AddName(scanner->Names, &token->Text) : Atom_Intern(&token->Text);
 			  return true;
 		  }
-		  else if (Match2(scanner, "!=><|&", "=")) {
-			  // comparison operators
-			  token->Text.Length = 2;
-			  token->Type = TokenType_FromString(&token->Text);
-			  NextChar(scanner);
-			  NextChar(scanner);
-			  return true;
+		  case Char_Compound:
+			  if (next == '=') {
+				  // comparison operators
+				  token->Text.Length = 2;
+				  token->Type = TokenType_Compound(ch);
+				  scanner->Pos += 2;
+				  return true;
+			  }
+			  break;
 		  }
-        else {
-			  token->Text.Length = 1;
-			  TokenType type = TokenType_FromString(&token->Text);
-			  token->Type = type != Token_None ? type : Token_Unexpected;
-			  NextChar(scanner);
-			  return true;
-        }
+		  // anything else is a token of one character
+		  token->Text.Length = 1;
+		  TokenType type = TokenType_Punctuator(ch);
+		  token->Type = type != Token_None ? type : Token_Unexpected;
+		  NextChar(scanner);
+		  return true;
     }
 	 token->Type = Token_EndOfStream;
 	 scanner->Done = true;
 	 return true;
-}
\ No newline at end of file
+}
+
+static void AddLineStart(LineIndex *, u32 start);
+
+// Adds the lines of a streaming scanner's window up to pos in the input to
+// its index
+static void CountLines(Scanner *scanner, u32 pos) {
+	u32 end = pos - scanner->Base;
+	for (u32 at = scanner->LineCursor - scanner->Base; (at = SpanUntil(scanner->Text, at, end, '\n')) < end;)
+		AddLineStart(&scanner->Lines, scanner->Base + ++at);
+	scanner->LineCursor = pos;
+}
+
+// Drops what's before Pos from the window and reads until at least need
+// bytes from Pos on are in it, or the input ends
+static void Refill(Scanner *scanner, u32 need) {
+	CountLines(scanner, scanner->Base + scanner->Pos);
+	u32 kept = scanner->TextLength - scanner->Pos;
+	// nothing's been read yet on the first call, so there's no buffer to move
+	if (kept > 0)
+		memmove(scanner->Buffer, scanner->Buffer + scanner->Pos, kept);
+	scanner->Base += scanner->Pos;
+	scanner->TextLength = kept;
+	scanner->Pos = 0;
+	while (!scanner->AtEnd && scanner->TextLength < need) {
+		if (scanner->Capacity - scanner->TextLength < SCANNER_CHUNK) {
+			while (scanner->Capacity - scanner->TextLength < SCANNER_CHUNK)
+				scanner->Capacity = scanner->Capacity ? 2 * scanner->Capacity : 2 * SCANNER_CHUNK;
+			scanner->Buffer = realloc(scanner->Buffer, scanner->Capacity);
+		}
+		size_t n = scanner->Read(scanner->Context, scanner->Buffer + scanner->TextLength, scanner->Capacity - scanner->TextLength);
+		if (n == 0)
+			scanner->AtEnd = true;
+		scanner->TextLength += (u32) n;
+	}
+	scanner->Text = scanner->Buffer;
+}
+
+bool Scanner_ReadNext(Scanner *scanner, Token *token) {
+    Token t;
+    if (token == NULL)
+        token = &t;
+	 if (scanner->Read == NULL)
+		 return ReadToken(scanner, token);
+	 if (!scanner->AtEnd && scanner->TextLength - scanner->Pos < SCANNER_CHUNK)
+		 Refill(scanner, SCANNER_CHUNK);
+	 for (;;) {
+		 bool more = ReadToken(scanner, token);
+		 // a token that runs into the end of what's been read may go on past
+		 // it, so read more and scan it again, from the start of the token
+		 // rather than any whitespace and comments skipped on the way to it
+		 if (scanner->AtEnd || scanner->Pos + 1 < scanner->TextLength)
+			 return more;
+		 scanner->Pos = token->Pos - scanner->Base;
+		 scanner->Done = false;
+		 u32 length = scanner->TextLength - scanner->Pos;
+		 Refill(scanner, length + (length > SCANNER_CHUNK ? length : SCANNER_CHUNK));
+	 }
+}
+
+bool Scanner_Streaming(const Scanner *scanner) {
+	return scanner->Read != NULL;
+}
+
+LineIndex Scanner_Lines(Scanner *scanner) {
+	if (scanner->Read == NULL)
+		return (LineIndex) { scanner->Text, scanner->TextLength };
+	CountLines(scanner, scanner->Base + scanner->TextLength);
+	LineIndex lines = scanner->Lines;
+	scanner->Lines = (LineIndex) { 0 };
+	return lines;
+}
+
+SourcePosition Scanner_Position(Scanner *scanner, const Token *token) {
+	if (scanner->Read) {
+		assert(token->Pos >= scanner->LineCursor && token->Pos <= scanner->Base + scanner->TextLength);
+		CountLines(scanner, token->Pos);
+	}
+	return LineIndex_Find(&scanner->Lines, token->Pos);
+}
+// Parallel tokenization: the text is split at newlines that aren't in a
+// string or block comment, which a pre-pass that only looks at quotes and
+// slashes finds, and the chunks are scanned on their own threads. Everything
+// else that can contain a newline ends before one, so each split is between
+// tokens, and scanning from it gives the tokens a scan from the start would.
+// Tokens hold their offset in the whole text, so nothing needs fixing up
+// when the chunks are put back together.
+
+#ifdef _WIN32
+typedef void *Thread;
+extern void *CreateThread(void *security, size_t stackSize, u32 (*start)(void *), void *arg, u32 flags, u32 *id);
+extern u32 WaitForSingleObject(void *handle, u32 milliseconds);
+extern int CloseHandle(void *handle);
+#define INFINITE 0xFFFFFFFFu
+#else
+#include <pthread.h>
+typedef pthread_t Thread;
+#endif
+
+// The identifiers a thread comes to are numbered by the thread itself, in a
+// table of its own, rather than interned under the atom table's lock one at a
+// time. Once the threads are done, each chunk's names are interned in order,
+// which numbers the atoms as a scan on one thread would.
+struct ChunkNames {
+	String *Names; // a token's Atom k stands for Names[k - 1]
+	u32 *Hashes;
+	u32 NumNames, Capacity;
+	u32 *Slots; // 0 for an empty slot
+	u32 SlotMask;
+};
+
+static u32 AddName(ChunkNames *names, const String *name) {
+	// keep the slots at most half full
+	if (names->Slots == NULL || 2 * names->NumNames >= names->SlotMask + 1) {
+		u32 capacity = names->Slots ? 2 * (names->SlotMask + 1) : 256;
+		free(names->Slots);
+		names->Slots = calloc(capacity, sizeof(u32));
+		names->SlotMask = capacity - 1;
+		for (u32 k = 1; k <= names->NumNames; k++) {
+			u32 i = names->Hashes[k - 1] & names->SlotMask;
+			while (names->Slots[i])
+				i = (i + 1) & names->SlotMask;
+			names->Slots[i] = k;
+		}
+	}
+	u32 hash = Atom_HashBytes(name->Bytes, name->Length);
+	for (u32 i = hash & names->SlotMask;; i = (i + 1) & names->SlotMask) {
+		u32 k = names->Slots[i];
+		if (k && names->Hashes[k - 1] == hash && String_Equals(&names->Names[k - 1], name))
+			return k;
+		if (k == 0) {
+			if (names->NumNames == names->Capacity) {
+				names->Capacity = names->Capacity ? 2 * names->Capacity : 256;
+				names->Names = realloc(names->Names, names->Capacity * sizeof(String));
+				names->Hashes = realloc(names->Hashes, names->Capacity * sizeof(u32));
+			}
+			names->Names[names->NumNames] = *name;
+			names->Hashes[names->NumNames] = hash;
+			return names->Slots[i] = ++names->NumNames;
+		}
+	}
+}
+
+typedef struct Chunk {
+	const u8 *Text;
+	u32 Length;
+	u32 Start, End;
+	Token *Tokens;
+	u32 NumTokens, Capacity;
+	bool ReachedEnd; // if so, Last is the Token_EndOfStream
+	Token Last;
+	ChunkNames Names;
+} Chunk;
+
+// Gives the chunk's tokens the atoms for the names it numbered
+static void InternNames(Chunk *chunk) {
+	ChunkNames *names = &chunk->Names;
+	Atom *atoms = malloc((names->NumNames + 1) * sizeof(Atom));
+	atoms[0] = ATOM_NONE;
+	for (u32 k = 1; k <= names->NumNames; k++)
+		atoms[k] = Atom_Intern(&names->Names[k - 1]);
+	for (u32 i = 0; i < chunk->NumTokens; i++)
+		chunk->Tokens[i].Atom = atoms[chunk->Tokens[i].Atom];
+	free(atoms);
+	free(names->Names);
+	free(names->Hashes);
+	free(names->Slots);
+}
+
+// Up to the next quote or slash, or the extra byte
+static u32 SpanLexical(const u8 *text, u32 pos, u32 length, u8 extra) {
+	SCAN_VECTORS(text, pos, length, v, MASK(OR(OR(EQ(v, SPLAT('"')), EQ(v, SPLAT('\''))), OR(EQ(v, SPLAT('/')), EQ(v, SPLAT(extra))))));
+	while (pos < length && text[pos] != '"' && text[pos] != '\'' && text[pos] != '/' && text[pos] != extra)
+		pos++;
+	return pos;
+}
+
+// The first newline at or after target that isn't in a string or block
+// comment, skipping them as Scanner_ReadNext would from pos, which mustn't be
+// in one either
+static u32 FindSplit(const u8 *text, u32 pos, u32 length, u32 target) {
+	for (;;) {
+		bool hunting = pos >= target;
+		pos = SpanLexical(text, pos, hunting ? length : target, hunting ? '\n' : '"');
+		if (pos >= length)
+			return length;
+		if (pos == target && !hunting)
+			continue;
+		u8 ch = text[pos];
+		int next = pos + 1 < length ? text[pos + 1] : -1;
+		if (ch == '\n')
+			return pos;
+		else if (ch == '"' || ch == '\'')
+			pos = Min(SpanUntil(text, pos + 1, length, ch) + 1, length);
+		else if (next == '/')
+			pos = SpanUntil(text, pos, length, '\n');
+		else if (next == '*')
+			pos = Min(SpanComment(text, pos, length) + 2, length);
+		else
+			pos++;
+	}
+}
+
+// Scans the tokens that start in the chunk, and the end of the stream if
+// there are no more tokens after them
+static void ScanChunk(Chunk *chunk) {
+	Scanner *scanner = Scanner_New(chunk->Text, chunk->Length);
+	scanner->Pos = chunk->Start;
+	scanner->Names = &chunk->Names;
+	Token token;
+	while (ReadToken(scanner, &token)) {
+		if (token.Type == Token_EndOfStream) {
+			chunk->ReachedEnd = true;
+			chunk->Last = token;
+			break;
+		}
+		if (token.Pos >= chunk->End)
+			break;
+		if (chunk->NumTokens == chunk->Capacity) {
+			chunk->Capacity = chunk->Capacity ? 2 * chunk->Capacity : 1024;
+			chunk->Tokens = realloc(chunk->Tokens, chunk->Capacity * sizeof(Token));
+		}
+		chunk->Tokens[chunk->NumTokens++] = token;
+	}
+	Scanner_Release(scanner);
+}
+
+#ifdef _WIN32
+static u32 ThreadMain(void *chunk) {
+	ScanChunk(chunk);
+	return 0;
+}
+
+static bool StartThread(Thread *thread, Chunk *chunk) {
+	*thread = CreateThread(NULL, 0, ThreadMain, chunk, 0, NULL);
+	return *thread != NULL;
+}
+
+static void JoinThread(Thread thread) {
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+#else
+static void *ThreadMain(void *chunk) {
+	ScanChunk(chunk);
+	return NULL;
+}
+
+static bool StartThread(Thread *thread, Chunk *chunk) {
+	return pthread_create(thread, NULL, ThreadMain, chunk) == 0;
+}
+
+static void JoinThread(Thread thread) {
+	pthread_join(thread, NULL);
+}
+#endif
+
+Token *Scanner_Tokenize(const u8 *text, u32 length, u32 threads, u32 *count) {
+	u32 n = Min(threads ? threads : 1, length / SCANNER_SPLIT_MIN + 1);
+	Chunk *chunks = calloc(n, sizeof(Chunk));
+	Thread *handles = calloc(n, sizeof(Thread));
+	bool *started = calloc(n, sizeof(bool));
+	BUILD_CHAR_CLASSES();
+
+	u32 start = 0;
+	for (u32 i = 0; i < n; i++) {
+		u32 end = i + 1 < n ? FindSplit(text, start, length, (u32) ((uint64_t) length * (i + 1) / n)) : length;
+		chunks[i] = (Chunk) { .Text = text, .Length = length, .Start = start, .End = end };
+		start = end;
+	}
+	// the first chunk is scanned on this thread, and any whose thread
+	// couldn't be started
+	for (u32 i = 1; i < n; i++)
+		started[i] = StartThread(&handles[i], &chunks[i]);
+	ScanChunk(&chunks[0]);
+	for (u32 i = 1; i < n; i++) {
+		if (started[i])
+			JoinThread(handles[i]);
+		else
+			ScanChunk(&chunks[i]);
+	}
+	for (u32 i = 0; i < n; i++)
+		InternNames(&chunks[i]);
+
+	u32 total = 1;
+	for (u32 i = 0; i < n; i++)
+		total += chunks[i].NumTokens;
+	Token *tokens;
+	if (n == 1) {
+		// one chunk's tokens can be handed back as they are
+		tokens = realloc(chunks[0].Tokens, total * sizeof(Token));
+		tokens[total - 1] = chunks[0].Last;
+	}
+	else {
+		tokens = malloc(total * sizeof(Token));
+		u32 at = 0;
+		bool ended = false;
+		for (u32 i = 0; i < n; i++) {
+			if (chunks[i].NumTokens > 0)
+				memcpy(&tokens[at], chunks[i].Tokens, chunks[i].NumTokens * sizeof(Token));
+			at += chunks[i].NumTokens;
+			// the first chunk to reach the end got there from the last token,
+			// like a scan from the start would; any after it have no tokens
+			if (chunks[i].ReachedEnd && !ended) {
+				tokens[at] = chunks[i].Last;
+				ended = true;
+			}
+			free(chunks[i].Tokens);
+		}
+		assert(ended && at + 1 == total);
+	}
+	free(started);
+	free(handles);
+	free(chunks);
+	*count = total;
+	return tokens;
+}
+
+#define LINE_INDEX_MIN 64
+
+static void StartLineIndex(LineIndex *lines) {
+	lines->Starts = malloc(LINE_INDEX_MIN * sizeof(u32));
+	lines->Starts[0] = 0;
+	lines->NumLines = 1;
+}
+
+// Starts doubles in size from LINE_INDEX_MIN, so it's full whenever
+// NumLines is a power of two at least that big
+static void AddLineStart(LineIndex *lines, u32 start) {
+	u32 n = lines->NumLines;
+	if (n >= LINE_INDEX_MIN && (n & (n - 1)) == 0)
+		lines->Starts = realloc(lines->Starts, 2 * n * sizeof(u32));
+	lines->Starts[lines->NumLines++] = start;
+}
+
+static void BuildLineIndex(LineIndex *lines) {
+	StartLineIndex(lines);
+	for (u32 pos = 0; (pos = SpanUntil(lines->Text, pos, lines->Length, '\n')) < lines->Length;)
+		AddLineStart(lines, ++pos);
+}
+
+SourcePosition LineIndex_Find(LineIndex *lines, u32 pos) {
+	if (lines->Starts == NULL)
+		BuildLineIndex(lines);
+	// the last line starting at or before pos
+	u32 lo = 0, hi = lines->NumLines;
+	while (hi - lo > 1) {
+		u32 mid = lo + (hi - lo) / 2;
+		if (lines->Starts[mid] <= pos)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return (SourcePosition) { lo + 1, pos - lines->Starts[lo] + 1 };
+}
+
+void LineIndex_Release(LineIndex *lines) {
+	free(lines->Starts);
+	lines->Starts = NULL;
+	lines->NumLines = 0;
+}
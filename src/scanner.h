@@ -6,8 +6,41 @@
 
 typedef struct Scanner Scanner;
 
+// Scans the whole text, which must outlive the scanner and any tokens or
+// tree made from them, since tokens' Text points into it
 Scanner *Scanner_New(const u8 *text, u32 length);
 
+// Reads up to capacity bytes into the buffer, returning 0 at the end
+typedef size_t (*ScannerRead)(void *context, u8 *buffer, size_t capacity);
+
+// Scans text that's read a chunk at a time, for inputs too big to hold at
+// once or that arrive on a pipe. Only a window around the current token is
+// kept, so a token's Text is only good until the next Scanner_ReadNext, and
+// Scanner_Position only works for the latest token. The parser copies the
+// text of the tokens it keeps into the tree.
+Scanner *Scanner_NewStream(ScannerRead read, void *context);
+
+// Whether the scanner was made with Scanner_NewStream
+bool Scanner_Streaming(const Scanner *);
+
 void Scanner_Release(Scanner *);
 
-bool Scanner_ReadNext(Scanner *, Token *);
\ No newline at end of file
+bool Scanner_ReadNext(Scanner *, Token *);
+
+// Scans the whole text on up to the given number of threads, returning the
+// tokens Scanner_ReadNext would, up to and including the Token_EndOfStream.
+// Identifiers are interned after the threads finish, in the order a scan on
+// one thread would intern them. Free the tokens with free.
+Token *Scanner_Tokenize(const u8 *text, u32 length, u32 threads, u32 *count);
+
+// Returns the scanner's source as a LineIndex that hasn't been built yet. A
+// streaming scanner's text is gone, so it hands over the line starts it has
+// seen instead, which covers every token read so far; its own
+// Scanner_Position stops working.
+LineIndex Scanner_Lines(Scanner *);
+
+SourcePosition Scanner_Position(Scanner *, const Token *);
+
+SourcePosition LineIndex_Find(LineIndex *, u32 pos);
+
+void LineIndex_Release(LineIndex *);
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include "source.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define GENERIC_READ 0x80000000u
+#define FILE_SHARE_READ 0x1
+#define OPEN_EXISTING 3
+#define PAGE_READONLY 0x02
+#define FILE_MAP_READ 0x4
+#define INVALID_HANDLE_VALUE ((void *) (intptr_t) -1)
+extern void *CreateFileA(const char *name, u32 access, u32 share, void *security, u32 disposition, u32 flags, void *templateFile);
+extern int GetFileSizeEx(void *file, int64_t *size);
+extern void *CreateFileMappingA(void *file, void *security, u32 protect, u32 sizeHigh, u32 sizeLow, const char *name);
+extern void *MapViewOfFile(void *mapping, u32 access, u32 offsetHigh, u32 offsetLow, size_t length);
+extern int UnmapViewOfFile(const void *address);
+extern int CloseHandle(void *handle);
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Reads the whole stream into memory
+static bool ReadAll(Source *source, FILE *file) {
+	size_t capacity = 1 << 16, length = 0;
+	u8 *text = malloc(capacity);
+	for (size_t n; text && (n = fread(&text[length], 1, capacity - length, file)) > 0;) {
+		length += n;
+		if (length > UINT32_MAX) {
+			ERROR("[source] input is larger than 4 GB");
+			free(text);
+			return false;
+		}
+		if (length == capacity)
+			text = realloc(text, capacity *= 2);
+	}
+	if (text == NULL)
+		return false;
+	*source = (Source) { .Text = text, .Length = (u32) length };
+	return true;
+}
+
+// Maps the whole file, returning false with source untouched if it can't be
+// mapped; empty files can't be, and there's nothing to map anyway
+static bool Map(Source *source, const char *path) {
+#ifdef _WIN32
+	void *file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	int64_t size = 0;
+	void *mapping = NULL;
+	if (GetFileSizeEx(file, &size) && size > 0 && size <= UINT32_MAX)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL)
+		return false;
+	const u8 *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (view == NULL) {
+		CloseHandle(mapping);
+		return false;
+	}
+	*source = (Source) { .Text = view, .Length = (u32) size, .Mapping = mapping, .MappedLength = (size_t) size };
+	return true;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void *view = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= UINT32_MAX)
+		view = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (view == MAP_FAILED)
+		return false;
+	// the scanner reads straight through
+	madvise(view, st.st_size, MADV_SEQUENTIAL);
+	*source = (Source) { .Text = view, .Length = (u32) st.st_size, .Mapping = view, .MappedLength = (size_t) st.st_size };
+	return true;
+#endif
+}
+
+bool Source_Open(Source *source, const char *path) {
+	*source = (Source) { 0 };
+	if (strcmp(path, "-") == 0)
+		return ReadAll(source, stdin);
+	if (Map(source, path))
+		return true;
+	FILE *file = NULL;
+	if (fopen_s(&file, path, "rb") != 0) {
+		ERROR("[source] could not open file '%s' for reading", path);
+		return false;
+	}
+	bool ok = ReadAll(source, file);
+	fclose(file);
+	return ok;
+}
+
+void Source_Release(Source *source) {
+	if (source->Mapping) {
+#ifdef _WIN32
+		UnmapViewOfFile(source->Text);
+		CloseHandle(source->Mapping);
+#else
+		munmap(source->Mapping, source->MappedLength);
+#endif
+	}
+	else {
+		free((void *) source->Text);
+	}
+	*source = (Source) { 0 };
+}
+
+size_t Source_ReadFile(void *file, u8 *buffer, size_t capacity) {
+	return fread(buffer, 1, capacity, file);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "types.h"
+
+// The text of a script. A file is mapped into memory where it can be, so that
+// tokens and the tree built from them point straight into the file; anything
+// that can't be mapped, such as a pipe, is read into memory instead.
+
+typedef struct Source {
+	const u8 *Text;
+	u32 Length;
+	void *Mapping; // set when Text is a mapped view of a file
+	size_t MappedLength;
+} Source;
+
+// Opens the file, or standard input if the path is "-"
+bool Source_Open(Source *, const char *path);
+
+void Source_Release(Source *);
+
+// Reads up to capacity bytes from the FILE *, for a streaming scanner
+size_t Source_ReadFile(void *file, u8 *buffer, size_t capacity);
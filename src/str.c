@@ -10,3 +10,10 @@ char *strndup(const char *str, size_t len) {
 	r[len] = '\0';
 	return r;
 }
+
+size_t String_ToUint(const String *str) {
+	size_t x = 0;
+	for (size_t i = 0; i < str->Length && str->Bytes[i] >= '0' && str->Bytes[i] <= '9'; i++)
+		x = 10 * x + (str->Bytes[i] - '0');
+	return x;
+}
@@ -13,6 +13,11 @@ typedef struct String {
 
 #define STRING_EMPTY { 0, 0 }
 
+// The decimal number the string starts with. Unlike strtoul this never looks
+// past Length, since strings are often slices of a larger text that isn't
+// terminated.
+size_t String_ToUint(const String *);
+
 inline String String_Copy(const String *src) {
 	return (String) {
 		.Bytes = strndup((const char *)src->Bytes, src->Length),
@@ -1,10 +1,12 @@
 
 #include "token.h"
 
+#include <assert.h>
+#include <ctype.h>
 #include <string.h>
 
 #define PASTE(x,y) x ## y
-#define X(A,B) PASTE("Token_", #A),
+#define X(A,B,P) PASTE("Token_", #A),
 static const char *TYPES_TO_STRINGS[] = {
     TOKEN_TYPES
 };
@@ -18,17 +20,94 @@ static struct {
 	TokenType Type;
 	const char *Text;
 } STRINGS_TO_TYPES[] = {
-#define X(A,B) { Token_ ## A, B },
+#define X(A,B,P) { Token_ ## A, B },
 	TOKEN_TYPES
 #undef X
 };
 
-TokenType TokenType_FromString(const String *str) {
-	for (int i = 0; i < countof(STRINGS_TO_TYPES); i++) {
+// Keywords sit in a table indexed by a hash of their length and first and
+// last characters, which is perfect for the keywords in TOKEN_TYPES; adding
+// one that collides trips the assert below. Punctuators of one character, or
+// of one followed by '=', are looked up by that character.
+#define KEYWORD_SLOTS 16
+#define KEYWORD_HASH(text, length) (((text)[0] + (text)[(length) - 1] + (length)) & (KEYWORD_SLOTS - 1))
+
+static struct {
+	TokenType Type;
+	const char *Text;
+	size_t Length;
+} Keywords[KEYWORD_SLOTS];
+
+static TokenType Punctuators[256];
+static TokenType Compounds[256];
+
+// The tables are filled in once, by whichever thread looks something up first
+#ifdef _WIN32
+typedef struct { void *Ptr; } INIT_ONCE;
+extern int InitOnceExecuteOnce(INIT_ONCE *once, int (*fn)(INIT_ONCE *, void *, void **), void *param, void **context);
+static INIT_ONCE Once;
+static int BuildTablesOnce(INIT_ONCE *once, void *param, void **context);
+#define BUILD_TABLES() InitOnceExecuteOnce(&Once, BuildTablesOnce, NULL, NULL)
+#else
+#include <pthread.h>
+static pthread_once_t Once = PTHREAD_ONCE_INIT;
+#define BUILD_TABLES() pthread_once(&Once, BuildTables)
+#endif
+
+static void BuildTables() {
+	for (size_t i = 0; i < countof(STRINGS_TO_TYPES); i++) {
 		const char *text = STRINGS_TO_TYPES[i].Text;
-		if (text && strlen(text) == str->Length && strncmp(text, str->Bytes, str->Length) == 0) {
-			return STRINGS_TO_TYPES[i].Type;
+		TokenType type = STRINGS_TO_TYPES[i].Type;
+		size_t length = text ? strlen(text) : 0;
+		if (length == 0)
+			continue;
+		if (isalpha((u8) text[0])) {
+			u32 slot = KEYWORD_HASH((const u8 *) text, length);
+			assert((Keywords[slot].Text == NULL || Keywords[slot].Text == text) && "keywords collide in KEYWORD_HASH");
+			Keywords[slot].Type = type;
+			Keywords[slot].Text = text;
+			Keywords[slot].Length = length;
+		}
+		else if (length == 1) {
+			Punctuators[(u8) text[0]] = type;
+		}
+		else if (length == 2 && text[1] == '=') {
+			Compounds[(u8) text[0]] = type;
 		}
 	}
+}
+
+#ifdef _WIN32
+static int BuildTablesOnce(INIT_ONCE *once, void *param, void **context) {
+	BuildTables();
+	return 1;
+}
+#endif
+
+TokenType TokenType_Keyword(const u8 *text, size_t length) {
+	BUILD_TABLES();
+	if (length == 0)
+		return Token_None;
+	u32 slot = KEYWORD_HASH(text, length);
+	if (Keywords[slot].Length == length && memcmp(Keywords[slot].Text, text, length) == 0)
+		return Keywords[slot].Type;
 	return Token_None;
-}
\ No newline at end of file
+}
+
+TokenType TokenType_Punctuator(u8 ch) {
+	BUILD_TABLES();
+	return Punctuators[ch];
+}
+
+TokenType TokenType_Compound(u8 ch) {
+	BUILD_TABLES();
+	return Compounds[ch];
+}
+
+TokenType TokenType_FromString(const String *str) {
+	if (str->Length == 1)
+		return TokenType_Punctuator(str->Bytes[0]);
+	if (str->Length == 2 && str->Bytes[1] == '=')
+		return TokenType_Compound(str->Bytes[0]);
+	return TokenType_Keyword(str->Bytes, str->Length);
+}
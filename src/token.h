@@ -2,53 +2,80 @@
 
 #include "types.h"
 #include "str.h"
+#include "atom.h"
 
 #define MAX_TOKEN 1024
 
+// Each token type, its text if that's always the same, and its precedence if
+// it's a binary operator, from loosest to tightest binding, or 0
 #define TOKEN_TYPES \
-	X(None, 0) \
-	X(Unexpected, 0) \
-	X(EndOfStream, 0) \
-	X(KeywordFunction, "function") \
-	X(KeywordReturn, "return") \
-	X(KeywordIf, "if") \
-	X(KeywordElse, "else") \
-	X(KeywordInt, "int") \
-	X(KeywordUint, "uint") \
-	X(Identifier, 0) \
-	X(IntegerLiteral, 0) \
-	X(StringLiteral, 0) \
-	X(LParen, "(") \
-	X(RParen, ")") \
-	X(LBrace, "{") \
-	X(RBrace, "}") \
-	X(Colon, ":") \
-	X(Comma, ",") \
-	X(Semicolon, ";") \
-	X(Equals, "=") \
-	X(CompareEq, "==") \
-	X(CompareNotEq, "!=") \
-	X(Plus, "+") \
-	X(Minus, "-") \
-	X(Multiply, "*") \
-	X(Divide, "/") \
+	X(None, 0, 0) \
+	X(Unexpected, 0, 0) \
+	X(EndOfStream, 0, 0) \
+	X(KeywordFunction, "function", 0) \
+	X(KeywordReturn, "return", 0) \
+	X(KeywordIf, "if", 0) \
+	X(KeywordElse, "else", 0) \
+	X(KeywordInt, "int", 0) \
+	X(KeywordUint, "uint", 0) \
+	X(Identifier, 0, 0) \
+	X(IntegerLiteral, 0, 0) \
+	X(StringLiteral, 0, 0) \
+	X(LParen, "(", 0) \
+	X(RParen, ")", 0) \
+	X(LBrace, "{", 0) \
+	X(RBrace, "}", 0) \
+	X(Colon, ":", 0) \
+	X(Comma, ",", 0) \
+	X(Semicolon, ";", 0) \
+	X(Equals, "=", 0) \
+	X(CompareEq, "==", 1) \
+	X(CompareNotEq, "!=", 1) \
+	X(Plus, "+", 2) \
+	X(Minus, "-", 2) \
+	X(Multiply, "*", 3) \
+	X(Divide, "/", 3) \
 
 typedef enum {
-#define X(A,B) Token_ ## A,
+#define X(A,B,P) Token_ ## A,
     TOKEN_TYPES
 #undef X
 } TokenType;
 
 typedef struct Token {
     TokenType Type;
-    u32 Line, Column, Pos;
+    u32 Pos; // byte offset in the source, see LineIndex for its line and column
 	 String Text;
-    //const u8 *Text;
-    //u32 Length;
+	 Atom Atom; // interned Text of an identifier, ATOM_NONE for anything else
 } Token;
 
-#define TOKEN_EMPTY ((Token){ 0, 0, 0, 0, 0, 0 })
+#define TOKEN_EMPTY ((Token){ 0, 0, 0, 0 })
+
+typedef struct SourcePosition {
+	u32 Line, Column;
+} SourcePosition;
+
+// Tokens only record their offset. The line and column, which are only
+// wanted for messages, are worked out when asked for from the offsets where
+// lines start; those are found the first time anything is asked (see
+// LineIndex_Find in scanner.h).
+typedef struct LineIndex {
+	const u8 *Text;
+	u32 Length;
+	u32 *Starts; // NULL until first needed
+	u32 NumLines;
+} LineIndex;
 
 const char *TokenType_ToString(TokenType type);
 
-TokenType TokenType_FromString(const String *);
\ No newline at end of file
+TokenType TokenType_FromString(const String *);
+
+// The keyword the word spells, or Token_None
+TokenType TokenType_Keyword(const u8 *text, size_t length);
+
+// The punctuator the character is on its own, or Token_None
+TokenType TokenType_Punctuator(u8 ch);
+
+// The two character punctuator the character makes followed by '=', or
+// Token_None
+TokenType TokenType_Compound(u8 ch);
\ No newline at end of file
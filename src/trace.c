@@ -3,29 +3,94 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
-#include <malloc.h>
+#include <string.h>
 
 extern void OutputDebugStringA(const char *);
+extern int IsDebuggerPresent();
 extern void DebugBreak();
 
+// most messages fit here and are formatted once, without allocating
+#define OUTPUT_BUFFER 512
+
+u8 TraceLevels[TraceCategory_Count] = {
+#define X(A, B, C) TraceLevel_Info,
+	TRACE_CATEGORIES
+#undef X
+};
+
+static const char *CategoryNames[] = {
+#define X(A, B, C) B,
+	TRACE_CATEGORIES
+#undef X
+};
+
+static const char *LevelNames[] = {
+#define X(A, B) B,
+	TRACE_LEVELS
+#undef X
+};
+
 void output(const char *format, ...) {
+	char local[OUTPUT_BUFFER];
+	char *buf = local;
 	va_list args;
 	va_start(args, format);
-	size_t count = _vscprintf(format, args);
-	char *buf = _malloca(count + 2);
-	if (VERIFY(buf)) {
-		_vsnprintf_s(buf, count + 1, count, format, args);
-		buf[count] = '\n';
-		buf[count + 1] = '\0';
-		fwrite(buf, 1, count, stdout);
-		fputc('\n', stdout);
+	// leave room for the newline
+	int count = vsnprintf(local, sizeof(local) - 1, format, args);
+	va_end(args);
+	if (count < 0)
+		return;
+	if (count > (int) sizeof(local) - 2) {
+		buf = malloc(count + 2);
+		if (!VERIFY(buf))
+			return;
+		va_start(args, format);
+		vsnprintf(buf, count + 1, format, args);
+		va_end(args);
+	}
+	buf[count] = '\n';
+	buf[count + 1] = '\0';
+	fwrite(buf, 1, count + 1, stdout);
+	if (IsDebuggerPresent())
 		OutputDebugStringA(buf);
+	if (buf != local)
+		free(buf);
+}
+
+static int Find(const char **names, int count, const char *name, size_t length) {
+	for (int i = 0; i < count; i++)
+		if (strlen(names[i]) == length && memcmp(names[i], name, length) == 0)
+			return i;
+	return -1;
+}
+
+bool Trace_Configure(const char *spec) {
+	const int numLevels = countof(LevelNames);
+	while (*spec) {
+		const char *end = strchr(spec, ',');
+		if (end == NULL)
+			end = spec + strlen(spec);
+		const char *eq = memchr(spec, '=', end - spec);
+		if (eq == NULL) {
+			int level = Find(LevelNames, numLevels, spec, end - spec);
+			if (level < 0)
+				return false;
+			memset(TraceLevels, level, sizeof(TraceLevels));
+		}
+		else {
+			int category = Find(CategoryNames, TraceCategory_Count, spec, eq - spec);
+			int level = Find(LevelNames, numLevels, eq + 1, end - eq - 1);
+			if (category < 0 || level < 0)
+				return false;
+			TraceLevels[category] = (u8) level;
+		}
+		spec = *end ? end + 1 : end;
 	}
-	va_end(args);
+	return true;
 }
 
 int VerifyFail(const char *msg) {
 	output(msg);
 	DebugBreak();
 	return 0;
-}
\ No newline at end of file
+}
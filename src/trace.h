@@ -2,12 +2,71 @@
 
 #include <stdio.h>
 
-#define TRACE output
-#define ERROR output
+#include "types.h"
+
+// Every message belongs to a category and has a level, and each category has
+// a level set at run time (see Trace_Configure); a message is written only if
+// its level is at or below its category's. Levels finer than a category keeps
+// in the build compile to nothing, so a check that's off costs one branch on
+// a byte at most, and the message's arguments are never evaluated.
+//
+// Each category lists the finest level release builds keep. Debug builds
+// keep everything. The VM keeps its per-instruction messages in release
+// because they only run when --trace single-steps the VM anyway.
+
+#define TRACE_CATEGORIES \
+	X(General, "general", TraceLevel_Info) \
+	X(Scanner, "scanner", TraceLevel_Info) \
+	X(Parser,  "parser",  TraceLevel_Info) \
+	X(VM,      "vm",      TraceLevel_Debug) \
+	X(Eval,    "eval",    TraceLevel_Info)
+
+#define TRACE_LEVELS \
+	X(Off,   "off") \
+	X(Error, "error") \
+	X(Info,  "info") \
+	X(Debug, "debug")
+
+typedef enum TraceLevel {
+#define X(A, B) TraceLevel_ ## A,
+	TRACE_LEVELS
+#undef X
+} TraceLevel;
+
+typedef enum TraceCategory {
+#define X(A, B, C) TraceCategory_ ## A,
+	TRACE_CATEGORIES
+#undef X
+	TraceCategory_Count
+} TraceCategory;
+
+#ifdef NDEBUG
+#define X(A, B, C) TraceCompiled_ ## A = C,
+#else
+#define X(A, B, C) TraceCompiled_ ## A = TraceLevel_Debug,
+#endif
+enum { TRACE_CATEGORIES };
+#undef X
+
+extern u8 TraceLevels[TraceCategory_Count];
+
+#define TRACE_ENABLED(category, level) \
+	((int) TraceLevel_ ## level <= (int) TraceCompiled_ ## category && TraceLevel_ ## level <= TraceLevels[TraceCategory_ ## category])
+
+#define LOG(category, level, ...) \
+	do { if (TRACE_ENABLED(category, level)) output(__VA_ARGS__); } while (0)
+
+#define TRACE(...) LOG(General, Info, __VA_ARGS__)
+#define ERROR(...) LOG(General, Error, __VA_ARGS__)
 
 void output(const char *format, ...);
 
+// Sets levels from a list like "parser=debug,vm=off"; a level on its own
+// applies to every category. Returns false if the list doesn't parse.
+bool Trace_Configure(const char *);
+
 #define ASSERT(cond) assert(cond)
+
 #define ASSERT_IF_NULL(expr) { if ((expr) == NULL) assert(#expr && 0); }
 
 #ifdef _DEBUG
@@ -16,4 +75,3 @@ int VerifyFail(const char *msg);
 #else
 #define VERIFY(expr) (expr)
 #endif
-
@@ -6,6 +6,7 @@
 
 typedef uint32_t u32;
 typedef int32_t s32;
+typedef uint16_t u16;
 typedef uint8_t u8;
 typedef int8_t s8;
 
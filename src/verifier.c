@@ -0,0 +1,287 @@
+
+#include "module.h"
+#include "vm.h"
+#include "opcode.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Abstract interpretation over a function's bytecode. Every reachable
+// instruction is visited with the operand stack depth (relative to BP, so
+// args included) it will always have at run time, which lets the fast
+// interpreter loop drop its per-access bounds checks. A function passes if:
+//
+//   - every opcode is valid and every instruction fits inside the body
+//   - branch targets land on instruction boundaries
+//   - no path falls off the end of the body
+//   - each instruction sees the same stack depth on every path into it,
+//     and never pops more than is there
+//   - LOAD slots are within NumArgs, CALL indices within the module
+//   - CALL_SELF names the function it's in, and a tail call returns what the
+//     function's RET would, from a bytecode function
+//   - RET leaves a value exactly when the function isn't FF_VOID
+//   - the entry function (index 0) never returns and is never called, and
+//     it's the only function that can HALT
+//
+// Superinstructions are checked as the sequence they stand for, including the
+// value their PUSH holds for the duration, so MaxStack is the same whether or
+// not a function has been through Module_Fuse.
+
+typedef struct Verifier {
+	const Module *Module;
+	const Function *Function;
+	u32 Index;
+	bool *Starts;
+	s32 *Depths;
+	u32 *Worklist;
+	u32 NumPending;
+	u32 MaxDepth;
+} Verifier;
+
+static bool Fail(const Verifier *v, u32 pc, const char *reason) {
+	ERROR("[verifier] %s+%04Xh: %s", v->Function->Name, pc, reason);
+	return false;
+}
+
+static bool Reach(Verifier *v, u32 from, u32 target, s32 depth) {
+	if (target >= v->Function->Body.Length)
+		return Fail(v, from, "control flows past the end of the function");
+	if (!v->Starts[target])
+		return Fail(v, from, "branch target is not an instruction");
+	if (v->Depths[target] < 0) {
+		v->Depths[target] = depth;
+		v->Worklist[v->NumPending++] = target;
+	}
+	else if (v->Depths[target] != depth) {
+		return Fail(v, from, "inconsistent stack depth where paths merge");
+	}
+	return true;
+}
+
+// Checks the function index at the given offset
+static const Function *Callee(const Verifier *v, u32 pc, u32 at) {
+	u32 fi = *(const u32 *) &v->Function->Body.Bytes[at];
+	if (fi >= v->Module->NumFunctions) {
+		Fail(v, pc, "CALL index out of range");
+		return NULL;
+	}
+	if (fi == 0) {
+		Fail(v, pc, "the entry function can't be called");
+		return NULL;
+	}
+	return &v->Module->Functions[fi];
+}
+
+static bool Step(Verifier *v, u32 pc) {
+	const u8 *code = v->Function->Body.Bytes;
+	u8 opcode = code[pc];
+	u32 next = pc + INSTRUCTION_SIZE(opcode);
+	s32 depth = v->Depths[pc];
+
+	// need: values that must be on the stack, pops/pushes: net effect,
+	// held: values pushed and consumed within a superinstruction
+	s32 need = 0, pops = 0, pushes = 0, held = 0;
+	bool falls = true, branches = false;
+
+	switch (opcode) {
+		case NOP:
+			break;
+		case PUSH:
+			pushes = 1;
+			break;
+		case POP:
+			need = pops = 1;
+			break;
+		case DUP:
+			need = 1;
+			pushes = 1;
+			break;
+		case XCHG:
+			need = 2;
+			break;
+		case LOAD:
+			if (code[pc + 1] >= v->Function->NumArgs)
+				return Fail(v, pc, "LOAD slot out of range");
+			pushes = 1;
+			break;
+		case CALL:
+		case CALL_SELF: {
+			const Function *callee = Callee(v, pc, pc + 1);
+			if (callee == NULL)
+				return false;
+			if (opcode == CALL_SELF && callee != v->Function)
+				return Fail(v, pc, "CALL_SELF names another function");
+			need = pops = (s32) callee->NumArgs;
+			pushes = (callee->Flags & FF_VOID) ? 0 : 1;
+			break;
+		}
+		case TAILCALL:
+		case TAILCALL_SELF: {
+			const Function *callee = Callee(v, pc, pc + 1);
+			if (callee == NULL)
+				return false;
+			if (opcode == TAILCALL_SELF && callee != v->Function)
+				return Fail(v, pc, "TAILCALL_SELF names another function");
+			if (v->Index == 0)
+				return Fail(v, pc, "the entry function can't return");
+			if (callee->Flags & FF_NATIVE)
+				return Fail(v, pc, "tail call to a native function");
+			if ((callee->Flags & FF_VOID) != (v->Function->Flags & FF_VOID))
+				return Fail(v, pc, "tail call doesn't match the function's return type");
+			need = pops = (s32) callee->NumArgs;
+			falls = false;
+			break;
+		}
+		case RET:
+			if (v->Index == 0)
+				return Fail(v, pc, "the entry function can't return");
+			if ((v->Function->Flags & FF_VOID) ? depth != 0 : depth == 0)
+				return Fail(v, pc, "RET doesn't match the function's return type");
+			falls = false;
+			break;
+		case ADD:
+		case SUB:
+		case MUL:
+		case DIV:
+		case EQ:
+		case NE:
+		case LT:
+		case LTE:
+			need = pops = 2;
+			pushes = 1;
+			break;
+		case BZ:
+		case BNZ:
+			need = pops = 1;
+			branches = true;
+			break;
+		case BNE:
+			need = 2;
+			pops = 1;
+			branches = true;
+			break;
+		case JMP:
+			branches = true;
+			falls = false;
+			break;
+		case PUSH_ADD:
+		case PUSH_SUB:
+			need = held = 1;
+			break;
+		case PUSH_CALL:
+		case PUSH_ADD_CALL:
+		case PUSH_SUB_CALL: {
+			const Function *callee = Callee(v, pc, next - 4);
+			if (callee == NULL)
+				return false;
+			held = 1;
+			pops = (s32) callee->NumArgs;
+			pushes = (callee->Flags & FF_VOID) ? 0 : 1;
+			if (opcode == PUSH_CALL) {
+				// the pushed value is the last argument, if there are any
+				need = pops > 0 ? pops - 1 : 0;
+				pushes++;
+			}
+			else {
+				need = pops > 1 ? pops : 1;
+			}
+			break;
+		}
+		case PUSH_EQ_BZ:
+		case PUSH_NE_BZ:
+		case PUSH_LT_BZ:
+		case PUSH_LTE_BZ:
+			need = pops = held = 1;
+			branches = true;
+			break;
+		case HALT:
+			if (v->Index != 0)
+				return Fail(v, pc, "only the entry function can halt");
+			falls = false;
+			break;
+		case PANIC:
+			falls = false;
+			break;
+		default:
+			return Fail(v, pc, "invalid opcode");
+	}
+
+	if (depth < need)
+		return Fail(v, pc, "stack underflow");
+	if ((u32) (depth + held) > v->MaxDepth)
+		v->MaxDepth = depth + held;
+	depth += pushes - pops;
+	if ((u32) depth > v->MaxDepth)
+		v->MaxDepth = depth;
+
+	if (branches) {
+		s32 offset = *(const s32 *) &code[next - 4];
+		if (!Reach(v, pc, next + offset, depth))
+			return false;
+	}
+	return !falls || Reach(v, pc, next, depth);
+}
+
+static bool VerifyFunction(Module *module, u32 index) {
+	Function *function = &module->Functions[index];
+	u32 length = function->Body.Length;
+	const u8 *code = function->Body.Bytes;
+	if (length == 0) {
+		ERROR("[verifier] %s: empty function body", function->Name);
+		return false;
+	}
+
+	Verifier v = {
+		.Module = module,
+		.Function = function,
+		.Index = index,
+		.Starts = calloc(length, sizeof(bool)),
+		.Depths = malloc(length * sizeof(s32)),
+		.Worklist = malloc(length * sizeof(u32)),
+		.MaxDepth = function->NumArgs
+	};
+
+	// Find instruction boundaries first so branches can be checked against them
+	bool ok = true;
+	for (u32 pc = 0; pc < length; pc += INSTRUCTION_SIZE(code[pc])) {
+		if (code[pc] >= NUM_OPCODES) {
+			ok = Fail(&v, pc, "invalid opcode");
+			break;
+		}
+		if (pc + INSTRUCTION_SIZE(code[pc]) > length) {
+			ok = Fail(&v, pc, "truncated instruction");
+			break;
+		}
+		v.Starts[pc] = true;
+	}
+
+	if (ok) {
+		memset(v.Depths, 0xff, length * sizeof(s32));
+		v.Depths[0] = function->NumArgs;
+		v.Worklist[v.NumPending++] = 0;
+		while (ok && v.NumPending > 0)
+			ok = Step(&v, v.Worklist[--v.NumPending]);
+	}
+
+	if (ok) {
+		function->MaxStack = v.MaxDepth;
+		function->Flags |= FF_VERIFIED;
+		VM_DecodeFunction(module, function, v.Depths);
+		TRACE("[verifier] %s: ok, max stack %d", function->Name, function->MaxStack);
+	}
+
+	free(v.Starts);
+	free(v.Depths);
+	free(v.Worklist);
+	return ok;
+}
+
+bool Module_Verify(Module *module) {
+	for (u32 i = 0; i < module->NumFunctions; i++) {
+		Function *function = &module->Functions[i];
+		if ((function->Flags & (FF_NATIVE | FF_VERIFIED)) == 0 && !VerifyFunction(module, i))
+			return false;
+	}
+	return true;
+}
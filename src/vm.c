@@ -1,19 +1,43 @@
 #include "vm.h"
 #include "opcode.h"
 #include "trace.h"
+#include "recorder.h"
 
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 
 static const char *OPCODE_STRINGS[256] = {
-#define X(M) #M,
+#define X(M, N) #M,
 	MNEMONICS
 #undef X
 };
 
-#define X(M) void op_ ## M(VM *vm, Frame *frame);
+const u8 OPERAND_SIZES[NUM_OPCODES] = {
+#define X(M, N) N,
+	MNEMONICS
+#undef X
+};
+
+bool Opcode_IsBranch(u32 opcode) {
+	switch (opcode) {
+		case BZ:
+		case BNZ:
+		case BNE:
+		case JMP:
+		case PUSH_EQ_BZ:
+		case PUSH_NE_BZ:
+		case PUSH_LT_BZ:
+		case PUSH_LTE_BZ:
+			return true;
+		default:
+			return false;
+	}
+}
+
+#define X(M, N) void op_ ## M(VM *vm, Frame *frame);
 	MNEMONICS
 #undef X
 
@@ -29,12 +53,13 @@ static const char *OPCODE_STRINGS[256] = {
 	FETCH_TYPES
 #undef X
 
-u32 CheckAddress(const VM *vm, u32 addr) {
-	PANIC_IF(vm, addr >= MEMORY_SIZE);
+u32 CheckAddress(VM *vm, u32 addr) {
+	// checked against the limit first, so addr + 1 can't wrap to 0
+	PANIC_IF(vm, addr >= vm->Limits.MaxMemory || !HAS_STACK(vm, addr + 1));
 	return addr;
 }
 
-u32 Load(const VM *vm, u32 addr) {
+u32 Load(VM *vm, u32 addr) {
 	return (vm)->Memory[CheckAddress(vm, addr)];
 }
 
@@ -75,15 +100,17 @@ void VM_Panic(const VM *vm, const char *format, ...) {
 	fprintf(stderr, "] SP\n");
 
 	fprintf(stderr, "    Memory:\n    ");
-	for (u32 i = 0; i < 20; i++)
+	for (u32 i = 0; i < 20 && i < vm->MemorySize; i++)
 		fprintf(stderr, "%02X ", vm->Memory[i]);
 	fputc('\n', stderr);
 	fflush(stderr);
     fputs("*** end ***\n", stderr);
+	if ((vm->Flags & VMFLAG_RECORD) && Recorder_Save(vm->Module))
+		fputs("recording saved\n", stderr);
 	abort();
 }
 
-u32 VM_GetArg(const VM *vm, u32 index, u32 *arg) {
+u32 VM_GetArg(VM *vm, u32 index, u32 *arg) {
 	const Frame *frame = CURRENT_FRAME(vm);
 	PANIC_IF(vm, index >= frame->Function->NumArgs);
 	return Load(vm, ARG_ADDRESS(frame, index));
@@ -112,16 +139,19 @@ void StepBytecode(VM *vm) {
 	u8 opcode = frame->Function->Body.Bytes[frame->PC];
 	u32 depth = frame->SP - frame->BP;
 
+	if (vm->Flags & VMFLAG_RECORD)
+		Recorder_Record(vm, frame);
+
 	const char *mnemonic = GetMnemonic(opcode);
 
-	TRACE(
+	LOG(VM, Debug,
 		"%10s+%04Xh %4d %4.02Xh   %s ",
 		frame->Function->Name, frame->PC, depth, opcode, mnemonic);
 
 	u32 pc = frame->PC;
 
 	switch (opcode) {
-#define X(M) \
+#define X(M, N) \
 		case M: { \
 			op_ ## M(vm, frame); \
 			break; \
@@ -133,9 +163,9 @@ void StepBytecode(VM *vm) {
 		}
 	}
 
-	TRACE("\n");
+	LOG(VM, Debug, "\n");
 	if (opcode == CALL || opcode == RET)
-		TRACE("\n");
+		LOG(VM, Debug, "\n");
 
 	if ((vm->Flags & VMFLAG_HALT) == 0)
 		if (CURRENT_FRAME(vm) == frame && frame->PC == pc)
@@ -155,6 +185,41 @@ void VM_Step(VM *vm) {
 }
 
 void VM_Run(VM *vm) {
-	while ((vm->Flags & (VMFLAG_HALT | VMFLAG_BREAKPOINT)) == 0)
-		VM_Step(vm);
+	if (vm->Flags & (VMFLAG_TRACE | VMFLAG_RECORD)) {
+		while ((vm->Flags & (VMFLAG_HALT | VMFLAG_BREAKPOINT)) == 0)
+			VM_Step(vm);
+	}
+	else if ((vm->Flags & VMFLAG_REGISTER) && (CURRENT_FRAME(vm)->Function->Flags & FF_REGISTER)) {
+		VM_ExecuteRegisters(vm);
+	}
+	else {
+		VM_Execute(vm);
+	}
+}
+
+bool VM_Init(VM *vm, const Module *module, const VMLimits *limits) {
+	memset(vm, 0, sizeof(VM));
+	vm->Module = module;
+	vm->Limits = limits ? *limits : (VMLimits) { .MaxMemory = DEFAULT_MAX_MEMORY, .MaxFrames = DEFAULT_MAX_FRAMES };
+	if (vm->Limits.MaxMemory == 0 || vm->Limits.MaxFrames == 0) {
+		ERROR("[vm] stack limits must be nonzero");
+		return false;
+	}
+	if (!VM_ReserveStacks(vm))
+		return false;
+	u8 here;
+	uintptr_t top = (uintptr_t) &here;
+	vm->NativeStackLimit = top > JIT_NATIVE_STACK ? top - JIT_NATIVE_STACK : 0;
+	const Function *global = &module->Functions[0];
+	vm->CallStack.Frames[vm->CallStack.Depth++] = (Frame) { .Function = global, .PC = 0, .BP = 0, .SP = 0 };
+	return true;
+}
+
+bool VM_HasNativeStack(const VM *vm) {
+	u8 here;
+	return (uintptr_t) &here > vm->NativeStackLimit;
+}
+
+void VM_Free(VM *vm) {
+	VM_ReleaseStacks(vm);
 }
@@ -6,6 +6,7 @@
 #include "module.h"
 
 DECLARE_TYPE(Frame);
+DECLARE_TYPE(VMLimits);
 DECLARE_TYPE(VM);
 DECLARE_TYPE(Module);
 
@@ -17,15 +18,30 @@ struct Frame {
 
 #define VMFLAG_HALT 		0x01
 #define VMFLAG_BREAKPOINT   0x02
+#define VMFLAG_TRACE        0x04 // single-step through the traced op_* handlers
+#define VMFLAG_REGISTER     0x08 // run FF_REGISTER functions as register bytecode
+#define VMFLAG_RECORD       0x10 // single-step like VMFLAG_TRACE, recording each step (see recorder.h)
+
+// The most a VM's stacks may grow to
+struct VMLimits {
+	u32 MaxMemory; // words
+	u32 MaxFrames;
+};
 
 struct VM {
 	struct {
-		Frame Frames[MAX_FRAMES];
+		Frame *Frames;
 		u32 Depth;
+		u32 Capacity; // frames committed
 	} CallStack;
 	const Module *Module;
-	u32 Memory[MEMORY_SIZE];
+	u32 *Memory;
+	u32 MemorySize; // words committed
+	VMLimits Limits;
 	u32 Flags;
+	u32 ExitDepth; // VM_Execute returns when a RET drops the call stack to this depth
+	u32 ReturnValue; // value of that RET
+	uintptr_t NativeStackLimit; // see VM_HasNativeStack
 };
 
 
@@ -34,6 +50,40 @@ struct VM {
 #define PANIC_IF(vm, cond) { if (cond) VM_Panic(vm, #cond); }
 #define ARG_ADDRESS(f, i) ((f)->BP + i)
 
+// True if the stack can hold `end` words, or another frame, growing it if need be
+#define HAS_STACK(vm, end) ((end) <= (vm)->MemorySize || VM_GrowMemory(vm, end))
+#define HAS_FRAME(vm) ((vm)->CallStack.Depth < (vm)->CallStack.Capacity || VM_GrowCallStack(vm))
+
+// Limits may be NULL for the defaults. Returns false if the stacks could not
+// be reserved.
+bool VM_Init(VM *vm, const Module *module, const VMLimits *limits);
+
+void VM_Free(VM *vm);
+
 void VM_Run(VM *vm);
 
+void VM_Execute(VM *vm);
+
+void VM_DecodeFunction(const Module *module, Function *function, const s32 *depths);
+
+void VM_ExecuteRegisters(VM *vm);
+
+void VM_LinkRegisterCode(RegInstruction *code, u32 count);
+
+u32 VM_ExecuteCall(VM *vm);
+
+// JIT code recurses on the native stack, which is much smaller than the VM's
+// limits allow for. Until the native stack is JIT_NATIVE_STACK bytes deeper
+// than where VM_Init ran, this is true and calls may go to JIT code; after
+// that they run interpreted, in frames that only take VM memory.
+bool VM_HasNativeStack(const VM *vm);
+
 void VM_Panic(const VM *vm, const char *reason, ...);
+
+bool VM_ReserveStacks(VM *vm);
+
+void VM_ReleaseStacks(VM *vm);
+
+bool VM_GrowMemory(VM *vm, u32 size);
+
+bool VM_GrowCallStack(VM *vm);
@@ -0,0 +1,404 @@
+#include "vm.h"
+#include "opcode.h"
+#include "trace.h"
+
+#include <stdlib.h>
+
+void RunNativeMethod(VM *vm, Frame *frame);
+
+// The fast interpreter loop. It runs the decoded form of each function (see
+// VM_DecodeFunction): handlers are inlined, each Instruction carries its
+// resolved immediate, branch target and callee, and the running frame's SP
+// and BP live in locals alongside the instruction pointer. Frame state is
+// written back only around calls, returns and panics, where PC is kept as a
+// byte offset so the traced op_* handlers in vm_ops.c and VM_Panic keep
+// working on the same frames.
+//
+// Only verified functions run here (see verifier.c). The verifier has already
+// proven operand indices, branch targets, call arity and stack depths, so the
+// handlers do no bounds checks of their own; stack memory is checked once per
+// frame, against the callee's MaxStack, when it is called.
+
+#define SAVE_STATE(at) (frame->PC = (at)->PC, frame->SP = sp)
+
+#define LOAD_STATE() \
+	(frame = CURRENT_FRAME(vm), \
+	 code = frame->Function->Code, \
+	 ip = &code[frame->Function->CodeIndex[frame->PC]], \
+	 sp = frame->SP, bp = frame->BP)
+
+#define CHECK(cond) { if (cond) { SAVE_STATE(ip); VM_Panic(vm, #cond); } }
+
+#if VM_COMPUTED_GOTO
+#define DISPATCH() goto *ip->Handler
+#define HANDLER(M) L_ ## M:
+#else
+#define DISPATCH() goto dispatch
+#define HANDLER(M) case M:
+#endif
+
+#define COMPARE_HANDLER(M, oper) \
+	HANDLER(M) { \
+		mem[sp - 2] = mem[sp - 2] oper mem[sp - 1]; \
+		sp--; \
+		ip++; \
+		DISPATCH(); \
+	}
+
+// Values are u32, so results wrap rather than overflow
+#define ARITHMETIC_HANDLER(M, oper) \
+	HANDLER(M) { \
+		mem[sp - 2] = mem[sp - 2] oper mem[sp - 1]; \
+		sp--; \
+		ip++; \
+		DISPATCH(); \
+	}
+
+#define BRANCH_HANDLER(M, cond) \
+	HANDLER(M) { \
+		bool branch = cond; \
+		sp--; \
+		ip = branch ? &code[ip->Target] : ip + 1; \
+		DISPATCH(); \
+	}
+
+// PUSH imm; ADD|SUB
+#define ARITHMETIC_IMMEDIATE_HANDLER(M, oper) \
+	HANDLER(M) { \
+		mem[sp - 1] = mem[sp - 1] oper (u32) ip->Immediate; \
+		ip++; \
+		DISPATCH(); \
+	}
+
+// PUSH imm; EQ|NE|LT|LTE; BZ off
+#define COMPARE_BRANCH_HANDLER(M, oper) \
+	HANDLER(M) { \
+		bool branch = !(mem[sp - 1] oper (u32) ip->Immediate); \
+		sp--; \
+		ip = branch ? &code[ip->Target] : ip + 1; \
+		DISPATCH(); \
+	}
+
+// CALL, after whatever the superinstruction does to the stack first
+#define CALL_HANDLER(M, prefix) \
+	HANDLER(M) { \
+		const Function *callee = ip->Callee; \
+		prefix; \
+		CHECK(!HAS_FRAME(vm)); \
+		sp -= callee->NumArgs; \
+		SAVE_STATE(ip + 1); \
+		Frame *new_frame = &vm->CallStack.Frames[vm->CallStack.Depth++]; \
+		*new_frame = (Frame) { .Function = callee, .PC = 0, .BP = sp, .SP = sp + callee->NumArgs }; \
+		if (callee->Flags & FF_NATIVE) { \
+			RunNativeMethod(vm, new_frame); \
+		} \
+		else if (!HAS_STACK(vm, sp + callee->MaxStack)) { \
+			VM_Panic(vm, "stack overflow calling %s", callee->Name); \
+		} \
+		else if ((callee->Flags & FF_JIT) && VM_HasNativeStack(vm)) { \
+			u32 value = callee->Jit(vm, &mem[sp]); \
+			vm->CallStack.Depth--; \
+			if ((callee->Flags & FF_VOID) == 0) \
+				mem[frame->SP++] = value; \
+		} \
+		LOAD_STATE(); \
+		DISPATCH(); \
+	}
+
+// Pops the running frame, passing value to the caller if has_value
+#define RETURN(has_value, value) { \
+		bool has_value_ = (has_value); \
+		u32 value_ = has_value_ ? (value) : 0; \
+		if (--vm->CallStack.Depth == vm->ExitDepth) { \
+			vm->ReturnValue = value_; \
+			return; \
+		} \
+		if (has_value_) { \
+			Frame *caller = CURRENT_FRAME(vm); \
+			mem[caller->SP++] = value_; \
+		} \
+		LOAD_STATE(); \
+		DISPATCH(); \
+	}
+
+// Replaces the running frame's arguments with the top n values
+#define MOVE_ARGS(n) { \
+		u32 n_ = (n); \
+		for (u32 i = 0; i < n_; i++) \
+			mem[bp + i] = mem[sp - n_ + i]; \
+		sp = bp + n_; \
+	}
+
+#if VM_COMPUTED_GOTO
+static const void *const *Handlers;
+#endif
+
+void VM_Execute(VM *vm) {
+#if VM_COMPUTED_GOTO
+	static const void *LABELS[256] = {
+		[0 ... 255] = &&L_invalid,
+#define X(M, N) [M] = &&L_ ## M,
+		MNEMONICS
+#undef X
+	};
+
+	// VM_DecodeFunction calls in with no VM to fetch the label table
+	if (vm == NULL) {
+		Handlers = LABELS;
+		return;
+	}
+#endif
+
+	PANIC_IF(vm, vm->CallStack.Depth == 0);
+	PANIC_IF(vm, CURRENT_FRAME(vm)->Function->Flags & FF_NATIVE);
+	PANIC_IF(vm, CURRENT_FRAME(vm)->Function->Code == NULL);
+	PANIC_IF(vm, !HAS_STACK(vm, CURRENT_FRAME(vm)->BP + CURRENT_FRAME(vm)->Function->MaxStack));
+
+	u32 *mem = vm->Memory;
+	Frame *frame;
+	const Instruction *code, *ip;
+	u32 sp, bp;
+	LOAD_STATE();
+
+#if VM_COMPUTED_GOTO
+	DISPATCH();
+#else
+dispatch:
+	switch (ip->Opcode) {
+#endif
+
+	HANDLER(NOP) {
+		ip++;
+		DISPATCH();
+	}
+
+	HANDLER(PUSH) {
+		mem[sp++] = (u32) ip->Immediate;
+		ip++;
+		DISPATCH();
+	}
+
+	HANDLER(POP) {
+		sp--;
+		ip++;
+		DISPATCH();
+	}
+
+	HANDLER(DUP) {
+		mem[sp] = mem[sp - 1];
+		sp++;
+		ip++;
+		DISPATCH();
+	}
+
+	HANDLER(XCHG) {
+		u32 a = mem[sp - 1];
+		mem[sp - 1] = mem[sp - 2];
+		mem[sp - 2] = a;
+		ip++;
+		DISPATCH();
+	}
+
+	HANDLER(LOAD) {
+		mem[sp++] = mem[bp + ip->Immediate];
+		ip++;
+		DISPATCH();
+	}
+
+	CALL_HANDLER(CALL, )
+
+	// Same as CALL, but the callee and its code are already at hand
+	HANDLER(CALL_SELF) {
+		const Function *function = frame->Function;
+		CHECK(!HAS_FRAME(vm));
+		sp -= function->NumArgs;
+		SAVE_STATE(ip + 1);
+		frame = &vm->CallStack.Frames[vm->CallStack.Depth++];
+		*frame = (Frame) { .Function = function, .PC = 0, .BP = sp, .SP = sp + function->NumArgs };
+		if (!HAS_STACK(vm, sp + function->MaxStack))
+			VM_Panic(vm, "stack overflow calling %s", function->Name);
+		bp = sp;
+		sp += function->NumArgs;
+		ip = code;
+		DISPATCH();
+	}
+
+	HANDLER(RET) {
+		RETURN(sp > bp, mem[sp - 1]);
+	}
+
+	HANDLER(TAILCALL) {
+		const Function *callee = ip->Callee;
+		if (!HAS_STACK(vm, bp + callee->MaxStack)) {
+			SAVE_STATE(ip);
+			VM_Panic(vm, "stack overflow calling %s", callee->Name);
+		}
+		MOVE_ARGS(callee->NumArgs);
+		frame->Function = callee;
+		frame->PC = 0;
+		if ((callee->Flags & FF_JIT) && VM_HasNativeStack(vm)) {
+			frame->SP = sp;
+			u32 value = callee->Jit(vm, &mem[bp]);
+			RETURN((callee->Flags & FF_VOID) == 0, value);
+		}
+		code = callee->Code;
+		ip = code;
+		DISPATCH();
+	}
+
+	HANDLER(TAILCALL_SELF) {
+		MOVE_ARGS(frame->Function->NumArgs);
+		ip = code;
+		DISPATCH();
+	}
+
+	ARITHMETIC_HANDLER(ADD, +)
+	ARITHMETIC_HANDLER(SUB, -)
+	ARITHMETIC_HANDLER(MUL, *)
+
+	HANDLER(DIV) {
+		if (mem[sp - 1] == 0) {
+			SAVE_STATE(ip);
+			VM_Panic(vm, "division by zero");
+		}
+		mem[sp - 2] = mem[sp - 2] / mem[sp - 1];
+		sp--;
+		ip++;
+		DISPATCH();
+	}
+
+	BRANCH_HANDLER(BZ, mem[sp - 1] == 0)
+	BRANCH_HANDLER(BNZ, mem[sp - 1] != 0)
+	BRANCH_HANDLER(BNE, mem[sp - 2] != mem[sp - 1])
+
+	HANDLER(JMP) {
+		ip = &code[ip->Target];
+		DISPATCH();
+	}
+
+	COMPARE_HANDLER(EQ, ==)
+	COMPARE_HANDLER(NE, !=)
+	COMPARE_HANDLER(LT, <)
+	COMPARE_HANDLER(LTE, <=)
+
+	ARITHMETIC_IMMEDIATE_HANDLER(PUSH_ADD, +)
+	ARITHMETIC_IMMEDIATE_HANDLER(PUSH_SUB, -)
+
+	CALL_HANDLER(PUSH_CALL, mem[sp++] = (u32) ip->Immediate)
+	CALL_HANDLER(PUSH_ADD_CALL, mem[sp - 1] += (u32) ip->Immediate)
+	CALL_HANDLER(PUSH_SUB_CALL, mem[sp - 1] -= (u32) ip->Immediate)
+
+	COMPARE_BRANCH_HANDLER(PUSH_EQ_BZ, ==)
+	COMPARE_BRANCH_HANDLER(PUSH_NE_BZ, !=)
+	COMPARE_BRANCH_HANDLER(PUSH_LT_BZ, <)
+	COMPARE_BRANCH_HANDLER(PUSH_LTE_BZ, <=)
+
+	HANDLER(HALT) {
+		SAVE_STATE(ip + 1);
+		vm->Flags |= VMFLAG_HALT;
+		return;
+	}
+
+	HANDLER(PANIC) {
+		SAVE_STATE(ip);
+		VM_Panic(vm, "software panic");
+	}
+
+#if !VM_COMPUTED_GOTO
+	default:
+#else
+	L_invalid:
+#endif
+		SAVE_STATE(ip);
+		VM_Panic(vm, "unrecognized opcode: %02Xh", ip->Opcode);
+
+#if !VM_COMPUTED_GOTO
+	}
+#endif
+}
+
+void VM_DecodeFunction(const Module *module, Function *function, const s32 *depths) {
+#if VM_COMPUTED_GOTO
+	if (Handlers == NULL)
+		VM_Execute(NULL);
+#endif
+
+	const u8 *bytes = function->Body.Bytes;
+	u32 length = function->Body.Length;
+
+	u32 count = 0;
+	u32 *index = malloc(length * sizeof(u32));
+	for (u32 pc = 0; pc < length; pc += INSTRUCTION_SIZE(bytes[pc]))
+		index[pc] = count++;
+
+	// One extra slot past the end, so that saving "the next instruction" after
+	// a trailing HALT still has a PC to record
+	Instruction *code = calloc(count + 1, sizeof(Instruction));
+	u32 i = 0;
+	for (u32 pc = 0; pc < length; pc += INSTRUCTION_SIZE(bytes[pc]), i++) {
+		Instruction *instr = &code[i];
+		u8 opcode = bytes[pc];
+		u32 next = pc + INSTRUCTION_SIZE(opcode);
+		instr->Opcode = opcode;
+		instr->PC = pc;
+		instr->Depth = depths[pc];
+#if VM_COMPUTED_GOTO
+		instr->Handler = Handlers[opcode];
+#endif
+		// unreachable instructions never run, and the verifier didn't check their operands
+		if (depths[pc] < 0)
+			continue;
+		switch (opcode) {
+			case PUSH:
+			case PUSH_ADD:
+			case PUSH_SUB:
+				instr->Immediate = *(const s32 *) &bytes[pc + 1];
+				break;
+			case LOAD:
+				instr->Immediate = bytes[pc + 1];
+				break;
+			case PUSH_CALL:
+			case PUSH_ADD_CALL:
+			case PUSH_SUB_CALL:
+				instr->Immediate = *(const s32 *) &bytes[pc + 1];
+				// fallthrough
+			case CALL:
+				instr->Callee = &module->Functions[*(const u32 *) &bytes[next - 4]];
+				break;
+			case CALL_SELF:
+			case TAILCALL:
+			case TAILCALL_SELF:
+				instr->Callee = &module->Functions[*(const u32 *) &bytes[pc + 1]];
+				break;
+			case PUSH_EQ_BZ:
+			case PUSH_NE_BZ:
+			case PUSH_LT_BZ:
+			case PUSH_LTE_BZ:
+				instr->Immediate = *(const s32 *) &bytes[pc + 1];
+				// fallthrough
+			case BZ:
+			case BNZ:
+			case BNE:
+			case JMP:
+				instr->Target = index[next + *(const s32 *) &bytes[next - 4]];
+				break;
+			default:
+				break;
+		}
+	}
+	code[count].PC = length;
+
+	function->Code = code;
+	function->CodeIndex = index;
+}
+
+u32 VM_ExecuteCall(VM *vm) {
+	u32 exitDepth = vm->ExitDepth;
+	vm->ExitDepth = vm->CallStack.Depth - 1;
+	if ((vm->Flags & VMFLAG_REGISTER) && (CURRENT_FRAME(vm)->Function->Flags & FF_REGISTER))
+		VM_ExecuteRegisters(vm);
+	else
+		VM_Execute(vm);
+	vm->ExitDepth = exitDepth;
+	return vm->ReturnValue;
+}
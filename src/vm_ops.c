@@ -14,9 +14,15 @@ FETCH_TYPES
 #undef X
 #undef FETCH_TYPES
 
+#define X(M, N) void op_ ## M(VM *vm, Frame *frame);
+	MNEMONICS
+#undef X
+
 void VM_Panic(const VM *vm, const char *format, ...);
 
-u32 Load(const VM *vm, u32 addr);
+const char *GetMnemonic(Opcode opcode);
+
+u32 Load(VM *vm, u32 addr);
 
 void Store(VM *vm, u32 addr, u32 value);
 
@@ -30,20 +36,20 @@ void op_NOP(VM *vm, Frame *frame) {
 
 void op_PUSH(VM *vm, Frame *frame) {
 	s32 operand = Fetch_s32(frame);
-	TRACE("%d", operand);
+	LOG(VM, Debug, "%d", operand);
 	Push(vm, operand);
 	frame->PC += 5;
 }
 
 void op_POP(VM *vm, Frame *frame) {
 	u32 value = Pop(vm);
-	TRACE("[=%d]", value);
+	LOG(VM, Debug, "[=%d]", value);
 	frame->PC++;
 }
 
 void op_DUP(VM *vm, Frame *frame) {
 	u32 value = Load(vm, frame->SP - 1);
-	TRACE("[=%d]", value);
+	LOG(VM, Debug, "[=%d]", value);
 	Store(vm, frame->SP, value);
 	frame->SP++;
 	frame->PC++;
@@ -57,36 +63,47 @@ void op_XCHG(VM *vm, Frame *frame) {
 	frame->PC++;	
 }
 
+void op_LOAD(VM *vm, Frame *frame) {
+	u8 slot = Fetch_u8(frame);
+	PANIC_IF(vm, slot >= frame->Function->NumArgs);
+	u32 value = Load(vm, ARG_ADDRESS(frame, slot));
+	LOG(VM, Debug, "%d [=%d]", slot, value);
+	Push(vm, value);
+	frame->PC += 2;
+}
+
 #define IMPLEMENT_COMPARE(mnemonic, x, oper, y) \
 	void op_ ## mnemonic(VM *vm, Frame *frame) { \
 		u32 res = x oper y; \
-		TRACE("[=%d]", res); \
+		LOG(VM, Debug, "[=%d]", res); \
 		Store(vm, frame->SP - 2, res); \
 		frame->SP--; \
 		frame->PC += 1; \
 	}
 
+IMPLEMENT_COMPARE(EQ,  Load(vm, frame->SP - 2), ==, Load(vm, frame->SP - 1));
+IMPLEMENT_COMPARE(NE,  Load(vm, frame->SP - 2), !=, Load(vm, frame->SP - 1));
 IMPLEMENT_COMPARE(LT,  Load(vm, frame->SP - 2), <,  Load(vm, frame->SP - 1));
 IMPLEMENT_COMPARE(LTE, Load(vm, frame->SP - 2), <=, Load(vm, frame->SP - 1));
 
 #define IMPLEMENT_BRANCH(mnemonic, x, oper, y) \
 	void op_ ## mnemonic(VM *vm, Frame *frame) { \
 		bool branch = x oper y; \
-		s8 offset = Fetch_s8(frame); \
-		u32 target = frame->PC + 2 + offset; \
+		s32 offset = Fetch_s32(frame); \
+		u32 target = frame->PC + 5 + offset; \
 		if (offset < 0) { \
-			TRACE("-%Xh [%04Xh,", -offset, target); \
+			LOG(VM, Debug, "-%Xh [%04Xh,", -offset, target); \
 		} \
 		else { \
-			TRACE("+%Xh [%04Xh,", offset, target); \
+			LOG(VM, Debug, "+%Xh [%04Xh,", offset, target); \
 		} \
-		frame->PC += 2; \
+		frame->PC += 5; \
 		if (branch) { \
-			TRACE("y]"); \
+			LOG(VM, Debug, "y]"); \
 			frame->PC = target; \
 		} \
 		else { \
-			TRACE("n]"); \
+			LOG(VM, Debug, "n]"); \
 		} \
 		frame->SP--; \
 	}
@@ -95,12 +112,20 @@ IMPLEMENT_BRANCH(BZ,  Load(vm, frame->SP-1), ==, 0);
 IMPLEMENT_BRANCH(BNZ, Load(vm, frame->SP-1), !=, 0);
 IMPLEMENT_BRANCH(BNE, Load(vm, frame->SP-2), !=, Load(vm, frame->SP-1));
 
+void op_JMP(VM *vm, Frame *frame) {
+	s32 offset = Fetch_s32(frame);
+	u32 target = frame->PC + 5 + offset;
+	LOG(VM, Debug, "%+Xh [%04Xh]", offset, target);
+	frame->PC = target;
+}
+
+// Values are u32, so results wrap rather than overflow
 #define IMPLEMENT_ARITHMETIC(mnemonic,oper) \
 	void op_ ## mnemonic(VM *vm, Frame *frame) { \
-		s32 a = Load(vm, frame->SP - 2); \
-		s32 b = Load(vm, frame->SP - 1); \
-		s32 value = a oper b; \
-		TRACE("[=%d]", value); \
+		u32 a = Load(vm, frame->SP - 2); \
+		u32 b = Load(vm, frame->SP - 1); \
+		u32 value = a oper b; \
+		LOG(VM, Debug, "[=%u]", value); \
 		Store(vm, frame->SP - 2, value); \
 		frame->SP -= 1; \
 		frame->PC += 1; \
@@ -109,7 +134,18 @@ IMPLEMENT_BRANCH(BNE, Load(vm, frame->SP-2), !=, Load(vm, frame->SP-1));
 IMPLEMENT_ARITHMETIC(ADD, +);
 IMPLEMENT_ARITHMETIC(SUB, -);
 IMPLEMENT_ARITHMETIC(MUL, *);
-IMPLEMENT_ARITHMETIC(DIV, /);
+
+void op_DIV(VM *vm, Frame *frame) {
+	u32 a = Load(vm, frame->SP - 2);
+	u32 b = Load(vm, frame->SP - 1);
+	if (b == 0)
+		VM_Panic(vm, "division by zero");
+	u32 value = a / b;
+	LOG(VM, Debug, "[=%u]", value);
+	Store(vm, frame->SP - 2, value);
+	frame->SP -= 1;
+	frame->PC += 1;
+}
 
 void op_CALL(VM *vm, Frame *frame) {
 	// layout of stack right before executing call instruction:
@@ -122,7 +158,7 @@ void op_CALL(VM *vm, Frame *frame) {
 	// [arg1]
 	// [arg0]
 
-	PANIC_IF(vm, vm->CallStack.Depth == MAX_FRAMES);
+	PANIC_IF(vm, !HAS_FRAME(vm));
 
 	// Get the callee function index and check it
 	u32 fi = Fetch_u32(frame);
@@ -140,20 +176,73 @@ void op_CALL(VM *vm, Frame *frame) {
 	new_frame->PC = 0;
 	new_frame->BP = frame->SP;
 	new_frame->SP = new_frame->BP + new_frame->Function->NumArgs;
+	if (new_function->Flags & FF_VERIFIED)
+		PANIC_IF(vm, !HAS_STACK(vm, new_frame->BP + new_function->MaxStack));
 
-	TRACE("%s ", new_function->Name);
+	LOG(VM, Debug, "%s ", new_function->Name);
 	for (u32 i = 0; i < new_frame->Function->NumArgs; i++)
-		TRACE("%d", Load(vm, new_frame->BP + i));
+		LOG(VM, Debug, "%d", Load(vm, new_frame->BP + i));
 
 	// Increment caller's PC
 	frame->PC += 5;
 }
 
+void op_CALL_SELF(VM *vm, Frame *frame) {
+	PANIC_IF(vm, !HAS_FRAME(vm));
+
+	// No index to check, the callee is the running function
+	const Function *function = frame->Function;
+	PANIC_IF(vm, function->NumArgs > frame->SP - frame->BP);
+	frame->SP -= function->NumArgs;
+
+	Frame *new_frame = &vm->CallStack.Frames[vm->CallStack.Depth++];
+	*new_frame = (Frame) { .Function = function, .PC = 0, .BP = frame->SP, .SP = frame->SP + function->NumArgs };
+	PANIC_IF(vm, !HAS_STACK(vm, new_frame->BP + function->MaxStack));
+
+	LOG(VM, Debug, "%s ", function->Name);
+	for (u32 i = 0; i < function->NumArgs; i++)
+		LOG(VM, Debug, "%d", Load(vm, new_frame->BP + i));
+
+	frame->PC += 5;
+}
+
+// Moves the callee's arguments down over the running frame's and restarts it
+// as the callee
+static void TailCall(VM *vm, Frame *frame, const Function *callee) {
+	PANIC_IF(vm, callee->NumArgs > frame->SP - frame->BP);
+	if (callee->Flags & FF_VERIFIED)
+		PANIC_IF(vm, !HAS_STACK(vm, frame->BP + callee->MaxStack));
+
+	u32 base = frame->SP - callee->NumArgs;
+	for (u32 i = 0; i < callee->NumArgs; i++)
+		Store(vm, ARG_ADDRESS(frame, i), Load(vm, base + i));
+	frame->SP = frame->BP + callee->NumArgs;
+	frame->Function = callee;
+	frame->PC = 0;
+
+	LOG(VM, Debug, "%s ", callee->Name);
+	for (u32 i = 0; i < callee->NumArgs; i++)
+		LOG(VM, Debug, "%d", Load(vm, ARG_ADDRESS(frame, i)));
+}
+
+void op_TAILCALL(VM *vm, Frame *frame) {
+	u32 fi = Fetch_u32(frame);
+	if (fi >= vm->Module->NumFunctions)
+		VM_Panic(vm, "Function index %d is out of bounds 0,%d", fi, vm->Module->NumFunctions);
+	const Function *callee = &vm->Module->Functions[fi];
+	PANIC_IF(vm, callee->Flags & FF_NATIVE);
+	TailCall(vm, frame, callee);
+}
+
+void op_TAILCALL_SELF(VM *vm, Frame *frame) {
+	TailCall(vm, frame, frame->Function);
+}
+
 void op_RET(VM *vm, Frame *frame) {
 	vm->CallStack.Depth -= 1;
 	if (frame->SP > frame->BP) {
 		u32 val = Load(vm, frame->SP - 1); // load return value
-		TRACE("[=%d]", val);
+		LOG(VM, Debug, "[=%d]", val);
 		Frame *caller = CURRENT_FRAME(vm);
 		Store(vm, caller->SP++, val); // push it onto caller's stack
 	}
@@ -171,4 +260,29 @@ void op_PANIC(VM *vm, Frame *frame) {
 void op_BRK(VM *vm, Frame *frame) {
 	vm->Flags |= VMFLAG_BREAKPOINT;
 	frame->PC++;
-}
\ No newline at end of file
+}
+
+static void (*const HANDLERS[NUM_OPCODES])(VM *, Frame *) = {
+#define X(M, N) op_ ## M,
+	MNEMONICS
+#undef X
+};
+
+// A superinstruction steps through the handlers of the sequence it replaces.
+// Its operands sit where they did before fusion, so each handler finds its
+// own at PC+1 as it advances.
+static void RunSequence(VM *vm, Frame *frame, const u8 *sequence) {
+	for (u32 i = 0; i < MAX_SEQUENCE && sequence[i] != NOP; i++) {
+		if (i > 0)
+			LOG(VM, Debug, "; %s ", GetMnemonic(sequence[i]));
+		HANDLERS[sequence[i]](vm, frame);
+	}
+}
+
+#define X(M, ...) \
+	void op_ ## M(VM *vm, Frame *frame) { \
+		static const u8 sequence[MAX_SEQUENCE] = { __VA_ARGS__ }; \
+		RunSequence(vm, frame, sequence); \
+	}
+	SUPERINSTRUCTIONS
+#undef X
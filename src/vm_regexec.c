@@ -0,0 +1,274 @@
+#include "vm.h"
+#include "regcode.h"
+#include "trace.h"
+
+void RunNativeMethod(VM *vm, Frame *frame);
+
+// The register bytecode loop, the counterpart of VM_Execute for functions
+// translated by Module_TranslateRegisters. Registers are the frame's stack
+// slots, so r points at Memory[BP] and frames, calls and returns work exactly
+// as in the stack loop; Frame.PC is still a byte offset into Body, mapped back
+// through RegIndex when a frame is resumed. As with the stack loop, everything
+// here is verified code and stack memory is checked once per call.
+//
+// Nothing tracks the operand stack depth here, so a frame's SP is only
+// meaningful around calls; a panic reports the whole register file.
+
+#define SAVE_STATE(at) (frame->PC = (at)->PC, frame->SP = frame->BP + frame->Function->MaxStack)
+
+#define LOAD_STATE() \
+	(frame = CURRENT_FRAME(vm), \
+	 code = frame->Function->RegCode, \
+	 ip = &code[frame->Function->RegIndex[frame->PC]], \
+	 r = &vm->Memory[frame->BP])
+
+#define CHECK(cond) { if (cond) { SAVE_STATE(ip); VM_Panic(vm, #cond); } }
+
+#if VM_COMPUTED_GOTO
+#define DISPATCH() goto *ip->Handler
+#define HANDLER(M) L_ ## M:
+#else
+#define DISPATCH() goto dispatch
+#define HANDLER(M) case REG_ ## M:
+#endif
+
+// Values are u32, so results wrap rather than overflow
+#define ARITHMETIC_HANDLER(M, oper) \
+	HANDLER(M) { \
+		r[ip->A] = r[ip->B] oper r[ip->C]; \
+		ip++; \
+		DISPATCH(); \
+	}
+
+#define ARITHMETIC_IMMEDIATE_HANDLER(M, oper) \
+	HANDLER(M) { \
+		r[ip->A] = r[ip->B] oper (u32) ip->Immediate; \
+		ip++; \
+		DISPATCH(); \
+	}
+
+#define COMPARE_HANDLER(M, oper) \
+	HANDLER(M) { \
+		r[ip->A] = r[ip->B] oper r[ip->C]; \
+		ip++; \
+		DISPATCH(); \
+	}
+
+#define BRANCH_HANDLER(M, cond) \
+	HANDLER(M) { \
+		ip = (cond) ? &code[ip->Target] : ip + 1; \
+		DISPATCH(); \
+	}
+
+#if VM_COMPUTED_GOTO
+static const void *const *Handlers;
+#endif
+
+void VM_ExecuteRegisters(VM *vm) {
+#if VM_COMPUTED_GOTO
+	static const void *LABELS[NUM_REG_OPCODES] = {
+#define X(M) [REG_ ## M] = &&L_ ## M,
+		REG_MNEMONICS
+#undef X
+	};
+
+	// VM_LinkRegisterCode calls in with no VM to fetch the label table
+	if (vm == NULL) {
+		Handlers = LABELS;
+		return;
+	}
+#endif
+
+	PANIC_IF(vm, vm->CallStack.Depth == 0);
+	PANIC_IF(vm, (CURRENT_FRAME(vm)->Function->Flags & FF_REGISTER) == 0);
+	PANIC_IF(vm, !HAS_STACK(vm, CURRENT_FRAME(vm)->BP + CURRENT_FRAME(vm)->Function->MaxStack));
+
+	u32 *mem = vm->Memory;
+	Frame *frame;
+	const RegInstruction *code, *ip;
+	u32 *r;
+	LOAD_STATE();
+
+#if VM_COMPUTED_GOTO
+	DISPATCH();
+#else
+dispatch:
+	switch (ip->Opcode) {
+#endif
+
+	HANDLER(MOV) {
+		r[ip->A] = r[ip->B];
+		ip++;
+		DISPATCH();
+	}
+
+	HANDLER(MOVI) {
+		r[ip->A] = (u32) ip->Immediate;
+		ip++;
+		DISPATCH();
+	}
+
+	HANDLER(SWAP) {
+		u32 a = r[ip->A];
+		r[ip->A] = r[ip->B];
+		r[ip->B] = a;
+		ip++;
+		DISPATCH();
+	}
+
+	ARITHMETIC_HANDLER(ADD, +)
+	ARITHMETIC_HANDLER(SUB, -)
+	ARITHMETIC_HANDLER(MUL, *)
+
+	HANDLER(DIV) {
+		if (r[ip->C] == 0) {
+			SAVE_STATE(ip);
+			VM_Panic(vm, "division by zero");
+		}
+		r[ip->A] = r[ip->B] / r[ip->C];
+		ip++;
+		DISPATCH();
+	}
+
+	ARITHMETIC_IMMEDIATE_HANDLER(ADDI, +)
+	ARITHMETIC_IMMEDIATE_HANDLER(SUBI, -)
+
+	COMPARE_HANDLER(EQ, ==)
+	COMPARE_HANDLER(NE, !=)
+	COMPARE_HANDLER(LT, <)
+	COMPARE_HANDLER(LTE, <=)
+
+	BRANCH_HANDLER(BZ, r[ip->A] == 0)
+	BRANCH_HANDLER(BNZ, r[ip->A] != 0)
+	BRANCH_HANDLER(BEQ, r[ip->A] == r[ip->B])
+	BRANCH_HANDLER(BNE, r[ip->A] != r[ip->B])
+	BRANCH_HANDLER(BLT, r[ip->A] < r[ip->B])
+	BRANCH_HANDLER(BLTE, r[ip->A] <= r[ip->B])
+	BRANCH_HANDLER(BGT, r[ip->A] > r[ip->B])
+	BRANCH_HANDLER(BGTE, r[ip->A] >= r[ip->B])
+	BRANCH_HANDLER(BEQI, r[ip->A] == (u32) ip->Immediate)
+	BRANCH_HANDLER(BNEI, r[ip->A] != (u32) ip->Immediate)
+	BRANCH_HANDLER(BLTI, r[ip->A] < (u32) ip->Immediate)
+	BRANCH_HANDLER(BLTEI, r[ip->A] <= (u32) ip->Immediate)
+	BRANCH_HANDLER(BGTI, r[ip->A] > (u32) ip->Immediate)
+	BRANCH_HANDLER(BGTEI, r[ip->A] >= (u32) ip->Immediate)
+
+	HANDLER(JMP) {
+		ip = &code[ip->Target];
+		DISPATCH();
+	}
+
+	// Reuses the frame whatever code the callee runs, as VM_Execute's TAILCALL
+	// does, so a chain of tail calls never runs out of frames
+	HANDLER(TAILCALL) {
+		const Function *callee = ip->Callee;
+		if (!HAS_STACK(vm, frame->BP + callee->MaxStack)) {
+			SAVE_STATE(ip);
+			VM_Panic(vm, "stack overflow calling %s", callee->Name);
+		}
+		for (u32 i = 0; i < callee->NumArgs; i++)
+			r[i] = r[ip->A + i];
+		frame->Function = callee;
+		frame->PC = 0;
+		frame->SP = frame->BP + callee->NumArgs;
+		u32 value;
+		if ((callee->Flags & FF_JIT) && VM_HasNativeStack(vm)) {
+			value = callee->Jit(vm, r);
+			vm->CallStack.Depth--;
+		}
+		else if (callee->Flags & FF_REGISTER) {
+			code = callee->RegCode;
+			ip = code;
+			DISPATCH();
+		}
+		else {
+			// the stack loop's RET pops the frame
+			value = VM_ExecuteCall(vm);
+		}
+		if (vm->CallStack.Depth == vm->ExitDepth) {
+			vm->ReturnValue = value;
+			return;
+		}
+		if ((callee->Flags & FF_VOID) == 0)
+			mem[CURRENT_FRAME(vm)->SP++] = value;
+		LOAD_STATE();
+		DISPATCH();
+	}
+
+	HANDLER(CALL) {
+		const Function *callee = ip->Callee;
+		u32 base = frame->BP + ip->A;
+		CHECK(!HAS_FRAME(vm));
+		frame->PC = ip[1].PC;
+		frame->SP = base;
+		Frame *new_frame = &vm->CallStack.Frames[vm->CallStack.Depth++];
+		*new_frame = (Frame) { .Function = callee, .PC = 0, .BP = base, .SP = base + callee->NumArgs };
+		if (callee->Flags & FF_NATIVE) {
+			RunNativeMethod(vm, new_frame);
+		}
+		else if (!HAS_STACK(vm, base + callee->MaxStack)) {
+			VM_Panic(vm, "stack overflow calling %s", callee->Name);
+		}
+		else if ((callee->Flags & FF_JIT) && VM_HasNativeStack(vm)) {
+			u32 value = callee->Jit(vm, &mem[base]);
+			vm->CallStack.Depth--;
+			if ((callee->Flags & FF_VOID) == 0)
+				mem[base] = value;
+		}
+		else if ((callee->Flags & FF_REGISTER) == 0) {
+			u32 value = VM_ExecuteCall(vm);
+			if ((callee->Flags & FF_VOID) == 0)
+				mem[base] = value;
+		}
+		LOAD_STATE();
+		DISPATCH();
+	}
+
+	HANDLER(RET) {
+		u32 value = r[ip->A];
+		if (--vm->CallStack.Depth == vm->ExitDepth) {
+			vm->ReturnValue = value;
+			return;
+		}
+		Frame *caller = CURRENT_FRAME(vm);
+		mem[caller->SP++] = value;
+		LOAD_STATE();
+		DISPATCH();
+	}
+
+	HANDLER(RETV) {
+		if (--vm->CallStack.Depth == vm->ExitDepth) {
+			vm->ReturnValue = 0;
+			return;
+		}
+		LOAD_STATE();
+		DISPATCH();
+	}
+
+	HANDLER(HALT) {
+		SAVE_STATE(ip);
+		vm->Flags |= VMFLAG_HALT;
+		return;
+	}
+
+	HANDLER(PANIC) {
+		SAVE_STATE(ip);
+		VM_Panic(vm, "software panic");
+	}
+
+#if !VM_COMPUTED_GOTO
+	default:
+		SAVE_STATE(ip);
+		VM_Panic(vm, "unrecognized register opcode: %02Xh", ip->Opcode);
+	}
+#endif
+}
+
+void VM_LinkRegisterCode(RegInstruction *code, u32 count) {
+#if VM_COMPUTED_GOTO
+	if (Handlers == NULL)
+		VM_ExecuteRegisters(NULL);
+	for (u32 i = 0; i < count; i++)
+		code[i].Handler = Handlers[code[i].Opcode];
+#endif
+}
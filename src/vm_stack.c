@@ -0,0 +1,134 @@
+#include "vm.h"
+#include "trace.h"
+
+// A VM's stack and call stack each live in their own reservation of address
+// space, sized by its limits plus a guard page that is never committed. Only
+// the initial sizes are committed up front and the rest a piece at a time as
+// the stacks grow, so an idle VM costs a page or two. Nothing ever moves, so
+// the interpreter loops and JIT code keep raw pointers into Memory across
+// calls.
+
+#ifdef _WIN32
+extern void *VirtualAlloc(void *address, size_t size, u32 type, u32 protect);
+extern int VirtualFree(void *address, size_t size, u32 type);
+#define MEM_COMMIT 0x1000
+#define MEM_RESERVE 0x2000
+#define MEM_RELEASE 0x8000
+#define PAGE_NOACCESS 0x01
+#define PAGE_READWRITE 0x04
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static size_t PageSize() {
+#ifdef _WIN32
+	return 4096;
+#else
+	static size_t size;
+	if (size == 0)
+		size = (size_t) sysconf(_SC_PAGESIZE);
+	return size;
+#endif
+}
+
+static size_t RoundToPages(size_t bytes) {
+	size_t page = PageSize();
+	return (bytes + page - 1) / page * page;
+}
+
+// Bytes reserved for max elements of the given size, guard page included
+static size_t ReservedSize(u32 max, size_t size) {
+	return RoundToPages((size_t) max * size) + PageSize();
+}
+
+static void *Reserve(size_t bytes) {
+#ifdef _WIN32
+	return VirtualAlloc(NULL, bytes, MEM_RESERVE, PAGE_NOACCESS);
+#else
+	void *p = mmap(NULL, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+#endif
+}
+
+static bool Commit(void *address, size_t bytes) {
+#ifdef _WIN32
+	return VirtualAlloc(address, bytes, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+	return mprotect(address, bytes, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+static void Release(void *address, size_t bytes) {
+#ifdef _WIN32
+	(void) bytes;
+	VirtualFree(address, 0, MEM_RELEASE);
+#else
+	munmap(address, bytes);
+#endif
+}
+
+// Commits room for at least `needed` elements, doubling what is committed if
+// that is more. Returns the new number of elements, or 0 past the limit.
+static u32 Grow(void *base, u32 committed, u32 needed, u32 max, size_t size) {
+	if (needed > max)
+		return 0;
+	uint64_t count = (uint64_t) committed * 2;
+	if (count < needed)
+		count = needed;
+	if (count > max)
+		count = max;
+	size_t from = RoundToPages((size_t) committed * size);
+	size_t to = RoundToPages((size_t) count * size);
+	if (to > from && !Commit((u8 *) base + from, to - from))
+		return 0;
+	// whole pages are committed, so use all of them
+	count = to / size;
+	return (u32) (count < max ? count : max);
+}
+
+bool VM_ReserveStacks(VM *vm) {
+	const VMLimits *limits = &vm->Limits;
+	vm->Memory = Reserve(ReservedSize(limits->MaxMemory, sizeof(u32)));
+	vm->CallStack.Frames = Reserve(ReservedSize(limits->MaxFrames, sizeof(Frame)));
+	if (vm->Memory && vm->CallStack.Frames) {
+		u32 memory = INITIAL_MEMORY_SIZE < limits->MaxMemory ? INITIAL_MEMORY_SIZE : limits->MaxMemory;
+		u32 frames = INITIAL_FRAMES < limits->MaxFrames ? INITIAL_FRAMES : limits->MaxFrames;
+		vm->MemorySize = Grow(vm->Memory, 0, memory, limits->MaxMemory, sizeof(u32));
+		vm->CallStack.Capacity = Grow(vm->CallStack.Frames, 0, frames, limits->MaxFrames, sizeof(Frame));
+		if (vm->MemorySize > 0 && vm->CallStack.Capacity > 0)
+			return true;
+	}
+	ERROR("[vm] could not reserve %u words of stack and %u frames", limits->MaxMemory, limits->MaxFrames);
+	VM_ReleaseStacks(vm);
+	return false;
+}
+
+void VM_ReleaseStacks(VM *vm) {
+	if (vm->Memory)
+		Release(vm->Memory, ReservedSize(vm->Limits.MaxMemory, sizeof(u32)));
+	if (vm->CallStack.Frames)
+		Release(vm->CallStack.Frames, ReservedSize(vm->Limits.MaxFrames, sizeof(Frame)));
+	vm->Memory = NULL;
+	vm->CallStack.Frames = NULL;
+	vm->MemorySize = 0;
+	vm->CallStack.Capacity = 0;
+}
+
+bool VM_GrowMemory(VM *vm, u32 size) {
+	u32 count = Grow(vm->Memory, vm->MemorySize, size, vm->Limits.MaxMemory, sizeof(u32));
+	if (count == 0)
+		return false;
+	LOG(VM, Info, "[vm] stack grown to %u words", count);
+	vm->MemorySize = count;
+	return true;
+}
+
+bool VM_GrowCallStack(VM *vm) {
+	u32 count = Grow(vm->CallStack.Frames, vm->CallStack.Capacity, vm->CallStack.Depth + 1, vm->Limits.MaxFrames, sizeof(Frame));
+	if (count == 0)
+		return false;
+	LOG(VM, Info, "[vm] call stack grown to %u frames", count);
+	vm->CallStack.Capacity = count;
+	return true;
+}